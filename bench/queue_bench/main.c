@@ -0,0 +1,229 @@
+#include <time.h>
+#include <stdio.h>
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "queue.h"
+#include "lfqueue.h"
+
+#define PAGE_SIZE           4096
+#define MAX_PRODUCERS       64
+#define LATENCY_PERIOD      16      // measure latency of one in every 16 operations
+
+// the same layout as 'struct interact_sample'
+struct sample
+{
+    uint32_t gfn: 29;
+    uint32_t xwr: 3;
+};
+
+// shared by all producers and the consumer of one run
+struct run
+{
+    int lockfree;               // use 'struct lfqueue' or 'struct queue'
+    size_t producer_count;      // count of producer threads
+    size_t ops_per_producer;    // how many entries each producer adds
+    pthread_barrier_t barrier;  // start all threads at the same time
+    // for 'struct queue'
+    struct queue queue;
+    pthread_spinlock_t lock;
+    // for 'struct lfqueue', one queue per producer
+    struct lfqueue lfqueues[MAX_PRODUCERS];
+};
+
+struct producer
+{
+    pthread_t thread;
+    struct run* run;
+    size_t id;
+    uint64_t* latencies;        // sampled latencies in ns
+    size_t latency_count;
+};
+
+static void* alloc_page(void* privdata)
+{
+    void* page;
+    return posix_memalign(&page, PAGE_SIZE, PAGE_SIZE) ? NULL : page;
+}
+
+static void free_page(void* page, void* privdata)
+{
+    free(page);
+}
+
+static uint64_t get_current_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void add_one(struct run* run, size_t id, uint32_t gfn)
+{
+    struct sample* sample;
+    if(run->lockfree)
+    {
+        struct lfqueue* queue = run->lfqueues + id;
+        sample = lfqueue_add(queue);
+        assert(sample);
+        sample->gfn = gfn;
+        sample->xwr = 2;
+        lfqueue_commit(queue);
+    }
+    else
+    {
+        pthread_spin_lock(&(run->lock));
+        sample = queue_add(&(run->queue));
+        assert(sample);
+        sample->gfn = gfn;
+        sample->xwr = 2;
+        pthread_spin_unlock(&(run->lock));
+    }
+}
+
+static void* producer_main(void* arg)
+{
+    struct producer* producer = arg;
+    struct run* run = producer->run;
+    pthread_barrier_wait(&(run->barrier));
+    for(size_t i = 0; i < run->ops_per_producer; i++)
+    {
+        if(i % LATENCY_PERIOD == 0)
+        {
+            uint64_t begin = get_current_ns();
+            add_one(run, producer->id, (uint32_t)i);
+            producer->latencies[producer->latency_count++] = get_current_ns() - begin;
+        }
+        else
+            add_one(run, producer->id, (uint32_t)i);
+    }
+    return NULL;
+}
+
+static size_t take_some(struct run* run)
+{
+    size_t count = 0;
+    if(run->lockfree)
+    {
+        for(size_t i = 0; i < run->producer_count; i++)
+            while(lfqueue_take(run->lfqueues + i))
+                count++;
+    }
+    else
+    {
+        // do not hold the lock for long, as interact_read() takes one entry at a time
+        pthread_spin_lock(&(run->lock));
+        while(count < 64 && queue_take(&(run->queue)))
+            count++;
+        pthread_spin_unlock(&(run->lock));
+    }
+    return count;
+}
+
+static int compare_u64(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static int do_run(int lockfree, size_t producer_count, size_t ops_per_producer)
+{
+    struct run* run;
+    if(posix_memalign((void**)&run, CACHELINE_SIZE, sizeof(struct run)))
+        ERROR0(-ENOMEM, "posix_memalign() failed");
+    run->lockfree = lockfree;
+    run->producer_count = producer_count;
+    run->ops_per_producer = ops_per_producer;
+    pthread_barrier_init(&(run->barrier), NULL, producer_count + 1);
+    if(lockfree)
+    {
+        for(size_t i = 0; i < producer_count; i++)
+            if(lfqueue_init(run->lfqueues + i, sizeof(struct sample), PAGE_SIZE,
+                alloc_page, free_page, NULL))
+                ERROR0(-ENOMEM, "lfqueue_init() failed");
+    }
+    else
+    {
+        if(queue_init(&(run->queue), sizeof(struct sample), PAGE_SIZE,
+            alloc_page, free_page, NULL))
+            ERROR0(-ENOMEM, "queue_init() failed");
+        pthread_spin_init(&(run->lock), PTHREAD_PROCESS_PRIVATE);
+    }
+    struct producer producers[MAX_PRODUCERS];
+    size_t max_latency_count = (ops_per_producer + LATENCY_PERIOD - 1) / LATENCY_PERIOD;
+    for(size_t i = 0; i < producer_count; i++)
+    {
+        producers[i].run = run;
+        producers[i].id = i;
+        producers[i].latencies = malloc(sizeof(uint64_t) * max_latency_count);
+        producers[i].latency_count = 0;
+        if(!producers[i].latencies)
+            ERROR0(-ENOMEM, "malloc() failed");
+        pthread_create(&(producers[i].thread), NULL, producer_main, producers + i);
+    }
+    // this thread is the only consumer, as read() is in the module
+    pthread_barrier_wait(&(run->barrier));
+    uint64_t begin = get_current_ns();
+    size_t total = producer_count * ops_per_producer, taken = 0;
+    while(taken < total)
+        taken += take_some(run);
+    uint64_t elapsed = get_current_ns() - begin;
+    // merge sampled latencies of all producers
+    uint64_t* latencies = malloc(sizeof(uint64_t) * max_latency_count * producer_count);
+    size_t latency_count = 0;
+    if(!latencies)
+        ERROR0(-ENOMEM, "malloc() failed");
+    for(size_t i = 0; i < producer_count; i++)
+    {
+        pthread_join(producers[i].thread, NULL);
+        memcpy(latencies + latency_count, producers[i].latencies,
+            sizeof(uint64_t) * producers[i].latency_count);
+        latency_count += producers[i].latency_count;
+        free(producers[i].latencies);
+    }
+    qsort(latencies, latency_count, sizeof(uint64_t), compare_u64);
+    printf("%-8s %9lu %14.0f %8lu %8lu %8lu %10lu\n",
+        lockfree ? "lfqueue" : "queue", producer_count, total * 1e9 / elapsed,
+        latencies[latency_count * 50 / 100], latencies[latency_count * 99 / 100],
+        latencies[latency_count * 999 / 1000], latencies[latency_count - 1]);
+    free(latencies);
+    if(lockfree)
+    {
+        for(size_t i = 0; i < producer_count; i++)
+            lfqueue_deinit(run->lfqueues + i, NULL);
+    }
+    else
+    {
+        queue_deinit(&(run->queue), NULL);
+        pthread_spin_destroy(&(run->lock));
+    }
+    pthread_barrier_destroy(&(run->barrier));
+    free(run);
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    size_t max_producers = MAX_PRODUCERS, ops_per_producer = 1000000;
+    if(argc > 3 ||
+        (argc > 1 && sscanf(argv[1], "%lu", &max_producers) != 1) ||
+        (argc > 2 && sscanf(argv[2], "%lu", &ops_per_producer) != 1) ||
+        max_producers < 1 || max_producers > MAX_PRODUCERS || ops_per_producer < 1)
+    {
+        fprintf(stderr, "USAGE: %s [max-producers (1~%d)] [ops-per-producer]\n",
+            argv[0], MAX_PRODUCERS);
+        return 1;
+    }
+    printf("%-8s %9s %14s %8s %8s %8s %10s\n",
+        "queue", "producers", "ops/s", "p50(ns)", "p99(ns)", "p999(ns)", "max(ns)");
+    for(size_t producer_count = 1; producer_count <= max_producers; producer_count *= 2)
+    {
+        if(do_run(0, producer_count, ops_per_producer) ||
+            do_run(1, producer_count, ops_per_producer))
+            return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,140 @@
+#include <math.h>
+#include <time.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rank.h"
+
+#define FAST_RATIO          0.25    // the ratio of fast memory
+#define TOLERANCE           0.1     // the temperature tolerance ratio
+
+static uint64_t get_current_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// xorshift64*, good enough to make up temperatures
+static uint64_t next_random(uint64_t* state)
+{
+    (*state) ^= (*state) >> 12;
+    (*state) ^= (*state) << 25;
+    (*state) ^= (*state) >> 27;
+    return (*state) * 2685821657736338717ULL;
+}
+
+// make up pages with a skewed temperature distribution, as hot pages are few, and a
+// random placement of fast memory
+static void make_pages(struct rank_page* pages, size_t count, size_t fast_capacity)
+{
+    uint64_t state = 88172645463325252ULL;
+    for(size_t i = 0; i < count; i++)
+    {
+        double u = (next_random(&state) >> 11) * (1.0 / (1ULL << 53));
+        pages[i].temperature = (float)(pow(u, 8) * 1000);
+        pages[i].id = (uint32_t)(i & 0x3fffffff);
+        pages[i].huge = 0;
+        pages[i].fast = next_random(&state) % count < fast_capacity;
+    }
+}
+
+static int compare_hotter(const void* a, const void* b)
+{
+    float x = ((const struct rank_page*)a)->temperature;
+    float y = ((const struct rank_page*)b)->temperature;
+    return x > y ? -1 : x < y;
+}
+
+// the same selection as rank_cutoff() + rank_select(), but sorting all pages
+static int sort_select(const struct rank_page* pages, size_t count, size_t fast_capacity,
+    size_t* p_promote_count, size_t* p_demote_count)
+{
+    struct rank_page* sorted = malloc(sizeof(struct rank_page) * count);
+    if(!sorted)
+        return -1;
+    memcpy(sorted, pages, sizeof(struct rank_page) * count);
+    qsort(sorted, count, sizeof(struct rank_page), compare_hotter);
+    float cutoff = fast_capacity < count ? sorted[fast_capacity].temperature : 0;
+    float hot_line = cutoff * (1 + TOLERANCE), cold_line = cutoff / (1 + TOLERANCE);
+    size_t promote_count = 0, demote_count = 0;
+    for(size_t i = 0; i < count; i++)
+    {
+        if(!sorted[i].fast && sorted[i].temperature >= hot_line)
+            promote_count++;
+        else if(sorted[i].fast && sorted[i].temperature < cold_line)
+            demote_count++;
+    }
+    free(sorted);
+    (*p_promote_count) = promote_count;
+    (*p_demote_count) = demote_count;
+    return 0;
+}
+
+static int do_run(struct rank* rank, size_t count, int with_sort)
+{
+    size_t fast_capacity = (size_t)(count * FAST_RATIO);
+    struct rank_page* pages = malloc(sizeof(struct rank_page) * count);
+    if(!pages)
+    {
+        fprintf(stderr, "malloc() failed\n");
+        return -1;
+    }
+    make_pages(pages, count, fast_capacity);
+    uint64_t begin = get_current_ns();
+    float cutoff = rank_cutoff(rank, pages, count, fast_capacity);
+    if(rank_select(rank, pages, count, cutoff, TOLERANCE, 0))
+    {
+        fprintf(stderr, "rank_select() failed\n");
+        return -1;
+    }
+    uint64_t rank_ns = get_current_ns() - begin;
+    printf("%-6s %12lu %12.3f %12lu %12lu\n", "rank", count, rank_ns / 1e6,
+        rank->promote_count, rank->demote_count);
+    if(with_sort)
+    {
+        size_t promote_count, demote_count;
+        begin = get_current_ns();
+        if(sort_select(pages, count, fast_capacity, &promote_count, &demote_count))
+        {
+            fprintf(stderr, "sort_select() failed\n");
+            return -1;
+        }
+        uint64_t sort_ns = get_current_ns() - begin;
+        printf("%-6s %12lu %12.3f %12lu %12lu\n", "sort", count, sort_ns / 1e6,
+            promote_count, demote_count);
+    }
+    free(pages);
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    size_t max_count = 100000000, max_sort_count = 100000000;
+    if(argc > 3 ||
+        (argc > 1 && sscanf(argv[1], "%lu", &max_count) != 1) ||
+        (argc > 2 && sscanf(argv[2], "%lu", &max_sort_count) != 1) ||
+        max_count < 1000000)
+    {
+        fprintf(stderr, "USAGE: %s [max-pages (>= 1000000)] [max-pages-to-sort]\n", argv[0]);
+        return 1;
+    }
+    struct rank* rank = malloc(sizeof(struct rank));
+    if(!rank)
+    {
+        fprintf(stderr, "malloc() failed\n");
+        return 1;
+    }
+    rank_init(rank);
+    printf("%-6s %12s %12s %12s %12s\n", "method", "pages", "time(ms)", "promote", "demote");
+    for(size_t count = 1000000; count <= max_count; count *= 10)
+    {
+        if(do_run(rank, count, count <= max_sort_count))
+            return 1;
+    }
+    rank_deinit(rank);
+    free(rank);
+    return 0;
+}
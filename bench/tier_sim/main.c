@@ -0,0 +1,669 @@
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vm.h"
+#include "kvm_ept_trace.h"
+
+#define REGION_SHIFT        9       // the sampler arms 2MB regions (PMDs) of 512 pages
+#define SIM_HZ              1000    // jiffies per second of the simulated kernel
+#define TICK_ACCESSES       1000    // accesses of the guest per ms
+#define WRITE_RATIO         0.3     // the ratio of accesses that write
+#define ZIPF_SKEW           0.99
+#define PHASE_LENGTH        30000   // ms between shifts of the hot set, for "phase"
+#define MIX_SCAN_RATIO      0.2     // the ratio of accesses that scan, for "mix"
+#define READ_ADDITION       1.0f    // temperature additions of the policy
+#define WRITE_ADDITION      2.0f
+#define EXEC_ADDITION       2.0f
+#define REPORT_INTERVAL     1000    // ms between lines of the report
+#define PERMUTE_PRIME       2654435761ULL   // maps ranks of Zipf to pages
+#define SIM_HVA             (1ULL << 40)    // HVAs of the guest, GPAs at a fixed offset
+#define REPLAY_BATCH        128     // samples per read of a trace
+
+enum workload
+{
+    WORKLOAD_ZIPF,      // Zipfian over all pages
+    WORKLOAD_SCAN,      // sequential sweeps over all pages
+    WORKLOAD_PHASE,     // Zipfian, whose hot set moves every PHASE_LENGTH ms
+    WORKLOAD_MIX,       // Zipfian, mixed with sweeps
+};
+
+struct params
+{
+    enum workload workload;
+    const char* trace_path;     // the trace replayed instead of the workload, or NULL
+    size_t page_count;          // pages of the guest
+    double ratios[MAX_TIERS];   // the ratio of pages of every tier but the slowest
+    unsigned long freq;         // the sample frequency, in Hz
+    unsigned long scan_interval;    // ms between scans of the policy
+    unsigned long duration;     // seconds to simulate
+    unsigned long bandwidth;    // max bandwidth of migration, in MB/s
+    struct vm_params policy;    // the policy, i.e. a VM of kvm_hybridmem
+};
+
+// the sampler of the kernel module, arming all 2MB regions every interval, so the first
+// access to every region after a sweep is a sample, and adapting the interval to the
+// frequency like sampler.c does
+struct sampler
+{
+    uint8_t* armed;             // a byte per region
+    size_t region_count;
+    unsigned long interval;     // jiffies between sweeps
+    uint64_t sweep_time;
+    uint64_t adapt_time;
+    size_t triggers;            // samples since 'adapt_time'
+};
+
+// the host of the guest, behind hooks of the VM: tier i is node i, and pages are where
+// the policy moves them to at once
+struct host
+{
+    uint64_t time;              // the simulated time, in ms
+    int8_t* nodes;              // the node of every 4KB page by GFN
+    size_t page_count;          // count of GFNs in 'nodes'
+    struct kvm_ept_client memslots; // memslots of the guest, for lookups only
+    int huge;                   // are memslots backed by 2MB huge pages
+};
+
+// the replay of a recorded trace, see kvm_ept_trace.h
+struct replay
+{
+    struct kvm_ept_trace_reader reader;
+    struct kvm_ept_sample_sample samples[REPLAY_BATCH];
+    size_t count;               // count of samples in 'samples' not replayed yet
+    uint64_t time;              // when 'samples' are recorded, in ms since the start
+    int ended;
+};
+
+// the Zipfian generator of rejection-inversion sampling (Hörmann and Derflinger), O(1)
+// per sample without a table of all pages
+struct zipf
+{
+    double skew;
+    double count;
+    double h_integral_x1;
+    double h_integral_n;
+    double s;
+};
+
+static uint64_t get_current_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// xorshift64*, good enough for workloads
+static uint64_t next_random(uint64_t* state)
+{
+    (*state) ^= (*state) >> 12;
+    (*state) ^= (*state) << 25;
+    (*state) ^= (*state) >> 27;
+    return (*state) * 2685821657736338717ULL;
+}
+
+static double next_uniform(uint64_t* state)
+{
+    return (next_random(state) >> 11) * (1.0 / (1ULL << 53));
+}
+
+static double zipf_helper1(double x)
+{
+    return fabs(x) > 1e-8 ? log1p(x) / x : 1 - x * (0.5 - x * (1.0 / 3 - 0.25 * x));
+}
+
+static double zipf_helper2(double x)
+{
+    return fabs(x) > 1e-8 ? expm1(x) / x : 1 + x * 0.5 * (1 + x / 3 * (1 + 0.25 * x));
+}
+
+static double zipf_h(const struct zipf* zipf, double x)
+{
+    return exp(-zipf->skew * log(x));
+}
+
+static double zipf_h_integral(const struct zipf* zipf, double x)
+{
+    double log_x = log(x);
+    return zipf_helper2((1 - zipf->skew) * log_x) * log_x;
+}
+
+static double zipf_h_integral_inverse(const struct zipf* zipf, double x)
+{
+    double t = x * (1 - zipf->skew);
+    if(t < -1)
+        t = -1;
+    return exp(zipf_helper1(t) * x);
+}
+
+static void zipf_init(struct zipf* zipf, size_t count, double skew)
+{
+    zipf->skew = skew;
+    zipf->count = count;
+    zipf->h_integral_x1 = zipf_h_integral(zipf, 1.5) - 1;
+    zipf->h_integral_n = zipf_h_integral(zipf, count + 0.5);
+    zipf->s = 2 - zipf_h_integral_inverse(zipf, zipf_h_integral(zipf, 2.5) - zipf_h(zipf, 2));
+}
+
+// return a rank in [0, count), 0 is the hottest
+static size_t zipf_next(const struct zipf* zipf, uint64_t* state)
+{
+    while(1)
+    {
+        double u = zipf->h_integral_n + next_uniform(state) *
+            (zipf->h_integral_x1 - zipf->h_integral_n);
+        double x = zipf_h_integral_inverse(zipf, u);
+        double k = floor(x + 0.5);
+        if(k < 1)
+            k = 1;
+        else if(k > zipf->count)
+            k = zipf->count;
+        if(k - x <= zipf->s || u >= zipf_h_integral(zipf, k + 0.5) - zipf_h(zipf, k))
+            return (size_t)k - 1;
+    }
+}
+
+// the next page accessed by the guest at a time
+static size_t next_page(const struct params* params, const struct zipf* zipf,
+    uint64_t* state, size_t* scan_next, uint64_t time)
+{
+    enum workload workload = params->workload;
+    if(workload == WORKLOAD_SCAN ||
+        (workload == WORKLOAD_MIX && next_uniform(state) < MIX_SCAN_RATIO))
+    {
+        size_t page = (*scan_next);
+        (*scan_next) = (page + 1) % params->page_count;
+        return page;
+    }
+    // hot pages are scattered, and the hot set moves to other pages in every phase
+    uint64_t offset = workload == WORKLOAD_PHASE ?
+        time / PHASE_LENGTH * (params->page_count / 4 + 1) : 0;
+    return (zipf_next(zipf, state) * PERMUTE_PRIME + offset) % params->page_count;
+}
+
+static void sampler_adapt(struct sampler* sampler, unsigned long freq, uint64_t time)
+{
+    uint64_t time_delta = time - sampler->adapt_time;
+    if(time_delta < SIM_HZ)
+        return;
+    unsigned long hz = SIM_HZ * sampler->triggers / time_delta;
+    if(hz < freq)
+    {
+        unsigned long delta = (freq - hz) / 1000 > 1 ? (freq - hz) / 1000 : 1;
+        sampler->interval = sampler->interval <= delta ? 1 : sampler->interval - delta;
+    }
+    else if(hz > freq)
+        sampler->interval += (hz - freq) / 1000 > 1 ? (hz - freq) / 1000 : 1;
+    sampler->adapt_time = time;
+    sampler->triggers = 0;
+}
+
+
+static uint64_t host_get_time(void* privdata)
+{
+    return ((struct host*)privdata)->time;
+}
+
+// 4KB pages of the unit of a head GFN, as page_table.c makes units: a chunk fully in a
+// memslot backed by huge pages has huge units
+static size_t get_unit_pages(struct host* host, uint64_t gfn)
+{
+    const struct kvm_ept_sample_memslot_ex* memslot = kvm_ept_client_lookup(&(host->memslots), gfn);
+    if(!host->huge || !memslot)
+        return 1;
+    uint64_t base_gfn = memslot->gpa / PAGE_SIZE;
+    uint64_t chunk_gfn = gfn >> PAGE_TABLE_CHUNK_SHIFT << PAGE_TABLE_CHUNK_SHIFT;
+    return chunk_gfn >= base_gfn &&
+        chunk_gfn + PAGE_TABLE_CHUNK_PAGES <= base_gfn + memslot->page_count ?
+        1UL << PAGE_TABLE_HUGE_SHIFT : 1;
+}
+
+// move_pages(2) of the guest, a huge page moves as a whole
+static long host_move_pages(void* privdata, size_t count, void** addresses, const int* nodes,
+    int* status)
+{
+    struct host* host = privdata;
+    for(size_t i = 0; i < count; i++)
+    {
+        uint64_t gfn = ((uint64_t)addresses[i] - SIM_HVA) / PAGE_SIZE;
+        if(gfn >= host->page_count || !kvm_ept_client_lookup(&(host->memslots), gfn))
+        {
+            status[i] = -ENOENT;
+            continue;
+        }
+        if(nodes)
+        {
+            size_t unit_pages = get_unit_pages(host, gfn);
+            if(gfn + unit_pages > host->page_count)
+                unit_pages = host->page_count - gfn;
+            memset(host->nodes + gfn, nodes[i], unit_pages);
+        }
+        status[i] = host->nodes[gfn];
+    }
+    return 0;
+}
+
+// annotate a sample like kvm-ept-sample does with KVM_EPT_SAMPLE_FORMAT_ANNOTATED
+static void annotate(struct host* host, struct kvm_ept_sample_annotated* sample, uint64_t gfn,
+    int xwr)
+{
+    sample->gfn = gfn;
+    sample->xwr = xwr;
+    int mapped = gfn < host->page_count && kvm_ept_client_lookup(&(host->memslots), gfn);
+    sample->hva = mapped ? SIM_HVA + gfn * PAGE_SIZE : 0;
+    sample->slot = mapped ? 0 : -1;
+    sample->node = mapped ? host->nodes[gfn] : -1;
+}
+
+// replay samples of a trace recorded before a time, as a real sampler would have taken
+// them, and count those in the fastest tier
+// return count of samples, or -1 if the trace is broken
+static long replay_tick(struct replay* replay, struct host* host, struct vm* vm,
+    uint64_t time, size_t* p_hits)
+{
+    struct kvm_ept_sample_annotated samples[REPLAY_BATCH];
+    size_t total = 0;
+    while(1)
+    {
+        if(!replay->count)
+        {
+            if(replay->ended)
+                break;
+            ssize_t len = kvm_ept_trace_read(&(replay->reader), replay->samples,
+                sizeof(replay->samples));
+            if(len < 0)
+                return -1;
+            if(!len)
+            {
+                replay->ended = 1;
+                break;
+            }
+            replay->count = len / sizeof(struct kvm_ept_sample_sample);
+            replay->time = (kvm_ept_trace_time_us(&(replay->reader)) -
+                replay->reader.header.start_time_us) / 1000;
+        }
+        if(replay->time > time)
+            break;
+        // events of changed memslots are dropped, as memslots of a trace never change
+        size_t count = 0;
+        for(size_t i = 0; i < replay->count; i++)
+        {
+            if(!replay->samples[i].xwr)
+                continue;
+            annotate(host, samples + count, replay->samples[i].gfn, replay->samples[i].xwr);
+            (*p_hits) += samples[count].node == 0;
+            count++;
+        }
+        replay->count = 0;
+        if(vm_dispatch(vm, samples, count))
+            return -1;
+        total += count;
+    }
+    return total;
+}
+
+// run the guest for a ms, through the model of the sampler
+// return count of samples
+static long run_tick(const struct params* params, struct sampler* sampler,
+    const struct zipf* zipf, uint64_t* state, size_t* scan_next, struct host* host,
+    struct vm* vm, uint64_t time, size_t* p_hits)
+{
+    static struct kvm_ept_sample_annotated samples[TICK_ACCESSES];
+    // a sweep arms all regions
+    if(time >= sampler->sweep_time)
+    {
+        memset(sampler->armed, 1, sampler->region_count);
+        sampler_adapt(sampler, params->freq, time);
+        sampler->sweep_time = time + sampler->interval;
+    }
+    // the guest runs, and trips over armed regions
+    size_t count = 0;
+    for(size_t i = 0; i < TICK_ACCESSES; i++)
+    {
+        size_t page = next_page(params, zipf, state, scan_next, time);
+        int write = next_uniform(state) < WRITE_RATIO;
+        (*p_hits) += host->nodes[page] == 0;
+        size_t region = page >> REGION_SHIFT;
+        if(sampler->armed[region])
+        {
+            sampler->armed[region] = 0;
+            annotate(host, samples + count, page, write ? 2 : 1);
+            count++;
+        }
+    }
+    sampler->triggers += count;
+    return vm_dispatch(vm, samples, count) ? -1 : (long)count;
+}
+
+// execute the plan of the latest scan within a budget of bytes, at once
+// return bytes moved
+static size_t migrate(struct vm* vm, struct host* host, size_t max_bytes)
+{
+    static struct migrate_batch batch;
+    size_t moved_bytes = 0;
+    while(max_bytes && vm_take_tasks(vm, &batch, max_bytes))
+    {
+        host_move_pages(host, batch.count, batch.addresses, batch.nodes, batch.status);
+        moved_bytes += vm_on_migrated(vm, &batch);
+        max_bytes = batch.bytes < max_bytes ? max_bytes - batch.bytes : 0;
+    }
+    return moved_bytes;
+}
+
+static int parse_workload(const char* text, enum workload* p_workload)
+{
+    const char* names[] = {"zipf", "scan", "phase", "mix"};
+    for(size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+    {
+        if(!strcmp(text, names[i]))
+        {
+            (*p_workload) = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+
+// parse tiers like "0.25" or "0.1@80/0.3@250/@350", i.e. the ratio of pages of every tier
+// but the slowest, which takes the rest, from the fastest, and optionally their latency (ns)
+// return 0 if succeed, or -1 if it's invalid
+static int parse_tiers(char* text, struct params* params)
+{
+    struct vm_params* policy = &(params->policy);
+    policy->tier_count = 0;
+    for(char* tier = strtok(text, "/"); tier; tier = strtok(NULL, "/"))
+    {
+        if(policy->tier_count == MAX_TIERS)
+            return -1;
+        size_t index = policy->tier_count++;
+        double* ratio = params->ratios + index;
+        unsigned long* latency = &(policy->tiers[index].latency);
+        (*ratio) = -1;
+        (*latency) = 0;
+        if((*tier != '@' && sscanf(tier, "%lf", ratio) != 1) ||
+            (strchr(tier, '@') && sscanf(strchr(tier, '@'), "@%lu", latency) != 1))
+            return -1;
+    }
+    // the slowest tier is implied if all tiers have a ratio
+    if(policy->tier_count && params->ratios[policy->tier_count - 1] >= 0)
+    {
+        if(policy->tier_count == MAX_TIERS)
+            return -1;
+        policy->tiers[policy->tier_count++].latency = 0;
+    }
+    double sum = 0;
+    for(size_t i = 0; i + 1 < policy->tier_count; i++)
+    {
+        if(params->ratios[i] < 0)
+            return -1;
+        sum += params->ratios[i];
+    }
+    return policy->tier_count >= 2 && sum <= 1 ? 0 : -1;
+}
+
+// parse the cost model like kvm_hybridmem, see parse_cost_model() there
+// return 0 if succeed, or -1 if it's invalid
+static int parse_cost_model(const char* text, struct vm_params* policy)
+{
+    policy->payoff_horizon = 0;
+    policy->accesses_per_sample = 0;
+    policy->cooldown = 0;
+    policy->copy_ns = 1000;
+    policy->shootdown_ns = 5000;
+    if(!strcmp(text, "-"))
+        return 0;
+    int count = sscanf(text, "%f:%f:%lu:%lu:%lu", &(policy->payoff_horizon),
+        &(policy->accesses_per_sample), &(policy->cooldown), &(policy->copy_ns),
+        &(policy->shootdown_ns));
+    if((count != 3 && count != 5) || policy->payoff_horizon <= 0 ||
+        policy->accesses_per_sample <= 0)
+        return -1;
+    for(size_t i = 0; i < policy->tier_count; i++)
+    {
+        if(!policy->tiers[i].latency)
+            return -1;
+    }
+    return 0;
+}
+
+// memslots of the guest: one for the workload, or the normal ones of the trace, with HVAs
+// moved to SIM_HVA + GPA, so that addresses of pages map back to GFNs
+// return 0 if succeed, or -1 with errno set
+static int init_host(struct host* host, const struct params* params, struct replay* replay)
+{
+    struct kvm_ept_sample_memslot_ex workload_memslot =
+    {
+        .as_id = 0,
+        .id = 0,
+        .gpa = 0,
+        .hva = SIM_HVA,
+        .page_count = params->page_count,
+    };
+    const struct kvm_ept_sample_memslot_ex* memslots = &workload_memslot;
+    size_t memslot_count = 1;
+    if(replay)
+    {
+        memslots = replay->reader.memslots;
+        memslot_count = replay->reader.header.memslot_count;
+    }
+    kvm_ept_client_init_copy(&(host->memslots));
+    if(kvm_ept_client_set_memslots(&(host->memslots), memslots, memslot_count))
+        return -1;
+    host->page_count = 0;
+    for(size_t i = 0; i < host->memslots.sorted_count; i++)
+    {
+        struct kvm_ept_sample_memslot_ex* memslot = host->memslots.sorted + i;
+        memslot->hva = SIM_HVA + memslot->gpa;
+        uint64_t end = memslot->gpa / PAGE_SIZE + memslot->page_count;
+        host->page_count = end > host->page_count ? end : host->page_count;
+    }
+    // the guest of the policy has the same memslots
+    memcpy(host->memslots.memslots, host->memslots.sorted,
+        sizeof(struct kvm_ept_sample_memslot_ex) * host->memslots.sorted_count);
+    host->memslots.memslot_count = host->memslots.sorted_count;
+    host->time = 0;
+    // all pages start in the slowest tier
+    if(!(host->nodes = malloc(host->page_count + 1)))
+        return -1;
+    memset(host->nodes, params->policy.tier_count - 1, host->page_count);
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    struct params params =
+    {
+        .workload = WORKLOAD_ZIPF,
+        .trace_path = NULL,
+        .page_count = 1 << 18,
+        .freq = 10000,
+        .scan_interval = 1000,
+        .duration = 120,
+        .bandwidth = 1000,
+    };
+    struct vm_params* policy = &(params.policy);
+    memset(policy, 0, sizeof(struct vm_params));
+    policy->xwr = 7;
+    policy->half_life = 10000;
+    policy->xaddition = EXEC_ADDITION;
+    policy->waddition = WRITE_ADDITION;
+    policy->raddition = READ_ADDITION;
+    policy->temperature_tolerance_ratio = 0.1;
+    policy->shard_count = 1;
+    policy->placement = PLACEMENT_DECAY;
+    char default_tiers[] = "0.25";
+    int huge = 0;
+    if(argc >= 2 && parse_workload(argv[1], &(params.workload)))
+        params.trace_path = argv[1];
+    if(argc < 2 ||
+        (argc > 2 && sscanf(argv[2], "%zu", &(params.page_count)) != 1) ||
+        parse_tiers(argc > 3 ? argv[3] : default_tiers, &params) ||
+        (argc > 4 && sscanf(argv[4], "%lu", &(params.freq)) != 1) ||
+        (argc > 5 && sscanf(argv[5], "%f", &(policy->half_life)) != 1) ||
+        (argc > 6 && sscanf(argv[6], "%lu", &(params.scan_interval)) != 1) ||
+        (argc > 7 && sscanf(argv[7], "%lu", &(params.duration)) != 1) ||
+        (argc > 8 && sscanf(argv[8], "%f", &(policy->temperature_tolerance_ratio)) != 1) ||
+        (argc > 9 && sscanf(argv[9], "%lu", &(params.bandwidth)) != 1) ||
+        (argc > 10 && strcmp(argv[10], "decay") && strcmp(argv[10], "arc")) ||
+        parse_cost_model(argc > 11 ? argv[11] : "-", policy) ||
+        (argc > 12 && sscanf(argv[12], "%d", &huge) != 1) ||
+        (!params.trace_path && (!params.page_count || params.page_count > (1UL << 29))) ||
+        !params.freq ||
+        !params.scan_interval)
+    {
+        fprintf(stderr, "USAGE: %s <zipf|scan|phase|mix|trace-path> [pages] [tiers] "
+            "[freq (Hz)] [half-life (ms)] [scan-interval (ms)] [duration (s)] [tolerance] "
+            "[max-migration-bandwidth (MB/s)] [decay|arc] [cost-model] [huge (0|1)]\n"
+            "<tiers> are the ratio of pages and optionally latency (ns) of every tier but "
+            "the slowest from the fastest, then optionally latency of the slowest, e.g. "
+            "0.1@80/0.3@250/@350.\n"
+            "<cost-model> is the same as kvm_hybridmem takes, or - for none.\n", argv[0]);
+        return 1;
+    }
+    if(argc > 10 && !strcmp(argv[10], "arc"))
+        policy->placement = PLACEMENT_ARC;
+    // a trace brings its own guest and samples
+    static struct replay replay;
+    if(params.trace_path)
+    {
+        if(kvm_ept_trace_reader_open(&(replay.reader), params.trace_path))
+        {
+            perror("kvm_ept_trace_reader_open() failed");
+            return 1;
+        }
+        replay.count = 0;
+        replay.ended = 0;
+    }
+    struct host host;
+    host.huge = huge;
+    if(init_host(&host, &params, params.trace_path ? &replay : NULL))
+    {
+        perror("init_host() failed");
+        return 1;
+    }
+    size_t guest_pages = 0;
+    for(size_t i = 0; i < host.memslots.sorted_count; i++)
+        guest_pages += host.memslots.sorted[i].page_count;
+    // tier i is node i, and the policy gets all of every tier
+    size_t capacities[MAX_TIERS];
+    for(size_t i = 0; i < policy->tier_count; i++)
+    {
+        struct tier* tier = policy->tiers + i;
+        tier->nodes[0] = i;
+        tier->node_count = 1;
+        tier->capacity = i + 1 < policy->tier_count ?
+            (size_t)(guest_pages * params.ratios[i]) : 0;
+        capacities[i] = (i ? capacities[i - 1] : 0) + tier->capacity;
+    }
+    policy->max_fast_ratio = params.ratios[0];
+    policy->min_fast_ratio = params.ratios[0];
+    struct vm_hooks hooks =
+    {
+        .get_time = host_get_time,
+        .move_pages = host_move_pages,
+        .memslots = host.memslots.memslots,
+        .memslot_count = host.memslots.memslot_count,
+        .huge = huge,
+        .privdata = &host,
+    };
+    policy->hooks = &hooks;
+    static struct vm vm;
+    if(vm_init(&vm, policy))
+        return 1;
+    memcpy(vm.capacities, capacities, sizeof(capacities));
+    struct sampler sampler;
+    sampler.region_count = (host.page_count + (1 << REGION_SHIFT) - 1) >> REGION_SHIFT;
+    sampler.armed = calloc(sampler.region_count, 1);
+    sampler.interval = 1000 * SIM_HZ / params.freq ? 1000 * SIM_HZ / params.freq : 1;
+    sampler.sweep_time = 0;
+    sampler.adapt_time = 0;
+    sampler.triggers = 0;
+    if(!sampler.armed)
+    {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    struct zipf zipf;
+    zipf_init(&zipf, params.page_count, ZIPF_SKEW);
+    uint64_t state = 88172645463325252ULL;
+    size_t scan_next = 0;
+    // bytes to migrate per scan within the bandwidth
+    size_t max_bytes = (size_t)((double)params.bandwidth * 1024 * 1024 *
+        params.scan_interval / 1000);
+    size_t hits = 0, accesses = 0, total_hits = 0, total_accesses = 0;
+    size_t sample_count = 0, total_samples = 0, moved = 0, total_moved = 0;
+    uint64_t policy_ns = 0;
+    uint64_t scan_time = params.scan_interval, report_time = REPORT_INTERVAL;
+    printf("%8s %10s %10s %12s\n", "time (s)", "hit ratio", "samples", "moved (MB)");
+    for(uint64_t time = 0; time < params.duration * 1000 && !replay.ended; time++)
+    {
+        host.time = time;
+        // the guest runs, or the trace goes on, and samples go to the policy at once
+        uint64_t start_ns = get_current_ns();
+        long count;
+        if(params.trace_path)
+        {
+            count = replay_tick(&replay, &host, &vm, time, &hits);
+            // accesses between samples are not recorded
+            accesses += count > 0 ? count : 0;
+        }
+        else
+        {
+            uint64_t guest_ns = get_current_ns();
+            count = run_tick(&params, &sampler, &zipf, &state, &scan_next, &host, &vm, time,
+                &hits);
+            accesses += TICK_ACCESSES;
+            // the guest itself is not the policy
+            start_ns += get_current_ns() - guest_ns;
+        }
+        if(count < 0)
+        {
+            fprintf(stderr, "failed to take samples\n");
+            return 1;
+        }
+        sample_count += count;
+        // the policy takes samples, and scans once in a while
+        while(vm_update(&vm, 0))
+            ;
+        if(time >= scan_time)
+        {
+            if(vm_scan(&vm))
+                return 1;
+            moved += migrate(&vm, &host, max_bytes);
+            scan_time += params.scan_interval;
+        }
+        policy_ns += get_current_ns() - start_ns;
+        if(time + 1 >= report_time)
+        {
+            printf("%8.1f %10.4f %10zu %12.1f\n", (time + 1) / 1000.0,
+                accesses ? (double)hits / accesses : 0, sample_count,
+                moved / 1024.0 / 1024);
+            total_hits += hits;
+            total_accesses += accesses;
+            total_samples += sample_count;
+            total_moved += moved;
+            hits = accesses = sample_count = moved = 0;
+            report_time += REPORT_INTERVAL;
+        }
+    }
+    total_hits += hits;
+    total_accesses += accesses;
+    total_samples += sample_count;
+    total_moved += moved;
+    // one line for sweeps of parameters
+    printf("SUMMARY hit_ratio=%.4f samples=%zu migrated_mb=%.1f ns_per_sample=%.1f\n",
+        total_accesses ? (double)total_hits / total_accesses : 0, total_samples,
+        total_moved / 1024.0 / 1024, total_samples ? (double)policy_ns / total_samples : 0);
+    vm_deinit(&vm);
+    if(params.trace_path)
+        kvm_ept_trace_reader_close(&(replay.reader));
+    kvm_ept_client_close(&(host.memslots));
+    free(host.nodes);
+    free(sampler.armed);
+    return 0;
+}
@@ -0,0 +1,302 @@
+#ifndef KVM_EPT_CLIENT_H
+#define KVM_EPT_CLIENT_H
+
+// A small client of kvm-ept-sample, wrapping the ioctl() and read() sequences every consumer
+// needs, and translating GFNs to memslots and HVAs.
+//
+// The client keeps all memslots, however many there are, and refreshes them by itself when
+// the sample stream reports that they have changed. Memslots of the normal address space
+// are kept sorted by GPA, so a lookup is a binary search, and it's O(1) in the common case
+// that neighboring samples hit the same slot as the previous one.
+//
+// Usage:
+//      struct kvm_ept_client client;
+//      kvm_ept_client_open(&client, pid, KVM_EPT_SAMPLE_FORMAT_COMPACT);
+//      kvm_ept_client_set_prot(&client, 6);
+//      kvm_ept_client_set_freq(&client, 10000);
+//      while(...)
+//      {
+//          ssize_t len = kvm_ept_client_read(&client, samples, sizeof(samples));
+//          ... kvm_ept_client_gfn_to_hva(&client, samples[i].gfn) ...
+//      }
+//      kvm_ept_client_close(&client);
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+
+#include "kvm_ept_sample.h"
+
+#define KVM_EPT_CLIENT_MIN_MEMSLOTS 64
+
+struct kvm_ept_client
+{
+    int fd;                     // fd of kvm-ept-sample
+    int format;                 // KVM_EPT_SAMPLE_FORMAT_*
+    size_t sample_size;         // size of a sample in the format
+    // all memslots, in the order of GET_MEMSLOTS_EX
+    struct kvm_ept_sample_memslot_ex* memslots;
+    size_t memslot_count;
+    size_t memslot_capacity;
+    uint64_t generation;        // the generation of 'memslots'
+    // memslots of the normal address space, sorted by GPA
+    struct kvm_ept_sample_memslot_ex* sorted;
+    size_t sorted_count;
+    size_t last;                // the slot in 'sorted' hit by the latest lookup
+};
+
+static inline int kvm_ept_client_compare_memslots(const void* a, const void* b)
+{
+    uint64_t gpa_a = ((const struct kvm_ept_sample_memslot_ex*)a)->gpa;
+    uint64_t gpa_b = ((const struct kvm_ept_sample_memslot_ex*)b)->gpa;
+    return gpa_a < gpa_b ? -1 : gpa_a > gpa_b;
+}
+
+// make room for a count of memslots, which drops the ones kept
+// return 0 if succeed, or -1 with errno set
+static inline int kvm_ept_client_reserve_memslots(struct kvm_ept_client* client, size_t count)
+{
+    if(count <= client->memslot_capacity && client->memslots)
+        return 0;
+    size_t capacity = count > KVM_EPT_CLIENT_MIN_MEMSLOTS ? count : KVM_EPT_CLIENT_MIN_MEMSLOTS;
+    struct kvm_ept_sample_memslot_ex* memslots = malloc(
+        sizeof(struct kvm_ept_sample_memslot_ex) * capacity);
+    struct kvm_ept_sample_memslot_ex* sorted = malloc(
+        sizeof(struct kvm_ept_sample_memslot_ex) * capacity);
+    if(!memslots || !sorted)
+    {
+        free(memslots);
+        free(sorted);
+        return -1;
+    }
+    free(client->memslots);
+    free(client->sorted);
+    client->memslots = memslots;
+    client->sorted = sorted;
+    client->memslot_capacity = capacity;
+    client->memslot_count = 0;
+    client->sorted_count = 0;
+    return 0;
+}
+
+// rebuild the translation from 'memslots'
+static inline void kvm_ept_client_sort_memslots(struct kvm_ept_client* client)
+{
+    // slots of other address spaces (e.g. SMM) overlay the normal ones
+    client->sorted_count = 0;
+    for(size_t i = 0; i < client->memslot_count; i++)
+    {
+        if(!client->memslots[i].as_id)
+            client->sorted[client->sorted_count++] = client->memslots[i];
+    }
+    qsort(client->sorted, client->sorted_count, sizeof(struct kvm_ept_sample_memslot_ex),
+        kvm_ept_client_compare_memslots);
+    client->last = 0;
+}
+
+// get all memslots again, and rebuild the translation
+// return 0 if succeed, or -1 with errno set
+static inline int kvm_ept_client_refresh_memslots(struct kvm_ept_client* client)
+{
+    struct kvm_ept_sample_get_memslots_ex get_memslots;
+    while(1)
+    {
+        get_memslots.memslots = client->memslots;
+        get_memslots.capacity = client->memslot_capacity;
+        get_memslots.count = 0;
+        if(ioctl(client->fd, KVM_EPT_SAMPLE_CMD_GET_MEMSLOTS_EX, &get_memslots) < 0)
+            return -1;
+        if(get_memslots.count <= client->memslot_capacity)
+            break;
+        // more slots than the buffer holds, grow it and get them again
+        if(kvm_ept_client_reserve_memslots(client, get_memslots.count * 2))
+            return -1;
+    }
+    client->memslot_count = get_memslots.count;
+    client->generation = get_memslots.generation;
+    kvm_ept_client_sort_memslots(client);
+    return 0;
+}
+
+// open kvm-ept-sample for a QEMU-KVM process, and get its memslots
+//  format: KVM_EPT_SAMPLE_FORMAT_*, the format of samples read
+// return 0 if succeed, or -1 with errno set
+static inline int kvm_ept_client_open(struct kvm_ept_client* client, pid_t pid, int format)
+{
+    client->format = format;
+    client->sample_size = format == KVM_EPT_SAMPLE_FORMAT_ANNOTATED ?
+        sizeof(struct kvm_ept_sample_annotated) : sizeof(struct kvm_ept_sample_sample);
+    client->memslot_count = 0;
+    client->memslot_capacity = KVM_EPT_CLIENT_MIN_MEMSLOTS;
+    client->sorted_count = 0;
+    client->last = 0;
+    client->memslots = malloc(sizeof(struct kvm_ept_sample_memslot_ex) *
+        client->memslot_capacity);
+    client->sorted = malloc(sizeof(struct kvm_ept_sample_memslot_ex) * client->memslot_capacity);
+    if(!client->memslots || !client->sorted)
+        goto failed;
+    if((client->fd = open(KVM_EPT_SAMPLE_PATH, O_RDWR)) < 0)
+        goto failed;
+    // the format must be set before INIT
+    if((format != KVM_EPT_SAMPLE_FORMAT_COMPACT &&
+        ioctl(client->fd, KVM_EPT_SAMPLE_CMD_SET_FORMAT, format) < 0) ||
+        ioctl(client->fd, KVM_EPT_SAMPLE_CMD_INIT, pid) < 0 ||
+        kvm_ept_client_refresh_memslots(client))
+    {
+        close(client->fd);
+        goto failed;
+    }
+    return 0;
+failed:
+    free(client->memslots);
+    free(client->sorted);
+    return -1;
+}
+
+// xwr: access types to sample
+// return 0 if succeed, or -1 with errno set
+static inline int kvm_ept_client_set_prot(struct kvm_ept_client* client, int xwr)
+{
+    return ioctl(client->fd, KVM_EPT_SAMPLE_CMD_SET_PROT, xwr) < 0 ? -1 : 0;
+}
+
+// freq: samples per second, or 0 to stop sampling
+// return 0 if succeed, or -1 with errno set
+static inline int kvm_ept_client_set_freq(struct kvm_ept_client* client, unsigned long freq)
+{
+    return ioctl(client->fd, KVM_EPT_SAMPLE_CMD_SET_FREQ, freq) < 0 ? -1 : 0;
+}
+
+// is the i-th sample of a buffer an event of changed memslots
+static inline int kvm_ept_client_is_event(struct kvm_ept_client* client, const void* buffer,
+    size_t i)
+{
+    if(client->format == KVM_EPT_SAMPLE_FORMAT_ANNOTATED)
+        return !((const struct kvm_ept_sample_annotated*)buffer)[i].xwr;
+    return !((const struct kvm_ept_sample_sample*)buffer)[i].xwr;
+}
+
+// read samples until the buffer is full or no sample is left, so a call takes as many
+// samples as all CPUs have buffered
+// Events of changed memslots are kept in the buffer, but memslots have been refreshed by
+// the time it returns.
+//  capacity: size of the buffer in bytes
+// return the size of samples in bytes, 0 if there is no sample, or -1 with errno set
+static inline ssize_t kvm_ept_client_read(struct kvm_ept_client* client, void* buffer,
+    size_t capacity)
+{
+    size_t size = 0;
+    capacity -= capacity % client->sample_size;
+    while(size < capacity)
+    {
+        ssize_t len = read(client->fd, (char*)buffer + size, capacity - size);
+        if(len < 0)
+        {
+            if(size)
+                break;
+            return -1;
+        }
+        if(!len)
+            break;
+        size += len;
+    }
+    size_t count = size / client->sample_size;
+    for(size_t i = 0; i < count; i++)
+    {
+        // one refresh catches all changes so far
+        if(kvm_ept_client_is_event(client, buffer, i))
+            return kvm_ept_client_refresh_memslots(client) ? -1 : (ssize_t)size;
+    }
+    return size;
+}
+
+// get the memslot of a GFN in the normal address space
+// return the memslot, or NULL if it's in no memslot
+static inline const struct kvm_ept_sample_memslot_ex* kvm_ept_client_lookup(
+    struct kvm_ept_client* client, uint64_t gfn)
+{
+    const struct kvm_ept_sample_memslot_ex* sorted = client->sorted;
+    uint64_t gpa = gfn << 12;
+    // neighboring samples mostly hit the same slot
+    if(client->last < client->sorted_count && gpa >= sorted[client->last].gpa &&
+        gpa - sorted[client->last].gpa < (uint64_t)sorted[client->last].page_count << 12)
+        return sorted + client->last;
+    // the last slot starting at or before the GPA
+    size_t low = 0, high = client->sorted_count;
+    while(low < high)
+    {
+        size_t middle = (low + high) / 2;
+        if(sorted[middle].gpa <= gpa)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    if(!low || gpa - sorted[low - 1].gpa >= (uint64_t)sorted[low - 1].page_count << 12)
+        return NULL;
+    client->last = low - 1;
+    return sorted + client->last;
+}
+
+// get the HVA of a GFN
+// return the HVA, or 0 if it's in no memslot
+static inline uint64_t kvm_ept_client_gfn_to_hva(struct kvm_ept_client* client, uint64_t gfn)
+{
+    const struct kvm_ept_sample_memslot_ex* memslot = kvm_ept_client_lookup(client, gfn);
+    return memslot ? memslot->hva + ((gfn << 12) - memslot->gpa) : 0;
+}
+
+// make an empty copy of a client, see kvm_ept_client_copy_memslots()
+static inline void kvm_ept_client_init_copy(struct kvm_ept_client* client)
+{
+    memset(client, 0, sizeof(struct kvm_ept_client));
+    client->fd = -1;
+}
+
+// copy memslots of a client to a copy, e.g. a snapshot for another thread, as the client
+// refreshes them while reading
+// The copy only translates GFNs, and is released by kvm_ept_client_close().
+// return 0 if succeed, or -1 with errno set
+static inline int kvm_ept_client_copy_memslots(struct kvm_ept_client* to,
+    const struct kvm_ept_client* from)
+{
+    if(kvm_ept_client_reserve_memslots(to, from->memslot_count))
+        return -1;
+    memcpy(to->memslots, from->memslots,
+        sizeof(struct kvm_ept_sample_memslot_ex) * from->memslot_count);
+    memcpy(to->sorted, from->sorted, sizeof(struct kvm_ept_sample_memslot_ex) * from->sorted_count);
+    to->format = from->format;
+    to->sample_size = from->sample_size;
+    to->memslot_count = from->memslot_count;
+    to->sorted_count = from->sorted_count;
+    to->generation = from->generation;
+    to->last = 0;
+    return 0;
+}
+
+// set memslots of a copy from elsewhere, e.g. the header of a trace
+// return 0 if succeed, or -1 with errno set
+static inline int kvm_ept_client_set_memslots(struct kvm_ept_client* client,
+    const struct kvm_ept_sample_memslot_ex* memslots, size_t count)
+{
+    if(kvm_ept_client_reserve_memslots(client, count))
+        return -1;
+    memcpy(client->memslots, memslots, sizeof(struct kvm_ept_sample_memslot_ex) * count);
+    client->memslot_count = count;
+    kvm_ept_client_sort_memslots(client);
+    return 0;
+}
+
+// stop sampling and release everything, or release a copy
+static inline void kvm_ept_client_close(struct kvm_ept_client* client)
+{
+    if(client->fd >= 0)
+        close(client->fd);
+    free(client->memslots);
+    free(client->sorted);
+}
+
+#endif
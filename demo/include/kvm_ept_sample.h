@@ -8,16 +8,43 @@
 #define KVM_EPT_SAMPLE_CMD_SET_FREQ     1202
 #define KVM_EPT_SAMPLE_CMD_GET_MEMSLOTS 1203
 #define KVM_EPT_SAMPLE_CMD_DEINIT       1204
+#define KVM_EPT_SAMPLE_CMD_SET_WSS      1205
+#define KVM_EPT_SAMPLE_CMD_GET_WSS      1206
+#define KVM_EPT_SAMPLE_CMD_GET_MEMSLOTS_GEN 1207
+#define KVM_EPT_SAMPLE_CMD_SET_FORMAT   1208
+#define KVM_EPT_SAMPLE_CMD_GET_STATS    1209
+#define KVM_EPT_SAMPLE_CMD_GET_LATENCY  1210
+#define KVM_EPT_SAMPLE_CMD_RESET_LATENCY    1211
+#define KVM_EPT_SAMPLE_CMD_SET_VCPU_BUDGET  1212
+#define KVM_EPT_SAMPLE_CMD_SET_SWEEP_CPUS   1213
+#define KVM_EPT_SAMPLE_CMD_GET_MEMSLOTS_EX  1214
+
+#define KVM_EPT_SAMPLE_FORMAT_COMPACT   0   // samples are 'struct kvm_ept_sample_sample'
+#define KVM_EPT_SAMPLE_FORMAT_ANNOTATED 1   // samples are 'struct kvm_ept_sample_annotated'
 
 #include <stdint.h>
 
 // the structure of a sample
+// A sample with xwr = 0 is an event telling that memslots have changed since the latest
+// GET_MEMSLOTS or GET_MEMSLOTS_EX, and its gfn is the low bits of the new generation.
 struct kvm_ept_sample_sample
 {
     uint32_t gfn: 29;   // the Guest Physical Page Frame Number
     uint32_t xwr: 3;    // the 'or' bits of access type
 };
 
+// the structure of an annotated sample, see KVM_EPT_SAMPLE_CMD_SET_FORMAT
+// The HVA and the host NUMA node are got by the kernel when handling the EPT violation.
+// An event has xwr = 0 as well, and its gfn is the new generation of memslots.
+struct kvm_ept_sample_annotated
+{
+    uint64_t gfn: 61;   // the Guest Physical Page Frame Number
+    uint64_t xwr: 3;    // the 'or' bits of access type
+    uint64_t hva;       // the Host Virtual Address of the page, 0 if not in any memslot
+    int32_t slot;       // (as_id << 16) | id of the memslot, -1 if not in any memslot
+    int32_t node;       // the host NUMA node of the page, -1 if unknown
+};
+
 // the structure of a memslot
 // Guest Physical Address (GPA) is mapped to Host Virtual Addess (HVA) by 'memory slots'
 // For example, a kvm instance has 3 memory slots:
@@ -26,6 +53,7 @@ struct kvm_ept_sample_sample
 // |  0x400000  |  0x7f0000800000  |  32768  |
 // |  0x900000  |  0x7f0001200000  |    160  |
 // so GPA = 0x412345 is in the second slot, and mapped to HVA = 0x7f0000812345
+// Only slots of the normal address space are returned, see GET_MEMSLOTS_EX for all of them.
 struct kvm_ept_sample_get_memslots
 {
     struct kvm_ept_sample_memslot
@@ -39,4 +67,78 @@ struct kvm_ept_sample_get_memslots
     size_t count;       // the actual count of the array
 };
 
+// the argument of GET_MEMSLOTS_EX command, which returns slots of all address spaces, the
+// normal one (as_id = 0) at first, together with their generation
+// Slots of other address spaces (e.g. SMM) overlay the normal ones.
+struct kvm_ept_sample_get_memslots_ex
+{
+    struct kvm_ept_sample_memslot_ex
+    {
+        uint64_t gpa;       // the base GPA
+        uint64_t hva;       // the base HVA
+        size_t page_count;  // count of pages in the slot
+        uint32_t as_id;     // the address space of the slot
+        uint32_t id;        // the id of the slot in its address space
+    }*
+    memslots;           // the array of slots
+    size_t capacity;    // the max count of the array
+    size_t count;       // the actual count of the array
+    uint64_t generation;    // the generation of the slots, changes when slots change
+};
+
+// the working-set-size of an interval, counted in 2MB regions
+struct kvm_ept_sample_wss
+{
+    uint64_t time;          // the end of the interval, in ms since the Epoch
+    uint32_t interval;      // the length of the interval, in ms
+    uint32_t present;       // count of present regions armed at the start of the interval
+    uint32_t read;          // count of regions accessed (read or written)
+    uint32_t write;         // count of regions written
+    uint32_t exec;          // count of regions executed
+    uint32_t reserved;
+};
+
+// the argument of GET_WSS command, the oldest records are taken out
+struct kvm_ept_sample_get_wss
+{
+    struct kvm_ept_sample_wss* records; // the array of records
+    size_t capacity;    // the max count of the array
+    size_t count;       // the actual count of the array
+};
+
+// the argument of SET_SWEEP_CPUS command, e.g. { (unsigned long*)&cpu_set, sizeof(cpu_set) }
+// a NULL mask restores the default, the housekeeping CPUs
+struct kvm_ept_sample_sweep_cpus
+{
+    unsigned long* mask;    // the bitmap of allowed CPUs, bit n for CPU n
+    size_t size;        // the size of the bitmap in bytes
+};
+
+// the argument of GET_STATS command, counters since the fd is opened
+struct kvm_ept_sample_stats
+{
+    uint64_t buffered;      // count of samples buffered for read()
+    uint64_t dropped;       // count of samples dropped, as the buffer of a CPU is full
+};
+
+#define KVM_EPT_SAMPLE_LATENCY_SAMPLE   0   // handling an EPT violation of a landmine
+#define KVM_EPT_SAMPLE_LATENCY_SWEEP    1   // a sweep setting landmines
+#define KVM_EPT_SAMPLE_LATENCY_KINDS    2
+#define KVM_EPT_SAMPLE_LATENCY_BUCKETS  64
+
+// the argument of GET_LATENCY command, latencies since INIT or the latest RESET_LATENCY
+// Only available if the module is built with 'make LATENCY=1'.
+struct kvm_ept_sample_latency
+{
+    struct kvm_ept_sample_latency_histogram
+    {
+        uint64_t counts[KVM_EPT_SAMPLE_LATENCY_BUCKETS];    // i: count of [2^i, 2^(i+1)) TSC cycles
+        uint64_t p50;       // the median in ns, rounded up to the end of its bucket
+        uint64_t p99;       // the 99th percentile in ns, rounded up to the end of its bucket
+        uint64_t max;       // the max in ns
+    }
+    histograms[KVM_EPT_SAMPLE_LATENCY_KINDS];
+    uint64_t tsc_khz;       // the TSC frequency, to convert 'counts' to time
+};
+
 #endif
@@ -0,0 +1,317 @@
+#ifndef KVM_EPT_TRACE_H
+#define KVM_EPT_TRACE_H
+
+// A compact binary trace of samples, to record a VM's access stream once and replay it
+// offline as many times as needed.
+//
+// Layout of a trace file:
+// | struct kvm_ept_trace_header                                |
+// | struct kvm_ept_sample_memslot_ex * header.memslot_count    |
+// | struct kvm_ept_trace_block | payload of block.size bytes   |
+// | struct kvm_ept_trace_block | payload of block.size bytes   |
+// | ...                                                        |
+// In the payload of a block, every sample takes two LEB128 varints:
+//      1. (zigzag(gfn - gfn of previous sample) << 3) | xwr
+//      2. time_us - time_us of previous sample
+// The 'previous sample' of the first sample in a block is (block.base_gfn,
+// block.base_time_us), so every block can be decoded by itself.
+// Neighboring samples are mostly close in GFN and equal in time, so a sample usually
+// takes 3~5 bytes.
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "kvm_ept_sample.h"
+
+#define KVM_EPT_TRACE_MAGIC         "KVMEPTTR"
+#define KVM_EPT_TRACE_VERSION       2
+#define KVM_EPT_TRACE_BLOCK_SIZE    65536   // max size of payload of a block
+#define KVM_EPT_TRACE_MAX_SAMPLE    15      // max bytes of an encoded sample
+
+struct kvm_ept_trace_header
+{
+    char magic[8];              // KVM_EPT_TRACE_MAGIC
+    uint32_t version;           // KVM_EPT_TRACE_VERSION
+    uint32_t memslot_count;     // count of memslots following the header
+    uint64_t start_time_us;     // when the recording starts, in us since the Epoch
+};
+
+struct kvm_ept_trace_block
+{
+    uint32_t sample_count;      // count of samples in this block
+    uint32_t size;              // size of payload in bytes
+    uint64_t base_time_us;      // the time base of the first sample, in us since start
+    uint32_t base_gfn;          // the GFN base of the first sample
+    uint32_t reserved;
+};
+
+struct kvm_ept_trace_writer
+{
+    FILE* file;
+    uint64_t start_time_us;
+    struct kvm_ept_trace_block block;   // the block being filled
+    uint32_t last_gfn;
+    uint64_t last_time_us;
+    uint8_t payload[KVM_EPT_TRACE_BLOCK_SIZE];
+};
+
+struct kvm_ept_trace_reader
+{
+    FILE* file;
+    struct kvm_ept_trace_header header;
+    struct kvm_ept_sample_memslot_ex* memslots;
+    struct kvm_ept_trace_block block;   // the block being decoded
+    size_t position;                    // position in 'payload'
+    uint32_t decoded;                   // count of decoded samples in 'block'
+    uint32_t last_gfn;
+    uint64_t last_time_us;
+    uint8_t payload[KVM_EPT_TRACE_BLOCK_SIZE];
+};
+
+static inline uint8_t* kvm_ept_trace_put_varint(uint8_t* p, uint64_t value)
+{
+    while(value >= 0x80)
+    {
+        *(p++) = (uint8_t)value | 0x80;
+        value >>= 7;
+    }
+    *(p++) = (uint8_t)value;
+    return p;
+}
+
+static inline const uint8_t* kvm_ept_trace_get_varint(const uint8_t* p, const uint8_t* end,
+    uint64_t* value)
+{
+    uint64_t result = 0;
+    for(int shift = 0; p < end && shift < 64; shift += 7)
+    {
+        uint8_t byte = *(p++);
+        result |= (uint64_t)(byte & 0x7f) << shift;
+        if(!(byte & 0x80))
+        {
+            (*value) = result;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+static inline int kvm_ept_trace_flush(struct kvm_ept_trace_writer* writer)
+{
+    if(!writer->block.sample_count)
+        return 0;
+    if(fwrite(&(writer->block), sizeof(struct kvm_ept_trace_block), 1, writer->file) != 1 ||
+        fwrite(writer->payload, 1, writer->block.size, writer->file) != writer->block.size)
+        return -1;
+    writer->block.sample_count = 0;
+    writer->block.size = 0;
+    return 0;
+}
+
+// create a trace file, and write the memslot table to its header
+//  start_time_us: the time of the start of recording, in us since the Epoch
+// return 0 if succeed, or -1 with errno set
+static inline int kvm_ept_trace_writer_open(struct kvm_ept_trace_writer* writer,
+    const char* path, const struct kvm_ept_sample_memslot_ex* memslots, size_t memslot_count,
+    uint64_t start_time_us)
+{
+    if(!(writer->file = fopen(path, "wb")))
+        return -1;
+    struct kvm_ept_trace_header header =
+    {
+        .version = KVM_EPT_TRACE_VERSION,
+        .memslot_count = (uint32_t)memslot_count,
+        .start_time_us = start_time_us,
+    };
+    memcpy(header.magic, KVM_EPT_TRACE_MAGIC, sizeof(header.magic));
+    if(fwrite(&header, sizeof(header), 1, writer->file) != 1 ||
+        fwrite(memslots, sizeof(struct kvm_ept_sample_memslot_ex), memslot_count, writer->file) !=
+            memslot_count)
+    {
+        fclose(writer->file);
+        return -1;
+    }
+    writer->start_time_us = start_time_us;
+    writer->block.sample_count = 0;
+    writer->block.size = 0;
+    // time is clamped against 'last_time_us' before the first block sets it
+    writer->last_gfn = 0;
+    writer->last_time_us = 0;
+    return 0;
+}
+
+// append samples that are read at the same time
+//  time_us: when the samples are read, in us since the Epoch
+// return 0 if succeed, or -1 with errno set
+static inline int kvm_ept_trace_write(struct kvm_ept_trace_writer* writer,
+    const struct kvm_ept_sample_sample* samples, size_t count, uint64_t time_us)
+{
+    time_us = time_us > writer->start_time_us ? time_us - writer->start_time_us : 0;
+    if(time_us < writer->last_time_us)
+        time_us = writer->last_time_us;
+    for(size_t i = 0; i < count; i++)
+    {
+        if(writer->block.size + KVM_EPT_TRACE_MAX_SAMPLE > KVM_EPT_TRACE_BLOCK_SIZE &&
+            kvm_ept_trace_flush(writer))
+            return -1;
+        uint32_t gfn = samples[i].gfn;
+        if(!writer->block.sample_count)
+        {
+            writer->block.base_time_us = time_us;
+            writer->block.base_gfn = gfn;
+            writer->last_time_us = time_us;
+            writer->last_gfn = gfn;
+        }
+        int64_t gfn_delta = (int64_t)gfn - (int64_t)writer->last_gfn;
+        uint64_t zigzag = ((uint64_t)gfn_delta << 1) ^ (uint64_t)(gfn_delta >> 63);
+        uint8_t* p = writer->payload + writer->block.size;
+        p = kvm_ept_trace_put_varint(p, (zigzag << 3) | samples[i].xwr);
+        p = kvm_ept_trace_put_varint(p, time_us - writer->last_time_us);
+        writer->block.size = (uint32_t)(p - writer->payload);
+        writer->block.sample_count++;
+        writer->last_gfn = gfn;
+        writer->last_time_us = time_us;
+    }
+    return 0;
+}
+
+// flush the last block and close the file
+// return 0 if succeed, or -1 with errno set
+static inline int kvm_ept_trace_writer_close(struct kvm_ept_trace_writer* writer)
+{
+    int ret = kvm_ept_trace_flush(writer);
+    if(fclose(writer->file))
+        ret = -1;
+    return ret;
+}
+
+// open a trace file to replay
+// return 0 if succeed, or -1 with errno set
+static inline int kvm_ept_trace_reader_open(struct kvm_ept_trace_reader* reader,
+    const char* path)
+{
+    if(!(reader->file = fopen(path, "rb")))
+        return -1;
+    struct kvm_ept_trace_header* header = &(reader->header);
+    if(fread(header, sizeof(struct kvm_ept_trace_header), 1, reader->file) != 1 ||
+        memcmp(header->magic, KVM_EPT_TRACE_MAGIC, sizeof(header->magic)) ||
+        header->version != KVM_EPT_TRACE_VERSION)
+    {
+        fclose(reader->file);
+        errno = EINVAL;
+        return -1;
+    }
+    if(!(reader->memslots = malloc(sizeof(struct kvm_ept_sample_memslot_ex) *
+        (header->memslot_count + 1))))
+    {
+        fclose(reader->file);
+        return -1;
+    }
+    if(fread(reader->memslots, sizeof(struct kvm_ept_sample_memslot_ex), header->memslot_count,
+        reader->file) != header->memslot_count)
+    {
+        free(reader->memslots);
+        fclose(reader->file);
+        errno = EINVAL;
+        return -1;
+    }
+    reader->block.sample_count = 0;
+    reader->decoded = 0;
+    reader->last_gfn = 0;
+    reader->last_time_us = 0;
+    return 0;
+}
+
+// the same as ioctl(fd, KVM_EPT_SAMPLE_CMD_GET_MEMSLOTS_EX, param), but from the trace
+static inline int kvm_ept_trace_get_memslots(struct kvm_ept_trace_reader* reader,
+    struct kvm_ept_sample_get_memslots_ex* param)
+{
+    if(!param)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if(param->memslots)
+    {
+        size_t count = reader->header.memslot_count;
+        if(count > param->capacity)
+            count = param->capacity;
+        memcpy(param->memslots, reader->memslots, sizeof(struct kvm_ept_sample_memslot_ex) * count);
+    }
+    param->count = reader->header.memslot_count;
+    param->generation = 0;
+    return 0;
+}
+
+// the same as read(fd, buffer, capacity), but from the trace, and as fast as possible
+// all samples returned by one call are recorded at the same time,
+// which is given by kvm_ept_trace_time_us() then
+// return the size of samples in bytes, 0 at the end of trace, or -1 with errno set
+static inline ssize_t kvm_ept_trace_read(struct kvm_ept_trace_reader* reader,
+    void* buffer, size_t capacity)
+{
+    struct kvm_ept_sample_sample* samples = buffer;
+    size_t max_count = capacity / sizeof(struct kvm_ept_sample_sample), count = 0;
+    while(count < max_count)
+    {
+        if(reader->decoded == reader->block.sample_count)
+        {
+            struct kvm_ept_trace_block* block = &(reader->block);
+            if(count)
+                break;
+            if(fread(block, sizeof(struct kvm_ept_trace_block), 1, reader->file) != 1)
+                return 0;
+            if(block->size > KVM_EPT_TRACE_BLOCK_SIZE ||
+                fread(reader->payload, 1, block->size, reader->file) != block->size)
+            {
+                errno = EINVAL;
+                return -1;
+            }
+            reader->position = 0;
+            reader->decoded = 0;
+            reader->last_gfn = block->base_gfn;
+            reader->last_time_us = block->base_time_us;
+            continue;
+        }
+        const uint8_t* p = reader->payload + reader->position;
+        const uint8_t* end = reader->payload + reader->block.size;
+        uint64_t head, time_delta;
+        if(!(p = kvm_ept_trace_get_varint(p, end, &head)) ||
+            !(p = kvm_ept_trace_get_varint(p, end, &time_delta)))
+        {
+            errno = EINVAL;
+            return -1;
+        }
+        // stop at a new timestamp, so that one call returns samples of one time
+        if(time_delta && count)
+            break;
+        uint64_t zigzag = head >> 3;
+        int64_t gfn_delta = (int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1);
+        reader->last_gfn = (uint32_t)((int64_t)reader->last_gfn + gfn_delta);
+        reader->last_time_us += time_delta;
+        reader->position = p - reader->payload;
+        reader->decoded++;
+        samples[count].gfn = reader->last_gfn;
+        samples[count].xwr = head & 7;
+        count++;
+    }
+    return count * sizeof(struct kvm_ept_sample_sample);
+}
+
+// the time of samples returned by the latest kvm_ept_trace_read(), in us since the Epoch
+static inline uint64_t kvm_ept_trace_time_us(struct kvm_ept_trace_reader* reader)
+{
+    return reader->header.start_time_us + reader->last_time_us;
+}
+
+static inline void kvm_ept_trace_reader_close(struct kvm_ept_trace_reader* reader)
+{
+    free(reader->memslots);
+    fclose(reader->file);
+}
+
+#endif
@@ -0,0 +1,117 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "arc.h"
+
+int arc_init(struct arc* arc, size_t ghost_count)
+{
+    pthread_mutex_init(&(arc->lock), NULL);
+    arc->map = NULL;
+    arc->region_count = 0;
+    arc->ring_capacity = ghost_count > ARC_MIN_GHOSTS ? ghost_count : ARC_MIN_GHOSTS;
+    arc->ring_next = 0;
+    arc->counts[0] = 0;
+    arc->counts[1] = 0;
+    arc->target = 0;
+    if(!(arc->ring = malloc(sizeof(uint32_t) * arc->ring_capacity)))
+    {
+        pthread_mutex_destroy(&(arc->lock));
+        return -1;
+    }
+    return 0;
+}
+
+void arc_deinit(struct arc* arc)
+{
+    free(arc->ring);
+    arc->ring = NULL;
+    free(arc->map);
+    arc->map = NULL;
+    pthread_mutex_destroy(&(arc->lock));
+}
+
+int arc_reserve(struct arc* arc, size_t region_count)
+{
+    pthread_mutex_lock(&(arc->lock));
+    if(region_count > arc->region_count)
+    {
+        uint32_t* map = realloc(arc->map, sizeof(uint32_t) * region_count);
+        if(!map)
+        {
+            pthread_mutex_unlock(&(arc->lock));
+            return -1;
+        }
+        memset(map + arc->region_count, 0, sizeof(uint32_t) * (region_count -
+            arc->region_count));
+        arc->map = map;
+        arc->region_count = region_count;
+    }
+    pthread_mutex_unlock(&(arc->lock));
+    return 0;
+}
+
+// forget the ghost of a region
+// the lock must be held
+static void forget(struct arc* arc, uint64_t region)
+{
+    arc->counts[arc->map[region] & 1]--;
+    arc->map[region] = 0;
+}
+
+void arc_on_demoted(struct arc* arc, uint64_t region, int frequent)
+{
+    pthread_mutex_lock(&(arc->lock));
+    if(region >= arc->region_count)
+    {
+        pthread_mutex_unlock(&(arc->lock));
+        return;
+    }
+    size_t slot = arc->ring_next++ % arc->ring_capacity;
+    // the oldest ghost expires, unless its region has been demoted again since then
+    if(arc->ring_next > arc->ring_capacity)
+    {
+        uint32_t expired = arc->ring[slot];
+        if(arc->map[expired] >> 1 == slot + 1)
+            forget(arc, expired);
+    }
+    if(arc->map[region])
+        forget(arc, region);
+    arc->ring[slot] = (uint32_t)region;
+    arc->map[region] = (uint32_t)(slot + 1) << 1 | (frequent ? 1 : 0);
+    arc->counts[frequent ? 1 : 0]++;
+    pthread_mutex_unlock(&(arc->lock));
+}
+
+int arc_on_hit(struct arc* arc, uint64_t region, size_t unit_pages, size_t capacity)
+{
+    pthread_mutex_lock(&(arc->lock));
+    if(region >= arc->region_count || !arc->map[region])
+    {
+        pthread_mutex_unlock(&(arc->lock));
+        return 0;
+    }
+    size_t recent = arc->counts[0], frequent = arc->counts[1];
+    if(arc->map[region] & 1)
+    {
+        // a frequent page was demoted too early, give less to recent pages
+        size_t delta = unit_pages * (recent > frequent && frequent ? recent / frequent : 1);
+        arc->target = arc->target > delta ? arc->target - delta : 0;
+    }
+    else
+    {
+        // a recent page was demoted too early, give more to recent pages
+        size_t delta = unit_pages * (frequent > recent && recent ? frequent / recent : 1);
+        arc->target = arc->target + delta < capacity ? arc->target + delta : capacity;
+    }
+    forget(arc, region);
+    pthread_mutex_unlock(&(arc->lock));
+    return 1;
+}
+
+float arc_recent_weight(struct arc* arc, size_t recent)
+{
+    pthread_mutex_lock(&(arc->lock));
+    size_t target = arc->target;
+    pthread_mutex_unlock(&(arc->lock));
+    return recent > target ? (float)target / recent : 1;
+}
@@ -0,0 +1,61 @@
+#ifndef ARC_H
+#define ARC_H
+
+// The ghost history of a scan-resistant placement, in the manner of ARC (Adaptive
+// Replacement Cache, Megiddo and Modha).
+// A page sampled in only one scan interval is recent (T1 of ARC), and one sampled in two
+// intervals at least is frequent (T2). Only frequent pages are promoted, so a one-off
+// sequential scan never floods the fastest tier. Regions (2MB) demoted from the fastest
+// tier are remembered as ghosts, in B1 if the demoted page was recent, or in B2 if it was
+// frequent, within as many regions as the fastest tier may hold. A page of a ghost region
+// is admitted at its first sample again, and the hit moves the target of recent pages in
+// the fastest tier the way ARC moves 'p': up for a B1 hit, as recent pages were demoted
+// too early, and down for a B2 hit.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#define ARC_REGION_SHIFT    9       // 2MB regions
+#define ARC_MIN_GHOSTS      64
+
+struct arc
+{
+    pthread_mutex_t lock;
+    // for every region, 0 if it's not a ghost, or (its slot in 'ring' + 1) << 1 | frequent
+    uint32_t* map;
+    size_t region_count;        // count of regions in 'map'
+    uint32_t* ring;             // ghost regions in the order of demotion, oldest expire first
+    size_t ring_capacity;
+    size_t ring_next;           // count of regions ever put in 'ring'
+    size_t counts[2];           // count of ghosts in B1 and B2
+    size_t target;              // the target of recent pages in the fastest tier, in 4KB pages
+};
+
+// ghost_count: max ghost regions, e.g. regions of the fastest tier the VM may hold
+// return 0 if succeed, or -1 if out of memory
+int arc_init(struct arc* arc, size_t ghost_count);
+
+void arc_deinit(struct arc* arc);
+
+// cover regions [0, region_count) in the history, regions out of it are never ghosts
+// return 0 if succeed, or -1 if out of memory
+int arc_reserve(struct arc* arc, size_t region_count);
+
+// remember a region, as a page of it has been demoted from the fastest tier
+//  frequent: is the demoted page frequent
+void arc_on_demoted(struct arc* arc, uint64_t region, int frequent);
+
+// check if a page sampled out of the fastest tier hits a ghost, and consume the ghost
+//  unit_pages: 4KB pages of the page
+//  capacity: the VM's share of the fastest tier, in 4KB pages
+// return 1 if it hits a ghost, or 0 if not
+int arc_on_hit(struct arc* arc, uint64_t region, size_t unit_pages, size_t capacity);
+
+// the weight of temperatures of recent pages in the fastest tier, so that they go first
+// when there are more of them than the target
+//  recent: estimated count of recent pages in the fastest tier, in 4KB pages
+// return the weight, 0 ~ 1
+float arc_recent_weight(struct arc* arc, size_t recent);
+
+#endif
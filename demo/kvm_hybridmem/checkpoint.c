@@ -0,0 +1,232 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <dirent.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "checkpoint.h"
+
+// get the start time of a process in clock ticks since boot, which tells it from a later
+// process with the same pid
+// return 0 if succeed, or -1 if it has exited
+static int get_start_time(pid_t pid, unsigned long long* p_start_time)
+{
+    char path[64], text[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    FILE* file = fopen(path, "r");
+    if(!file)
+        return -1;
+    size_t len = fread(text, 1, sizeof(text) - 1, file);
+    fclose(file);
+    text[len] = '\0';
+    // the command may contain anything, fields go after the last ')'
+    char* fields = strrchr(text, ')');
+    // skip 'state' to 'itrealvalue', the 3rd to the 21st field
+    if(!fields || sscanf(fields + 1, "%*s %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %*u %*u "
+        "%*d %*d %*d %*d %*d %*d %llu", p_start_time) != 1)
+        return -1;
+    return 0;
+}
+
+// get the path of the checkpoint of a VM
+// return 0 if succeed, or -1 if the VM has exited
+static int get_path(struct vm* vm, char* path, size_t size)
+{
+    unsigned long long start_time;
+    if(get_start_time(vm->params.pid, &start_time))
+        return -1;
+    snprintf(path, size, "%s/vm-%d-%llu.ckpt", vm->params.checkpoint_dir,
+        (int)vm->params.pid, start_time);
+    return 0;
+}
+
+// FNV-1a of GPA ranges of memslots of the normal address space, by GPA
+static uint64_t get_layout(struct vm* vm)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    pthread_mutex_lock(&(vm->memslot_lock));
+    for(size_t i = 0; i < vm->memslots.sorted_count; i++)
+    {
+        uint64_t values[2] = {vm->memslots.sorted[i].gpa, vm->memslots.sorted[i].page_count};
+        const uint8_t* bytes = (const uint8_t*)values;
+        for(size_t j = 0; j < sizeof(values); j++)
+            hash = (hash ^ bytes[j]) * 0x100000001b3ULL;
+    }
+    pthread_mutex_unlock(&(vm->memslot_lock));
+    return hash;
+}
+
+static size_t get_chunk_size(struct vm* vm, unsigned shift)
+{
+    return vm->pages.entry_size * (PAGE_TABLE_CHUNK_PAGES >> shift);
+}
+
+void checkpoint_clean(const char* dir)
+{
+    DIR* entries = opendir(dir);
+    if(!entries)
+        return;
+    struct dirent* entry;
+    while((entry = readdir(entries)))
+    {
+        int pid;
+        unsigned long long start_time, current_start_time;
+        char tail;
+        if(sscanf(entry->d_name, "vm-%d-%llu.ckp%c", &pid, &start_time, &tail) != 3 ||
+            tail != 't')
+            continue;
+        if(!get_start_time(pid, &current_start_time) && current_start_time == start_time)
+            continue;
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        unlink(path);
+    }
+    closedir(entries);
+}
+
+int checkpoint_save(struct vm* vm)
+{
+    char path[512], temp_path[520];
+    if(get_path(vm, path, sizeof(path)))
+    {
+        errno = ESRCH;
+        return -1;
+    }
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+    FILE* file = fopen(temp_path, "w");
+    if(!file)
+        return -1;
+    struct checkpoint_header header = {
+        .magic = CHECKPOINT_MAGIC,
+        .version = CHECKPOINT_VERSION,
+        .entry_size = vm->pages.entry_size,
+        .layout = get_layout(vm),
+        .start_time = vm->clock.start_time,
+        .half_life = vm->clock.half_life,
+        .chunk_count = 0,
+        .save_time = get_current_ms(),
+        .scan_count = __atomic_load_n(&(vm->scan_count), __ATOMIC_RELAXED),
+    };
+    for(size_t i = 0; i < PAGE_TABLE_CHUNK_COUNT; i++)
+        header.chunk_count += !!__atomic_load_n(&(vm->pages.chunks[i]), __ATOMIC_ACQUIRE);
+    int failed = fwrite(&header, sizeof(header), 1, file) != 1;
+    // units are copied without locks of shards, so a unit being updated may be torn, which
+    // only costs the temperature of that unit
+    size_t chunk_count = 0;
+    for(size_t i = 0; !failed && i < PAGE_TABLE_CHUNK_COUNT &&
+        chunk_count < header.chunk_count; i++)
+    {
+        void* data = __atomic_load_n(&(vm->pages.chunks[i]), __ATOMIC_ACQUIRE);
+        if(!data)
+            continue;
+        struct checkpoint_chunk chunk = {.index = i, .shift = vm->pages.shifts[i]};
+        failed = fwrite(&chunk, sizeof(chunk), 1, file) != 1 ||
+            fwrite(data, get_chunk_size(vm, chunk.shift), 1, file) != 1;
+        chunk_count++;
+    }
+    // a chunk populated while writing is left to the next checkpoint
+    if(!failed && chunk_count < header.chunk_count)
+    {
+        header.chunk_count = chunk_count;
+        failed = fseek(file, 0, SEEK_SET) || fwrite(&header, sizeof(header), 1, file) != 1;
+    }
+    // data must be durable before the rename is
+    if(fflush(file) || fsync(fileno(file)))
+        failed = 1;
+    int error = errno;
+    fclose(file);
+    if(failed || rename(temp_path, path))
+    {
+        error = failed ? error : errno;
+        unlink(temp_path);
+        errno = error;
+        return -1;
+    }
+    // make the rename durable
+    int dir_fd = open(vm->params.checkpoint_dir, O_RDONLY | O_DIRECTORY);
+    if(dir_fd >= 0)
+    {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+    return 0;
+}
+
+int checkpoint_load(struct vm* vm)
+{
+    char path[512];
+    if(get_path(vm, path, sizeof(path)))
+        return 0;
+    int fd = open(path, O_RDONLY);
+    if(fd < 0)
+        return errno == ENOENT ? 0 : -1;
+    struct stat st;
+    if(fstat(fd, &st))
+    {
+        close(fd);
+        return -1;
+    }
+    size_t size = st.st_size;
+    if(size < sizeof(struct checkpoint_header))
+    {
+        close(fd);
+        return 0;
+    }
+    const char* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED)
+        return -1;
+    const struct checkpoint_header* header = (const struct checkpoint_header*)data;
+    if(header->magic != CHECKPOINT_MAGIC || header->version != CHECKPOINT_VERSION ||
+        header->entry_size != vm->pages.entry_size || header->layout != get_layout(vm) ||
+        header->half_life != vm->params.half_life)
+    {
+        munmap((void*)data, size);
+        return 0;
+    }
+    // temperatures go on cooling from where they are, as if nothing has been missed, but
+    // epochs wrap around, so all pages are moved to the current epoch at once, or cooled
+    // down to nothing if they have been down for more than 32 half-lives
+    temperature_clock_init(&(vm->clock), header->start_time, header->half_life);
+    uint64_t current_time = get_current_ms();
+    uint16_t epoch = temperature_epoch(&(vm->clock), current_time);
+    int expired = current_time > header->save_time && current_time - header->save_time >=
+        vm->clock.epoch_length * 32 / TEMPERATURE_EPOCH_HALF_LIVES;
+    size_t offset = sizeof(struct checkpoint_header);
+    for(uint32_t i = 0; i < header->chunk_count; i++)
+    {
+        if(offset + sizeof(struct checkpoint_chunk) > size)
+            break;
+        const struct checkpoint_chunk* chunk = (const struct checkpoint_chunk*)(data + offset);
+        offset += sizeof(struct checkpoint_chunk);
+        if(chunk->index >= PAGE_TABLE_CHUNK_COUNT || chunk->shift > PAGE_TABLE_HUGE_SHIFT)
+            break;
+        size_t chunk_size = get_chunk_size(vm, chunk->shift);
+        if(offset + chunk_size > size)
+            break;
+        char* units = vm->pages.chunks[chunk->index];
+        if(units && vm->pages.shifts[chunk->index] == chunk->shift)
+        {
+            memcpy(units, data + offset, chunk_size);
+            // nodes are refreshed by the first scan, which lists candidates again
+            for(size_t j = 0; j < PAGE_TABLE_CHUNK_PAGES >> chunk->shift; j++)
+            {
+                struct page_info* page = (struct page_info*)(units + vm->pages.entry_size * j);
+                page->node_inited = 0;
+                page->hot_listed = 0;
+                page->upper_listed = 0;
+                page->temperature = expired ? 0 :
+                    temperature_rebase(page->temperature, page->epoch, epoch);
+                page->epoch = epoch;
+            }
+        }
+        offset += chunk_size;
+    }
+    // stamps of pages go on with the count of scans
+    vm->scan_count = header->scan_count;
+    munmap((void*)data, size);
+    return 1;
+}
@@ -0,0 +1,55 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+// Checkpoints of page information, so that a restarted kvm_hybridmem resumes with the
+// temperatures it has learned, instead of warming up from cold for minutes.
+// A checkpoint is a file per VM instance, named by its pid and the start time of the
+// process, as a pid alone may be reused. It holds a header, then populated chunks of the
+// page table as they are in memory, so it's loaded by mapping the file and copying chunks
+// back. It's written to a temporary file, synced and renamed over the old one, so a crash
+// leaves either the old checkpoint or the new one, never a torn one.
+// Temperatures are relative to the clock of the VM, so the clock is restored as well, and
+// so is the count of scans, which stamps of pages are relative to.
+// A checkpoint only applies to the same memslot layout, and units of a chunk only if the
+// chunk has the same unit size.
+
+#include <stdint.h>
+
+#include "vm.h"
+
+#define CHECKPOINT_MAGIC    0x54504b434d48564bULL   // "KVHMCKPT"
+#define CHECKPOINT_VERSION  2
+
+struct checkpoint_header
+{
+    uint64_t magic;             // CHECKPOINT_MAGIC
+    uint32_t version;           // CHECKPOINT_VERSION
+    uint32_t entry_size;        // sizeof(struct page_info)
+    uint64_t layout;            // the hash of the memslot layout
+    uint64_t start_time;        // the start of epoch 0 of the clock, in ms
+    float half_life;            // the half-life of the clock, in ms
+    uint32_t chunk_count;       // count of chunks following the header
+    uint64_t save_time;         // when the checkpoint is written, in ms
+    uint64_t scan_count;        // the count of scans of the VM
+};
+
+// a chunk in a checkpoint, followed by its units
+struct checkpoint_chunk
+{
+    uint32_t index;             // the index of the chunk in the page table
+    uint32_t shift;             // log2 of pages per unit of the chunk
+};
+
+// remove checkpoints of VMs that have exited, e.g. while kvm_hybridmem was down
+void checkpoint_clean(const char* dir);
+
+// (the policy) write the checkpoint of a VM
+// return 0 if succeed, or -1 with errno set
+int checkpoint_save(struct vm* vm);
+
+// (vm_init(), before any sample) restore page information and the clock of a VM from its
+// checkpoint
+// return 1 if restored, 0 if there is no checkpoint that applies, or -1 with errno set
+int checkpoint_load(struct vm* vm);
+
+#endif
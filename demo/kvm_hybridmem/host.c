@@ -0,0 +1,530 @@
+#include <math.h>
+#include <poll.h>
+#include <errno.h>
+#include <stdio.h>
+#include <dirent.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "host.h"
+#include "metrics.h"
+#include "checkpoint.h"
+
+#define POLL_TIMEOUT        100     // ms to wait for samples
+#define DISCOVER_INTERVAL   5000    // ms between discoveries of VMs
+#define WORKER_IDLE_US      1000    // us a worker sleeps when all its shards are empty
+#define MIGRATE_TICK        10      // ms between rounds of dispatching migrations
+#define MIGRATE_BURST       100     // ms of bandwidth that may go at once
+#define MIGRATE_THREADS     2       // threads issuing move_pages()
+#define REPORT_INTERVAL     1000    // ms between reports of migration
+#define CHECKPOINT_INTERVAL 60000   // ms between checkpoints of VMs
+#define METRICS_INTERVAL    1000    // ms between refreshes of metrics
+
+// the host, for on_batch_done(), which has no context but the batch
+static struct host* migrating_host;
+
+static void sleep_until(uint64_t time)
+{
+    uint64_t current_time = get_current_ms();
+    if(time > current_time)
+        usleep((time - current_time) * 1000);
+}
+
+static void put_vm(struct host_vm* vm)
+{
+    if(!__atomic_sub_fetch(&(vm->refs), 1, __ATOMIC_ACQ_REL))
+    {
+        vm_deinit(&(vm->vm));
+        free(vm);
+    }
+}
+
+// take references of all VMs, so they keep valid while the reader drops them
+//  vms: output VMs, MAX_VMS of them at most
+// return count of VMs
+static size_t get_vms(struct host* host, struct host_vm** vms)
+{
+    pthread_rwlock_rdlock(&(host->vm_lock));
+    size_t count = host->vm_count;
+    for(size_t i = 0; i < count; i++)
+    {
+        vms[i] = host->vms[i];
+        __atomic_add_fetch(&(vms[i]->refs), 1, __ATOMIC_RELAXED);
+    }
+    pthread_rwlock_unlock(&(host->vm_lock));
+    return count;
+}
+
+static void put_vms(struct host_vm** vms, size_t count)
+{
+    for(size_t i = 0; i < count; i++)
+        put_vm(vms[i]);
+}
+
+// (the reader, or before threads start) start managing a VM
+// return 0 if succeed, or -1 with a message printed
+static int add_vm(struct host* host, const struct vm_params* params)
+{
+    if(host->vm_count == MAX_VMS)
+    {
+        fprintf(stderr, "too many VMs, VM %d is not managed\n", (int)params->pid);
+        return -1;
+    }
+    struct host_vm* vm = malloc(sizeof(struct host_vm));
+    if(!vm)
+    {
+        fprintf(stderr, "malloc() failed, VM %d is not managed\n", (int)params->pid);
+        return -1;
+    }
+    if(vm_init(&(vm->vm), params))
+    {
+        fprintf(stderr, "vm_init() failed, VM %d is not managed\n", (int)params->pid);
+        free(vm);
+        return -1;
+    }
+    // held by 'vms'
+    vm->refs = 1;
+    vm->dropped = 0;
+    pthread_rwlock_wrlock(&(host->vm_lock));
+    host->vms[host->vm_count++] = vm;
+    pthread_rwlock_unlock(&(host->vm_lock));
+    printf("\nVM %d is managed\n", (int)params->pid);
+    return 0;
+}
+
+// (the reader) stop managing a VM, it's released once nobody is using it
+static void remove_vm(struct host* host, size_t index)
+{
+    struct host_vm* vm = host->vms[index];
+    pthread_rwlock_wrlock(&(host->vm_lock));
+    host->vms[index] = host->vms[--(host->vm_count)];
+    pthread_rwlock_unlock(&(host->vm_lock));
+    printf("\nVM %d is not managed any more\n", (int)vm->vm.params.pid);
+    put_vm(vm);
+}
+
+static int has_exited(pid_t pid)
+{
+    return kill(pid, 0) && errno == ESRCH;
+}
+
+static int is_managed(struct host* host, pid_t pid)
+{
+    for(size_t i = 0; i < host->vm_count; i++)
+    {
+        if(host->vms[i]->vm.params.pid == pid)
+            return 1;
+    }
+    return 0;
+}
+
+// is a process a KVM user, i.e. does it hold /dev/kvm open
+static int is_kvm_process(pid_t pid)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/fd", (int)pid);
+    DIR* dir = opendir(path);
+    if(!dir)
+        return 0;
+    int found = 0;
+    struct dirent* entry;
+    while(!found && (entry = readdir(dir)))
+    {
+        char link[320], target[64];
+        snprintf(link, sizeof(link), "%s/%s", path, entry->d_name);
+        ssize_t len = readlink(link, target, sizeof(target) - 1);
+        if(len <= 0)
+            continue;
+        target[len] = '\0';
+        found = !strcmp(target, "/dev/kvm");
+    }
+    closedir(dir);
+    return found;
+}
+
+// (the reader, or before threads start) drop VMs that have exited, and manage new ones
+static void discover(struct host* host)
+{
+    for(size_t i = host->vm_count; i > 0; i--)
+    {
+        if(has_exited(host->vms[i - 1]->vm.params.pid))
+            remove_vm(host, i - 1);
+    }
+    // checkpoints of exited VMs are useless
+    if(host->params.defaults.checkpoint_dir)
+        checkpoint_clean(host->params.defaults.checkpoint_dir);
+    // only the given VMs are managed
+    if(host->params.vm_count)
+        return;
+    DIR* dir = opendir("/proc");
+    if(!dir)
+    {
+        perror("opendir() failed");
+        return;
+    }
+    struct dirent* entry;
+    while((entry = readdir(dir)))
+    {
+        int pid;
+        char tail;
+        if(sscanf(entry->d_name, "%d%c", &pid, &tail) != 1 ||
+            is_managed(host, pid) || !is_kvm_process(pid))
+            continue;
+        // a VM failed to be managed is tried again in the next discovery
+        struct vm_params params = host->params.defaults;
+        params.pid = pid;
+        add_vm(host, &params);
+    }
+    closedir(dir);
+}
+
+static size_t clamp(size_t value, size_t min, size_t max)
+{
+    return value < min ? min : value > max ? max : value;
+}
+
+// divide the budget of the fastest 'boundary' + 1 tiers among VMs by marginal benefit
+// A common temperature level is lowered from the hottest bin of histograms of all VMs,
+// so fast memory goes to the hottest pages of the host, and every VM gets its pages above
+// the level, within its min and max. Histograms are taken at different times, but a
+// histogram cools down by shifting, as bins are 1 / 2^RANK_MANTISSA_BITS octave wide.
+// Guarantees only apply to the fastest tier, and a VM never gets less of more tiers.
+static void split_budget(struct host* host, struct host_vm** vms, size_t count,
+    uint64_t current_time, size_t boundary)
+{
+    size_t budget = 0;
+    for(size_t i = 0; i <= boundary; i++)
+        budget += host->params.defaults.tiers[i].capacity;
+    size_t mins[MAX_VMS], maxs[MAX_VMS], offsets[MAX_VMS];
+    size_t hots[MAX_VMS], additions[MAX_VMS], gains[MAX_VMS], extras[MAX_VMS];
+    size_t granted = 0;
+    for(size_t i = 0; i < count; i++)
+    {
+        struct vm* vm = &(vms[i]->vm);
+        pthread_mutex_lock(&(vm->memslot_lock));
+        size_t guest_pages = vm->guest_pages;
+        pthread_mutex_unlock(&(vm->memslot_lock));
+        if(!boundary)
+        {
+            maxs[i] = (size_t)round(guest_pages * vm->params.max_fast_ratio);
+            mins[i] = (size_t)round(guest_pages * vm->params.min_fast_ratio);
+        }
+        else
+        {
+            maxs[i] = guest_pages;
+            mins[i] = vm->capacities[boundary - 1];
+        }
+        if(mins[i] > maxs[i])
+            mins[i] = maxs[i];
+        // bins the histogram has cooled down by, or all of them if there is no histogram
+        offsets[i] = vm->histogram_time ? (size_t)((current_time - vm->histogram_time) /
+            vm->params.half_life * (1 << RANK_MANTISSA_BITS)) : RANK_BIN_COUNT;
+        hots[i] = 0;
+        extras[i] = 0;
+        granted += mins[i];
+    }
+    // guarantees can't be kept, scale them down
+    if(granted >= budget)
+    {
+        for(size_t i = 0; i < count; i++)
+            vms[i]->vm.capacities[boundary] = granted ? mins[i] * budget / granted : 0;
+        return;
+    }
+    for(size_t level = RANK_BIN_COUNT; level > 0; level--)
+    {
+        // what every VM gains if the level goes one bin lower
+        size_t gain = 0;
+        for(size_t i = 0; i < count; i++)
+        {
+            size_t bin = level - 1 + offsets[i];
+            additions[i] = bin < RANK_BIN_COUNT ? vms[i]->vm.histogram[bin] : 0;
+            gains[i] = clamp(hots[i] + additions[i], mins[i], maxs[i]) -
+                clamp(hots[i], mins[i], maxs[i]);
+            gain += gains[i];
+        }
+        // the bin overflows the budget, share the rest of the budget by gains
+        if(granted + gain > budget)
+        {
+            for(size_t i = 0; i < count; i++)
+                extras[i] = gains[i] * (budget - granted) / gain;
+            break;
+        }
+        for(size_t i = 0; i < count; i++)
+            hots[i] += additions[i];
+        granted += gain;
+    }
+    for(size_t i = 0; i < count; i++)
+        vms[i]->vm.capacities[boundary] = clamp(hots[i], mins[i], maxs[i]) + extras[i];
+}
+
+static void* worker_main(void* arg)
+{
+    struct host_worker* worker = arg;
+    struct host* host = worker->host;
+    while(1)
+    {
+        size_t taken = 0;
+        pthread_rwlock_rdlock(&(host->vm_lock));
+        for(size_t i = 0; i < host->vm_count; i++)
+            taken += vm_update(&(host->vms[i]->vm), worker->index);
+        pthread_rwlock_unlock(&(host->vm_lock));
+        if(!taken)
+            usleep(WORKER_IDLE_US);
+    }
+    return NULL;
+}
+
+// poll samplers of all VMs, and drain samples from them
+static void* reader_main(void* arg)
+{
+    struct host* host = arg;
+    struct pollfd pollfds[MAX_VMS];
+    while(1)
+    {
+        if(get_current_ms() >= host->discover_time)
+        {
+            discover(host);
+            host->discover_time = get_current_ms() + DISCOVER_INTERVAL;
+        }
+        // only the reader changes 'vms', so it needs no lock to read them
+        size_t count = host->vm_count;
+        for(size_t i = 0; i < count; i++)
+        {
+            pollfds[i].fd = host->vms[i]->vm.client.fd;
+            pollfds[i].events = POLLIN | POLLPRI;
+            pollfds[i].revents = 0;
+        }
+        // a closed fd only shows in 'revents', so a failure here is transient (e.g. ENOMEM),
+        // and every VM keeps being managed
+        if(poll(pollfds, count, POLL_TIMEOUT) < 0)
+        {
+            if(errno != EINTR)
+            {
+                perror("poll() failed");
+                usleep(POLL_TIMEOUT * 1000);
+            }
+            continue;
+        }
+        // backward, as removing a VM moves the last one to its place
+        for(size_t i = count; i > 0; i--)
+        {
+            struct host_vm* vm = host->vms[i - 1];
+            if(__atomic_load_n(&(vm->dropped), __ATOMIC_RELAXED))
+                remove_vm(host, i - 1);
+            else if(pollfds[i - 1].revents && vm_read(&(vm->vm)))
+            {
+                fprintf(stderr, "failed to read VM %d\n", (int)vm->vm.params.pid);
+                remove_vm(host, i - 1);
+            }
+        }
+    }
+    return NULL;
+}
+
+static void* policy_main(void* arg)
+{
+    struct host* host = arg;
+    struct host_vm* vms[MAX_VMS];
+    uint64_t migration_scan_time = get_current_ms();
+    uint64_t checkpoint_time = migration_scan_time + CHECKPOINT_INTERVAL;
+    while(1)
+    {
+        sleep_until(migration_scan_time);
+        size_t count = get_vms(host, vms);
+        uint64_t current_time = get_current_ms();
+        for(size_t i = 0; i + 1 < host->params.defaults.tier_count; i++)
+            split_budget(host, vms, count, current_time, i);
+        // a VM failed to scan only misses this round, unless it has exited (move_pages()
+        // fails with ESRCH then), which is dropped at once instead of at the next discovery
+        for(size_t i = 0; i < count; i++)
+        {
+            struct vm* vm = &(vms[i]->vm);
+            if(current_time < vm->start_time || !vm_scan(vm))
+                continue;
+            if(has_exited(vm->params.pid))
+            {
+                fprintf(stderr, "\nVM %d has exited while scanning\n", (int)vm->params.pid);
+                __atomic_store_n(&(vms[i]->dropped), 1, __ATOMIC_RELAXED);
+            }
+            else
+                fprintf(stderr, "\nfailed to scan VM %d, try again later\n", (int)vm->params.pid);
+        }
+        // a failed checkpoint only costs the warm-up after a restart
+        if(host->params.defaults.checkpoint_dir && current_time >= checkpoint_time)
+        {
+            for(size_t i = 0; i < count; i++)
+            {
+                if(checkpoint_save(&(vms[i]->vm)))
+                    fprintf(stderr, "\nfailed to checkpoint VM %d: %s\n",
+                        (int)vms[i]->vm.params.pid, strerror(errno));
+            }
+            checkpoint_time = current_time + CHECKPOINT_INTERVAL;
+        }
+        put_vms(vms, count);
+        migration_scan_time += host->params.defaults.migration_interval * 1000;
+    }
+    return NULL;
+}
+
+// (a migration worker) a batch is done
+static void on_batch_done(struct migrate_batch* batch)
+{
+    struct host* host = migrating_host;
+    struct host_vm* vm = batch->privdata;
+    size_t moved_bytes = vm_on_migrated(&(vm->vm), batch);
+    size_t failed_count = 0;
+    for(size_t i = 0; i < batch->count; i++)
+        failed_count += batch->status[i] < 0;
+    __atomic_add_fetch(&(host->moved_bytes), moved_bytes, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&(host->failed_count), failed_count, __ATOMIC_RELAXED);
+    // pages that didn't move cost no bandwidth
+    __atomic_add_fetch(&(host->refund_bytes), batch->bytes - moved_bytes, __ATOMIC_RELAXED);
+    put_vm(vm);
+    free(batch);
+}
+
+// dispatch planned tasks of VMs to the migrator, paced by a token bucket
+static void* migration_main(void* arg)
+{
+    struct host* host = arg;
+    struct host_vm* vms[MAX_VMS];
+    uint64_t current_time = get_current_ms();
+    uint64_t dispatch_time = current_time;
+    uint64_t report_time = current_time + REPORT_INTERVAL;
+    size_t reported_bytes = 0, reported_count = 0;
+    double rate = host->params.defaults.max_migration_bandwidth * 1024.0 * 1024 / 1000;
+    struct token_bucket bucket;
+    token_bucket_init(&bucket, rate, rate * MIGRATE_BURST, current_time);
+    while(1)
+    {
+        sleep_until(dispatch_time);
+        current_time = get_current_ms();
+        token_bucket_refill(&bucket, current_time,
+            __atomic_exchange_n(&(host->refund_bytes), 0, __ATOMIC_RELAXED));
+        size_t count = get_vms(host, vms);
+        // keep the migrator busy, but don't queue much, so new plans take effect soon
+        while(bucket.tokens > 0 &&
+            migrator_pending(&(host->migrator)) < host->migrator.thread_count * 2)
+        {
+            // the VM whose next task benefits most goes first
+            struct host_vm* vm = NULL;
+            float benefit = -1;
+            for(size_t i = 0; i < count; i++)
+            {
+                float next_benefit;
+                if(current_time >= vms[i]->vm.start_time &&
+                    (next_benefit = vm_next_benefit(&(vms[i]->vm))) > benefit)
+                {
+                    vm = vms[i];
+                    benefit = next_benefit;
+                }
+            }
+            if(!vm)
+                break;
+            struct migrate_batch* batch = malloc(sizeof(struct migrate_batch));
+            if(!batch)
+            {
+                fprintf(stderr, "malloc() failed\n");
+                break;
+            }
+            if(!vm_take_tasks(&(vm->vm), batch, (size_t)bucket.tokens))
+            {
+                free(batch);
+                continue;
+            }
+            bucket.tokens -= batch->bytes;
+            // the batch keeps the VM valid until it's done
+            __atomic_add_fetch(&(vm->refs), 1, __ATOMIC_RELAXED);
+            batch->privdata = vm;
+            migrator_submit(&(host->migrator), batch);
+        }
+        put_vms(vms, count);
+        if(current_time >= report_time)
+        {
+            size_t moved_bytes = __atomic_load_n(&(host->moved_bytes), __ATOMIC_RELAXED);
+            size_t failed_count = __atomic_load_n(&(host->failed_count), __ATOMIC_RELAXED);
+            printf("\r%.3f MB/s, %zu pages failed                 ",
+                (moved_bytes - reported_bytes) / 1024.0 / 1024 * 1000 /
+                (current_time - report_time + REPORT_INTERVAL), failed_count - reported_count);
+            fflush(stdout);
+            reported_bytes = moved_bytes;
+            reported_count = failed_count;
+            report_time = current_time + REPORT_INTERVAL;
+        }
+        dispatch_time += MIGRATE_TICK;
+    }
+    return NULL;
+}
+
+// refresh metrics of all VMs
+static void* metrics_main(void* arg)
+{
+    struct host* host = arg;
+    struct host_vm* vms[MAX_VMS];
+    uint64_t metrics_time = get_current_ms();
+    while(1)
+    {
+        sleep_until(metrics_time);
+        size_t count = get_vms(host, vms);
+        if(metrics_write(host, vms, count, host->params.metrics_path))
+            fprintf(stderr, "\nfailed to write metrics: %s\n", strerror(errno));
+        put_vms(vms, count);
+        metrics_time += METRICS_INTERVAL;
+    }
+    return NULL;
+}
+
+int host_init(struct host* host, const struct host_params* params)
+{
+    host->params = *params;
+    // the reader must not starve while workers keep taking the read lock
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&(host->vm_lock), &attr);
+    pthread_rwlockattr_destroy(&attr);
+    host->vm_count = 0;
+    host->moved_bytes = 0;
+    host->failed_count = 0;
+    host->refund_bytes = 0;
+    migrating_host = host;
+    if(migrator_init(&(host->migrator), MIGRATE_THREADS, on_batch_done))
+        return -1;
+    for(size_t i = 0; i < params->vm_count; i++)
+    {
+        if(add_vm(host, params->vms + i))
+            return -1;
+    }
+    discover(host);
+    host->discover_time = get_current_ms() + DISCOVER_INTERVAL;
+    return 0;
+}
+
+int host_run(struct host* host)
+{
+    for(size_t i = 0; i < host->params.defaults.shard_count; i++)
+    {
+        struct host_worker* worker = host->workers + i;
+        worker->host = host;
+        worker->index = i;
+        if(pthread_create(&(worker->thread), NULL, worker_main, worker))
+        {
+            fprintf(stderr, "pthread_create() failed\n");
+            return -1;
+        }
+    }
+    if(pthread_create(&(host->reader_thread), NULL, reader_main, host) ||
+        pthread_create(&(host->policy_thread), NULL, policy_main, host) ||
+        pthread_create(&(host->migration_thread), NULL, migration_main, host) ||
+        (host->params.metrics_path &&
+        pthread_create(&(host->metrics_thread), NULL, metrics_main, host)))
+    {
+        fprintf(stderr, "pthread_create() failed\n");
+        return -1;
+    }
+    // all threads run endlessly, and a VM that goes wrong is only dropped
+    pthread_join(host->reader_thread, NULL);
+    return -1;
+}
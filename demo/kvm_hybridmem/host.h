@@ -0,0 +1,79 @@
+#ifndef HOST_H
+#define HOST_H
+
+// All VMs on the host under one kvm_hybridmem, sharing one set of threads:
+//  reader: polls samplers of all VMs in one event loop, and discovers VMs that have
+//      started or exited
+//  workers: worker N drains shard N of every VM
+//  policy: divides capacities of tiers among VMs, scans every VM, and checkpoints every
+//      VM once in a while (see checkpoint.h)
+//  migration: dispatches migration tasks of all VMs to the migrator by benefit, within
+//      the max bandwidth
+//  metrics: writes metrics of all VMs once in a while (see metrics.h)
+// Every tier goes to the hottest pages of the host, as if pages of all VMs were ranked
+// together, so fast memory follows the VM that benefits most from it, while every VM
+// keeps its guaranteed ratio of the fastest tier and never gets more than its max ratio.
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "vm.h"
+
+#define MAX_VMS             256
+
+// a VM managed by the host
+struct host_vm
+{
+    struct vm vm;
+    size_t refs;                // references, the VM is released with the last one
+    int dropped;                // set by other threads to ask the reader to stop managing it
+};
+
+// a thread draining shards of the same index of all VMs
+struct host_worker
+{
+    struct host* host;
+    size_t index;               // the index of shards to drain
+    pthread_t thread;
+};
+
+struct host_params
+{
+    struct vm_params defaults;  // params of discovered VMs, except the pid
+    // VMs to manage, or all QEMU-KVM processes are discovered if 'vm_count' is 0
+    struct vm_params vms[MAX_VMS];
+    size_t vm_count;
+    const char* metrics_path;   // where metrics go, or NULL
+};
+
+struct host
+{
+    struct host_params params;
+    // 'vms' are only changed by the reader, with the write lock held; the workers hold
+    // the read lock while using them, and the others hold references instead
+    pthread_rwlock_t vm_lock;
+    struct host_vm* vms[MAX_VMS];
+    size_t vm_count;
+    uint64_t discover_time;     // when to discover VMs next time
+    struct migrator migrator;
+    // statistics of migration, updated by workers of the migrator
+    size_t moved_bytes;
+    size_t failed_count;        // count of pages failed to move
+    size_t refund_bytes;        // bytes charged but not moved, to be refunded
+    pthread_t reader_thread;
+    pthread_t policy_thread;
+    pthread_t migration_thread;
+    pthread_t metrics_thread;
+    struct host_worker workers[MAX_SHARDS];
+};
+
+// discover VMs and start managing them
+// return 0 if succeed, or -1 with a message printed
+int host_init(struct host* host, const struct host_params* params);
+
+// start the threads, and never return unless something is wrong
+// return -1 with a message printed
+int host_run(struct host* host);
+
+#endif
@@ -1,286 +1,184 @@
-#include <math.h>
-#include <fcntl.h>
 #include <stdio.h>
-#include <assert.h>
-#include <stdint.h>
-#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
-#include <sys/mman.h>
-#include <sys/time.h>
-#include <sys/ioctl.h>
 
-#include "hybridmem.h"
-#include "kvm_ept_sample.h"
+#include "host.h"
 
-#define PAGE_SIZE           4096
+// all VMs on the host, too large for the stack
+static struct host host;
 
-#define MAX_MEMSLOTS        64
-#define FORCE_REFRESH_LOOP  30
-
-struct page_info
-{
-    uint64_t timestamp;         // the timestamp of latest update
-    float temperature;          // the temperature of this page
-    int node : 31;              // the NUMA node of this page
-    unsigned node_inited : 1;   // is 'node' initiated
-};
-
-static uint64_t get_current_ms()
-{
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    return (uint64_t)tv.tv_sec * 1000 + (uint64_t)tv.tv_usec / 1000;
-}
-
-static void update_page_info(struct page_info* page,
-    uint64_t current_time, float half_life, float addition)
+// parse tiers like "0,1:65536@80/2,3:131072@250/4,5@350", i.e. nodes, capacity (MB) and
+// latency (ns) of every tier from the fastest to the slowest, and the slowest one has no
+// capacity
+// return 0 if succeed, or -1 if it's invalid
+static int parse_tiers(char* text, struct vm_params* params)
 {
-    assert(current_time >= page->timestamp);
-    uint64_t time_delta = current_time - page->timestamp;
-    page->temperature *= pow(0.5f, time_delta / half_life); // natural cooling
-    page->temperature += addition;                          // temperation addition
-    page->timestamp = current_time;                         // update timestamp
-}
-
-static struct hybridmem_page* build_hybridmem_input(struct page_info* pages,
-    struct kvm_ept_sample_memslot* memslots, size_t memslot_count, int force_refresh_node,
-    size_t* p_page_count)
-{
-    size_t max_page_count = 0;
-    for(size_t i = 0; i < memslot_count; i++)
-        max_page_count += memslots[i].page_count;
-    struct hybridmem_page* input_pages = malloc(sizeof(struct hybridmem_page) * max_page_count);
-    if(!input_pages)
-        return NULL;
-    size_t page_count = 0;
-    for(size_t i = 0; i < memslot_count; i++)
+    params->tier_count = 0;
+    char* tier_saveptr;
+    for(char* tier_text = strtok_r(text, "/", &tier_saveptr); tier_text;
+        tier_text = strtok_r(NULL, "/", &tier_saveptr))
     {
-        uint64_t gfn = memslots[i].gpa / PAGE_SIZE;
-        uint64_t hva = memslots[i].hva;
-        size_t slot_page_count = memslots[i].page_count;
-        for(size_t j = 0; j < slot_page_count; j++)
+        if(params->tier_count == MAX_TIERS)
+            return -1;
+        struct tier* tier = params->tiers + (params->tier_count++);
+        unsigned long capacity = 0;
+        tier->latency = 0;
+        char* latency_text = strchr(tier_text, '@');
+        if(latency_text)
+        {
+            (*latency_text++) = '\0';
+            if(sscanf(latency_text, "%lu", &(tier->latency)) != 1)
+                return -1;
+        }
+        char* capacity_text = strchr(tier_text, ':');
+        if(capacity_text)
         {
-            struct page_info* page = pages + gfn + j;
-            if(force_refresh_node)
-                page->node_inited = 0;
-            int node;
-            if(!page->node_inited)
-                node = -1;
-            else if(page->node >= 0)
-                node = page->node;
-            else
-                continue;
-            struct hybridmem_page* input_page = input_pages + page_count;
-            input_page->address = hva + j * PAGE_SIZE;
-            input_page->temperature = page->temperature;
-            input_page->node = node;
-            input_page->privdata = page;
-            page_count++;
+            (*capacity_text++) = '\0';
+            if(sscanf(capacity_text, "%lu", &capacity) != 1)
+                return -1;
         }
+        tier->capacity = capacity * 256;
+        tier->node_count = 0;
+        char* node_saveptr;
+        for(char* node_text = strtok_r(tier_text, ",", &node_saveptr); node_text;
+            node_text = strtok_r(NULL, ",", &node_saveptr))
+        {
+            if(tier->node_count == MAX_TIER_NODES ||
+                sscanf(node_text, "%d", tier->nodes + tier->node_count) != 1 ||
+                tier->nodes[tier->node_count] < 0 || tier->nodes[tier->node_count] >= MAX_NODES)
+                return -1;
+            tier->node_count++;
+        }
+        if(!tier->node_count)
+            return -1;
     }
-    assert(page_count <= max_page_count);
-    (*p_page_count) = page_count;
-    return input_pages;
+    return params->tier_count >= 2 ? 0 : -1;
 }
 
-static void on_page_migrated(unsigned long address, int status, void* privdata)
+// parse the cost model like "30:100:3" or "30:100:3:1000:5000", i.e. the payoff horizon
+// (s), accesses per sample, the cooldown (scans), and optionally the time to copy 4KB and
+// the TLB shootdown of a migration (ns), or "-" to disable it
+// return 0 if succeed, or -1 if it's invalid
+static int parse_cost_model(const char* text, struct vm_params* params)
 {
-    struct page_info* page = privdata;
-    assert(page);
-    page->node = status;
-    page->node_inited = 1;
+    params->payoff_horizon = 0;
+    params->accesses_per_sample = 0;
+    params->cooldown = 0;
+    // about 4GB/s, and a shootdown of a few CPUs
+    params->copy_ns = 1000;
+    params->shootdown_ns = 5000;
+    if(!strcmp(text, "-"))
+        return 0;
+    int count = sscanf(text, "%f:%f:%lu:%lu:%lu", &(params->payoff_horizon),
+        &(params->accesses_per_sample), &(params->cooldown), &(params->copy_ns),
+        &(params->shootdown_ns));
+    if((count != 3 && count != 5) || params->payoff_horizon <= 0 ||
+        params->accesses_per_sample <= 0)
+        return -1;
+    // the gain of a promotion is the latency saved between tiers
+    for(size_t i = 0; i < params->tier_count; i++)
+    {
+        if(!params->tiers[i].latency)
+            return -1;
+    }
+    return 0;
 }
 
 int main(int argc, char** argv)
 {
-    pid_t pid;
-    int xwr;
-    unsigned long freq;
-    float half_life, xaddition, waddition, raddition;
-    unsigned long migration_delay, migration_interval, max_migration_bandwidth;
-    int fast_node, slow_node;
-    float fast_ratio, temperature_tolerance_ratio;
-    if(argc != 15 ||
-        // pid of target QEMU-KVM instance
-        sscanf(argv[1], "%d", &pid) != 1 ||
+    struct host_params params;
+    struct vm_params* defaults = &(params.defaults);
+    if(argc < 18 || argc - 18 > MAX_VMS ||
         // access type to sample
-        sscanf(argv[2], "%d", &xwr) != 1 ||
+        sscanf(argv[1], "%d", &(defaults->xwr)) != 1 ||
         // sample frequency
-        sscanf(argv[3], "%lu", &freq) != 1 ||
+        sscanf(argv[2], "%lu", &(defaults->freq)) != 1 ||
         // half-life of natural cooling
-        sscanf(argv[4], "%f", &half_life) != 1 ||
+        sscanf(argv[3], "%f", &(defaults->half_life)) != 1 ||
         // temperature addition when 'exec'
-        sscanf(argv[5], "%f", &xaddition) != 1 ||
+        sscanf(argv[4], "%f", &(defaults->xaddition)) != 1 ||
         // temperature addition when 'write'
-        sscanf(argv[6], "%f", &waddition) != 1 ||
+        sscanf(argv[5], "%f", &(defaults->waddition)) != 1 ||
         // temperature addition when 'read'
-        sscanf(argv[7], "%f", &raddition) != 1 ||
+        sscanf(argv[6], "%f", &(defaults->raddition)) != 1 ||
         // seconds before migration starts
-        sscanf(argv[8], "%lu", &migration_delay) != 1 ||
+        sscanf(argv[7], "%lu", &(defaults->migration_delay)) != 1 ||
         // seconds between loops of migration
-        sscanf(argv[9], "%lu", &migration_interval) != 1 ||
-        // max bandwitth to migrate
-        sscanf(argv[10], "%lu", &max_migration_bandwidth) != 1 ||
-        // NUMA node of fast memory device
-        sscanf(argv[11], "%d", &fast_node) != 1 ||
-        // NUMA node of slow memory device
-        sscanf(argv[12], "%d", &slow_node) != 1 ||
-        // the ratio of fast memory
-        sscanf(argv[13], "%f", &fast_ratio) != 1 ||
+        sscanf(argv[8], "%lu", &(defaults->migration_interval)) != 1 ||
+        // max bandwitth to migrate, shared by all VMs
+        sscanf(argv[9], "%lu", &(defaults->max_migration_bandwidth)) != 1 ||
+        // tiers of memory shared by all VMs
+        parse_tiers(argv[10], defaults) ||
         // the temperature anti-shaking tolerance ratio
-        sscanf(argv[14], "%f", &temperature_tolerance_ratio) != 1)
+        sscanf(argv[11], "%f", &(defaults->temperature_tolerance_ratio)) != 1 ||
+        // the ratio of the fastest tier guaranteed to every VM
+        sscanf(argv[12], "%f", &(defaults->min_fast_ratio)) != 1 ||
+        // the max ratio of the fastest tier of every VM
+        sscanf(argv[13], "%f", &(defaults->max_fast_ratio)) != 1)
     {
-        fprintf(stderr, "USAGE: %s <pid> <xwr> <freq (Hz)> <half-life (ms)> <x-addition> "
+        fprintf(stderr, "USAGE: %s <xwr> <freq (Hz)> <half-life (ms)> <x-addition> "
             "<w-addition> <r-addition> <migration-delay (s)> <migration-interval (s)> "
-            "<max-migration-bandwidth (MB/s)> <fast-node> <slow-node> <fast-ratio> "
-            "<temperature-tolerance-ratio>\n", argv[0]);
+            "<max-migration-bandwidth (MB/s)> <tiers> <temperature-tolerance-ratio> "
+            "<min-fast-ratio> <max-fast-ratio> <checkpoint-dir> <metrics-path> <placement> "
+            "<cost-model> [<pid>[:<min-fast-ratio>:<max-fast-ratio>] ...]\n"
+            "<tiers> are nodes, capacity (MB) and optionally latency (ns) of every tier "
+            "from the fastest to the slowest, e.g. 0,1:65536@80/2,3:131072@250/4,5@350 for "
+            "local DRAM, CXL DRAM and NVM of two sockets.\n"
+            "<checkpoint-dir> keeps temperatures across restarts, or - for none.\n"
+            "<metrics-path> is a file of metrics in the Prometheus text format, refreshed "
+            "every second, or - for none.\n"
+            "<placement> is decay to place pages by temperature only, or arc to promote "
+            "pages sampled in 2 scan intervals only, resisting sequential scans.\n"
+            "<cost-model> is <payoff-horizon (s)>:<accesses-per-sample>:<cooldown (scans)>"
+            "[:<copy-4KB (ns)>:<shootdown (ns)>] to migrate a page only if the latency it "
+            "saves within the horizon outweighs the cost of moving it (1000 and 5000 ns by "
+            "default), and never move it back within the cooldown, or - for none. "
+            "It needs latency of all tiers.\n"
+            "All QEMU-KVM processes are managed if no pid is given.\n", argv[0]);
         return 1;
     }
-    int fd = open(KVM_EPT_SAMPLE_PATH, O_RDWR);
-    if(fd < 0)
+    // one shard per CPU left by the reader, the policy and the migration thread
+    long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+    defaults->shard_count = cpu_count > 4 ? (size_t)cpu_count - 3 : 1;
+    if(defaults->shard_count > MAX_SHARDS)
+        defaults->shard_count = MAX_SHARDS;
+    // the real guest and host
+    defaults->hooks = NULL;
+    // where checkpoints go
+    defaults->checkpoint_dir = strcmp(argv[14], "-") ? argv[14] : NULL;
+    // where metrics go
+    params.metrics_path = strcmp(argv[15], "-") ? argv[15] : NULL;
+    // how pages are placed
+    if(!strcmp(argv[16], "decay"))
+        defaults->placement = PLACEMENT_DECAY;
+    else if(!strcmp(argv[16], "arc"))
+        defaults->placement = PLACEMENT_ARC;
+    else
     {
-        perror("open() failed");
+        fprintf(stderr, "invalid placement: %s\n", argv[16]);
         return 1;
     }
-    // set pid
-    if(ioctl(fd, KVM_EPT_SAMPLE_CMD_INIT, pid) < 0)
+    // when migration pays off
+    if(parse_cost_model(argv[17], defaults))
     {
-        perror("ioctl() failed");
+        fprintf(stderr, "invalid cost model: %s\n", argv[17]);
         return 1;
     }
-    // set prot
-    if(ioctl(fd, KVM_EPT_SAMPLE_CMD_SET_PROT, xwr) < 0)
+    // VMs to manage, with their own guarantees optionally
+    params.vm_count = argc - 18;
+    for(size_t i = 0; i < params.vm_count; i++)
     {
-        perror("ioctl() failed");
-        return 1;
-    }
-    // set frequency
-    if(ioctl(fd, KVM_EPT_SAMPLE_CMD_SET_FREQ, freq) < 0)
-    {
-        perror("ioctl() failed");
-        return 1;
-    }
-    // get all memory slots
-    struct kvm_ept_sample_memslot memslots[MAX_MEMSLOTS];
-    struct kvm_ept_sample_get_memslots get_memslots =
-    {
-        .memslots = memslots,
-        .capacity = MAX_MEMSLOTS,
-        .count = 0,
-    };
-    if(ioctl(fd, KVM_EPT_SAMPLE_CMD_GET_MEMSLOTS, &get_memslots) < 0)
-    {
-        perror("ioctl() failed");
-        return 1;
-    }
-    // ensure all memory slots are got
-    assert(get_memslots.count < MAX_MEMSLOTS);
-    uint64_t gpa_limit = 0, hva_limit = 0;
-    for(size_t i = 0; i < get_memslots.count; i++)
-    {
-        size_t slot_size = memslots[i].page_count * PAGE_SIZE;
-        uint64_t gpa_end = memslots[i].gpa + slot_size;
-        uint64_t hva_end = memslots[i].hva + slot_size;
-        if(gpa_end > gpa_limit)
-            gpa_limit = gpa_end;
-        if(hva_end > hva_limit)
-            hva_limit = hva_end;
-    }
-    // allocate a linear array for all page information
-    struct page_info* pages = mmap(NULL, sizeof(struct page_info) * gpa_limit / PAGE_SIZE,
-        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
-    if((void*)pages == MAP_FAILED)
-    {
-        perror("mmap() failed");
-        return 1;
-    }
-    // init libhybridmem
-    struct hybridmem hybridmem;
-    if(hybridmem_init(&hybridmem, pid, hva_limit / PAGE_SIZE, on_page_migrated))
-    {
-        fprintf(stderr, "hybridmem_init() failed\n");
-        return 1;
-    }
-    uint64_t current_time = get_current_ms();
-    // first time to scan migration tasks
-    uint64_t migration_scan_time = current_time + migration_delay * 1000;
-    // first time to execute migration tasks
-    uint64_t migration_exec_time = migration_scan_time;
-    size_t migration_scan_loops = 0;
-    // endlessly read samples
-    while(1)
-    {
-        current_time = get_current_ms();
-        // if it's time to do a loop of migration scan
-        if(current_time >= migration_scan_time)
-        {
-            struct hybridmem_page* input;
-            size_t page_count;
-            // build input data for libhybridmem
-            if(!(input = build_hybridmem_input(pages, memslots, get_memslots.count,
-                migration_scan_loops % FORCE_REFRESH_LOOP == 0, &page_count)))
-            {
-                fprintf(stderr, "build_hybridmem_input() failed\n");
-                return 1;
-            }
-            size_t fast_page_count = (size_t)round(page_count * fast_ratio);
-            // scan migration tasks
-            ssize_t task_addition = hybridmem_scan(&hybridmem, input, page_count, fast_page_count,
-                fast_node, slow_node, temperature_tolerance_ratio);
-            if(task_addition < 0)
-            {
-                fprintf(stderr, "hybridmem_scan() failed\n");
-                return 1;
-            }
-            // destroy the input data
-            free(input);
-            // set next migaration time
-            migration_scan_time = current_time + migration_interval * 1000;
-            migration_scan_loops++;
-        }
-        // if it's time to do a loop of migration execution
-        if(current_time >= migration_exec_time)
+        struct vm_params* vm = params.vms + i;
+        (*vm) = (*defaults);
+        int count = sscanf(argv[18 + i], "%d:%f:%f", &(vm->pid), &(vm->min_fast_ratio),
+            &(vm->max_fast_ratio));
+        if(count != 1 && count != 3)
         {
-            // do 10% of max bandwidth in every 100ms
-            size_t max_count = (size_t)round(max_migration_bandwidth * 256 / 10.0);
-            size_t exec_count = hybridmem_execute(&hybridmem, max_count, 1);
-            printf("\r%.3f MB/s                 ", 10.0 * exec_count / 256);
-            fflush(stdout);
-            // do it 100ms later
-            migration_exec_time = current_time + 100;
-        }
-        struct kvm_ept_sample_sample samples[128];
-        ssize_t len = read(fd, samples, sizeof(samples));
-        if(len < 0)
-        {
-            perror("read() failed");
+            fprintf(stderr, "invalid VM: %s\n", argv[18 + i]);
             return 1;
         }
-        else if(len > 0)
-        {
-            assert(len % sizeof(struct kvm_ept_sample_sample) == 0);
-            // count of samples
-            size_t count = len / sizeof(struct kvm_ept_sample_sample);
-            for(size_t i = 0; i < count; i++)
-            {
-                uint32_t gfn = samples[i].gfn;
-                uint32_t xwr = samples[i].xwr;
-                assert(gfn < gpa_limit / PAGE_SIZE);
-                // get the according page_info
-                struct page_info* page = pages + gfn;
-                // get the according temperature addition
-                float addition;
-                if(xwr & 4)
-                    addition = xaddition;       // addition for 'exec'
-                else if(xwr & 2)
-                    addition = waddition;       // addition for 'write'
-                else
-                    addition = raddition;       // addition for 'read'
-                update_page_info(page, current_time, half_life, addition);
-            }
-        }
-        else
-            usleep(10000);
     }
+    if(host_init(&host, &params) || host_run(&host))
+        return 1;
     return 0;
 }
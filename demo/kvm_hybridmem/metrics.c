@@ -0,0 +1,147 @@
+#include <math.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "metrics.h"
+
+#define LOAD(x)     __atomic_load_n(&(x), __ATOMIC_RELAXED)
+
+#define HISTOGRAM_MIN_OCTAVE    -8  // buckets of temperatures, in powers of 2
+#define HISTOGRAM_MAX_OCTAVE    16
+
+// counters of a VM summed over its shards
+struct vm_metrics
+{
+    size_t sampled[MAX_TIERS + 1];
+    size_t resident[MAX_TIERS];
+    size_t promoted;
+    size_t demoted;
+    size_t failed;
+};
+
+static void sum_shards(struct vm* vm, struct vm_metrics* metrics)
+{
+    memset(metrics, 0, sizeof(struct vm_metrics));
+    for(size_t i = 0; i < vm->shard_inited; i++)
+    {
+        struct shard* shard = vm->shards + i;
+        for(size_t j = 0; j <= MAX_TIERS; j++)
+            metrics->sampled[j] += LOAD(shard->sampled[j]);
+        for(size_t j = 0; j < MAX_TIERS; j++)
+            metrics->resident[j] += LOAD(shard->resident[j]);
+        metrics->promoted += LOAD(shard->promoted);
+        metrics->demoted += LOAD(shard->demoted);
+        metrics->failed += LOAD(shard->failed);
+    }
+}
+
+// the temperature histogram of the latest full refresh, as the cumulative buckets of a
+// Prometheus histogram, whose bounds are the same for every VM and every write, so that
+// series of a bucket stay comparable: one per octave from 2^HISTOGRAM_MIN_OCTAVE to
+// 2^HISTOGRAM_MAX_OCTAVE, and colder or hotter pages fall in the first or the last one
+static void write_histogram(FILE* file, struct vm* vm, int pid)
+{
+    // the policy refills the histogram in every full refresh
+    size_t histogram[RANK_BIN_COUNT];
+    pthread_mutex_lock(&(vm->histogram_lock));
+    memcpy(histogram, vm->histogram, sizeof(histogram));
+    size_t total = vm->histogram_total;
+    double sum = vm->histogram_sum;
+    pthread_mutex_unlock(&(vm->histogram_lock));
+    size_t bin = 0, count = 0;
+    for(int octave = HISTOGRAM_MIN_OCTAVE; octave <= HISTOGRAM_MAX_OCTAVE; octave++)
+    {
+        // pages of bins below the bound, which is the floor of a bin as bins never cross
+        // octaves
+        float bound = ldexpf(1, octave);
+        for(size_t end = rank_bin(bound); bin < end; bin++)
+            count += histogram[bin];
+        fprintf(file, "kvm_hybridmem_temperature_pages_bucket{vm=\"%d\",le=\"%g\"} %zu\n",
+            pid, bound, count);
+    }
+    fprintf(file, "kvm_hybridmem_temperature_pages_bucket{vm=\"%d\",le=\"+Inf\"} %zu\n", pid,
+        total);
+    fprintf(file, "kvm_hybridmem_temperature_pages_sum{vm=\"%d\"} %g\n", pid, sum);
+    fprintf(file, "kvm_hybridmem_temperature_pages_count{vm=\"%d\"} %zu\n", pid, total);
+}
+
+int metrics_write(struct host* host, struct host_vm** vms, size_t count, const char* path)
+{
+    char temp_path[4096];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+    FILE* file = fopen(temp_path, "w");
+    if(!file)
+        return -1;
+    fprintf(file, "# HELP kvm_hybridmem_vms VMs managed\n"
+        "# TYPE kvm_hybridmem_vms gauge\n"
+        "kvm_hybridmem_vms %zu\n", count);
+    fprintf(file, "# HELP kvm_hybridmem_moved_bytes_total Bytes moved by migration\n"
+        "# TYPE kvm_hybridmem_moved_bytes_total counter\n"
+        "kvm_hybridmem_moved_bytes_total %zu\n", LOAD(host->moved_bytes));
+    fprintf(file, "# HELP kvm_hybridmem_samples_read_total Samples read from the kernel\n"
+        "# TYPE kvm_hybridmem_samples_read_total counter\n");
+    for(size_t i = 0; i < count; i++)
+        fprintf(file, "kvm_hybridmem_samples_read_total{vm=\"%d\"} %zu\n",
+            (int)vms[i]->vm.params.pid, LOAD(vms[i]->vm.read_count));
+    fprintf(file, "# HELP kvm_hybridmem_samples_dropped_total Samples dropped by the kernel, "
+        "as they are not read in time\n"
+        "# TYPE kvm_hybridmem_samples_dropped_total counter\n");
+    for(size_t i = 0; i < count; i++)
+    {
+        // the kernel may not support it
+        struct kvm_ept_sample_stats stats;
+        if(!ioctl(vms[i]->vm.client.fd, KVM_EPT_SAMPLE_CMD_GET_STATS, &stats))
+            fprintf(file, "kvm_hybridmem_samples_dropped_total{vm=\"%d\"} %llu\n",
+                (int)vms[i]->vm.params.pid, (unsigned long long)stats.dropped);
+    }
+    struct vm_metrics metrics[MAX_VMS];
+    for(size_t i = 0; i < count; i++)
+        sum_shards(&(vms[i]->vm), metrics + i);
+    fprintf(file, "# HELP kvm_hybridmem_accesses_total Sampled accesses by the tier of pages, "
+        "tier=\"unknown\" if the page is not located yet\n"
+        "# TYPE kvm_hybridmem_accesses_total counter\n");
+    for(size_t i = 0; i < count; i++)
+    {
+        int pid = vms[i]->vm.params.pid;
+        for(size_t j = 0; j < vms[i]->vm.params.tier_count; j++)
+            fprintf(file, "kvm_hybridmem_accesses_total{vm=\"%d\",tier=\"%zu\"} %zu\n", pid,
+                j, metrics[i].sampled[j]);
+        fprintf(file, "kvm_hybridmem_accesses_total{vm=\"%d\",tier=\"unknown\"} %zu\n", pid,
+            metrics[i].sampled[MAX_TIERS]);
+    }
+    fprintf(file, "# HELP kvm_hybridmem_resident_pages Pages known to be in every tier\n"
+        "# TYPE kvm_hybridmem_resident_pages gauge\n");
+    for(size_t i = 0; i < count; i++)
+    {
+        for(size_t j = 0; j < vms[i]->vm.params.tier_count; j++)
+            fprintf(file, "kvm_hybridmem_resident_pages{vm=\"%d\",tier=\"%zu\"} %zu\n",
+                (int)vms[i]->vm.params.pid, j, metrics[i].resident[j]);
+    }
+    fprintf(file, "# HELP kvm_hybridmem_migrated_units_total Units migrated, or failed to\n"
+        "# TYPE kvm_hybridmem_migrated_units_total counter\n");
+    for(size_t i = 0; i < count; i++)
+    {
+        int pid = vms[i]->vm.params.pid;
+        fprintf(file, "kvm_hybridmem_migrated_units_total{vm=\"%d\",result=\"promoted\"} %zu\n"
+            "kvm_hybridmem_migrated_units_total{vm=\"%d\",result=\"demoted\"} %zu\n"
+            "kvm_hybridmem_migrated_units_total{vm=\"%d\",result=\"failed\"} %zu\n", pid,
+            metrics[i].promoted, pid, metrics[i].demoted, pid, metrics[i].failed);
+    }
+    fprintf(file, "# HELP kvm_hybridmem_temperature_pages 4KB pages by temperature, as of the "
+        "latest full refresh\n"
+        "# TYPE kvm_hybridmem_temperature_pages histogram\n");
+    for(size_t i = 0; i < count; i++)
+        write_histogram(file, &(vms[i]->vm), (int)vms[i]->vm.params.pid);
+    int failed = ferror(file);
+    if(fclose(file) || failed || rename(temp_path, path))
+    {
+        int error = errno;
+        unlink(temp_path);
+        errno = error ? error : EIO;
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,17 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+// Metrics of kvm_hybridmem in the Prometheus text format, written to a file that is
+// replaced atomically, e.g. for the textfile collector of node_exporter.
+// Counters are kept by the threads that count them (the reader, the consumer of every
+// shard, and migration workers under the lock of a shard), so counting costs no shared
+// cache line, and they are only summed when metrics are written. Rates, e.g. of sampling
+// or of accesses to the slowest tier, are left to the monitoring system.
+
+#include "host.h"
+
+// write metrics of the host and its VMs
+// return 0 if succeed, or -1 with errno set
+int metrics_write(struct host* host, struct host_vm** vms, size_t count, const char* path);
+
+#endif
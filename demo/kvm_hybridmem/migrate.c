@@ -0,0 +1,79 @@
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "migrate.h"
+
+#ifndef MPOL_MF_MOVE_ALL
+#define MPOL_MF_MOVE_ALL    (1 << 2)    // move pages mapped by other processes as well
+#endif
+
+static void* worker_main(void* arg)
+{
+    struct migrator* migrator = arg;
+    while(1)
+    {
+        pthread_mutex_lock(&(migrator->lock));
+        while(!migrator->queued)
+            pthread_cond_wait(&(migrator->cond), &(migrator->lock));
+        struct migrate_batch* batch = migrator->queue[migrator->first];
+        migrator->first = (migrator->first + 1) % MIGRATE_QUEUE;
+        migrator->queued--;
+        pthread_mutex_unlock(&(migrator->lock));
+        if(syscall(SYS_move_pages, batch->pid, batch->count, batch->addresses, batch->nodes,
+            batch->status, MPOL_MF_MOVE_ALL) < 0)
+        {
+            // the whole batch failed, e.g. the process has exited
+            int error = errno;
+            for(size_t i = 0; i < batch->count; i++)
+                batch->status[i] = -error;
+        }
+        migrator->on_done(batch);
+        pthread_mutex_lock(&(migrator->lock));
+        migrator->pending--;
+        // a submitter may be waiting for room
+        pthread_cond_broadcast(&(migrator->cond));
+        pthread_mutex_unlock(&(migrator->lock));
+    }
+    return NULL;
+}
+
+int migrator_init(struct migrator* migrator, size_t thread_count,
+    void (*on_done)(struct migrate_batch* batch))
+{
+    pthread_mutex_init(&(migrator->lock), NULL);
+    pthread_cond_init(&(migrator->cond), NULL);
+    migrator->first = 0;
+    migrator->queued = 0;
+    migrator->pending = 0;
+    migrator->on_done = on_done;
+    migrator->thread_count = thread_count < MIGRATE_MAX_THREADS ? thread_count :
+        MIGRATE_MAX_THREADS;
+    for(size_t i = 0; i < migrator->thread_count; i++)
+    {
+        if(pthread_create(migrator->threads + i, NULL, worker_main, migrator))
+        {
+            fprintf(stderr, "pthread_create() failed\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void migrator_submit(struct migrator* migrator, struct migrate_batch* batch)
+{
+    pthread_mutex_lock(&(migrator->lock));
+    while(migrator->pending == MIGRATE_QUEUE)
+        pthread_cond_wait(&(migrator->cond), &(migrator->lock));
+    migrator->queue[(migrator->first + migrator->queued) % MIGRATE_QUEUE] = batch;
+    migrator->queued++;
+    migrator->pending++;
+    pthread_cond_broadcast(&(migrator->cond));
+    pthread_mutex_unlock(&(migrator->lock));
+}
+
+size_t migrator_pending(struct migrator* migrator)
+{
+    return __atomic_load_n(&(migrator->pending), __ATOMIC_RELAXED);
+}
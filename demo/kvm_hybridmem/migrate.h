@@ -0,0 +1,90 @@
+#ifndef MIGRATE_H
+#define MIGRATE_H
+
+// An asynchronous executor of page migrations. A batch of pages of a process is moved by
+// a worker thread with one move_pages(), so a slow migration (e.g. to NVM) never stalls
+// whoever submits it. The submitter paces batches with a token bucket of bytes, charged
+// before a batch is submitted and refunded for pages that don't move, so the bandwidth
+// never overshoots the budget for long.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#define MIGRATE_BATCH       512     // max pages per move_pages()
+#define MIGRATE_QUEUE       16      // max batches queued or in flight
+#define MIGRATE_MAX_THREADS 8
+
+struct migrate_batch
+{
+    pid_t pid;                          // the process owning the pages
+    size_t count;                       // count of pages
+    void* addresses[MIGRATE_BATCH];     // heads of pages, a huge page moves as a whole
+    int nodes[MIGRATE_BATCH];           // target nodes
+    int status[MIGRATE_BATCH];          // output nodes of pages, or negative errnos
+    uint32_t ids[MIGRATE_BATCH];        // identifiers of the submitter, e.g. GFNs
+    size_t bytes;                       // bytes to move
+    void* privdata;                     // privdata of the submitter
+};
+
+struct migrator
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;                // signaled when a batch is queued
+    struct migrate_batch* queue[MIGRATE_QUEUE];
+    size_t first;                       // the first batch in 'queue'
+    size_t queued;                      // count of batches in 'queue'
+    size_t pending;                     // count of batches queued or in flight
+    // called by a worker after a batch is done, the batch is the callee's since then
+    void (*on_done)(struct migrate_batch* batch);
+    size_t thread_count;
+    pthread_t threads[MIGRATE_MAX_THREADS];
+};
+
+// a token bucket of bytes, which may go into debt, so a batch larger than the burst
+// still goes, but the next one waits until the debt is paid
+struct token_bucket
+{
+    double tokens;          // bytes allowed to move now
+    double rate;            // bytes per ms
+    double burst;           // max tokens
+    uint64_t time;          // when tokens are refilled, in ms
+};
+
+static inline void token_bucket_init(struct token_bucket* bucket, double rate, double burst,
+    uint64_t time)
+{
+    bucket->tokens = burst;
+    bucket->rate = rate;
+    bucket->burst = burst;
+    bucket->time = time;
+}
+
+// refill tokens up to a time, plus bytes refunded
+static inline void token_bucket_refill(struct token_bucket* bucket, uint64_t time,
+    size_t refund)
+{
+    if(time > bucket->time)
+    {
+        bucket->tokens += bucket->rate * (time - bucket->time);
+        bucket->time = time;
+    }
+    bucket->tokens += refund;
+    if(bucket->tokens > bucket->burst)
+        bucket->tokens = bucket->burst;
+}
+
+// start worker threads
+//  on_done: called by a worker after a batch is done
+// return 0 if succeed, or -1 with a message printed
+int migrator_init(struct migrator* migrator, size_t thread_count,
+    void (*on_done)(struct migrate_batch* batch));
+
+// queue a batch, and wait if the queue is full
+void migrator_submit(struct migrator* migrator, struct migrate_batch* batch);
+
+// count of batches queued or in flight, may be stale
+size_t migrator_pending(struct migrator* migrator);
+
+#endif
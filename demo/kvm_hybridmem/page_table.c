@@ -0,0 +1,45 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "page_table.h"
+
+void page_table_init(struct page_table* table, size_t entry_size)
+{
+    table->entry_size = entry_size;
+    table->chunk_count = 0;
+    memset(table->chunks, 0, sizeof(table->chunks));
+    memset(table->shifts, 0, sizeof(table->shifts));
+}
+
+int page_table_populate(struct page_table* table, uint64_t gfn, uint64_t count, int huge)
+{
+    if(!count)
+        return 0;
+    uint64_t last = gfn + count - 1;
+    if(last >= PAGE_TABLE_MAX_GFN_COUNT)
+        last = PAGE_TABLE_MAX_GFN_COUNT - 1;
+    for(uint64_t i = gfn >> PAGE_TABLE_CHUNK_SHIFT; i <= last >> PAGE_TABLE_CHUNK_SHIFT; i++)
+    {
+        if(table->chunks[i])
+            continue;
+        // a chunk shared with other memslots keeps 4KB units, as they may not be huge
+        uint64_t chunk_gfn = i << PAGE_TABLE_CHUNK_SHIFT;
+        unsigned shift = huge && chunk_gfn >= gfn &&
+            chunk_gfn + PAGE_TABLE_CHUNK_PAGES <= gfn + count ? PAGE_TABLE_HUGE_SHIFT : 0;
+        void* chunk = calloc(PAGE_TABLE_CHUNK_PAGES >> shift, table->entry_size);
+        if(!chunk)
+            return -1;
+        table->shifts[i] = shift;
+        // the zeroed chunk and its shift must be visible before the pointer
+        __atomic_store_n(&(table->chunks[i]), chunk, __ATOMIC_RELEASE);
+        table->chunk_count++;
+    }
+    return 0;
+}
+
+void page_table_deinit(struct page_table* table)
+{
+    for(size_t i = 0; i < PAGE_TABLE_CHUNK_COUNT; i++)
+        free(table->chunks[i]);
+    page_table_init(table, table->entry_size);
+}
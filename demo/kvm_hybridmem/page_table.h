@@ -0,0 +1,63 @@
+#ifndef PAGE_TABLE_H
+#define PAGE_TABLE_H
+
+// A two-level sparse table of page information, indexed by GFN.
+// Page information is allocated by chunks of PAGE_TABLE_CHUNK_PAGES, only for chunks
+// covered by memslots, so holes of the GPA space (e.g. the PCI hole) cost nothing, and
+// memory scales with the RAM of the guest. Chunks never move or get freed until deinit,
+// so a page got from the table keeps valid, and readers need no lock.
+// A chunk fully covered by a huge-page-backed memslot keeps one entry per huge page
+// (a unit) instead of per 4KB page, which cuts its metadata by 512x, and lets callers
+// track, rank and migrate whole huge pages.
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define PAGE_TABLE_MAX_GFN_COUNT    (1UL << 30)     // 4TB, as IDs of rank_page have 30 bits
+#define PAGE_TABLE_CHUNK_SHIFT      15              // 128MB of guest memory per chunk
+#define PAGE_TABLE_CHUNK_PAGES      (1UL << PAGE_TABLE_CHUNK_SHIFT)
+#define PAGE_TABLE_CHUNK_COUNT      (PAGE_TABLE_MAX_GFN_COUNT >> PAGE_TABLE_CHUNK_SHIFT)
+#define PAGE_TABLE_HUGE_SHIFT       9               // 2MB huge pages
+
+struct page_info;
+
+struct page_table
+{
+    size_t entry_size;                      // sizeof(struct page_info)
+    size_t chunk_count;                     // count of allocated chunks
+    void* chunks[PAGE_TABLE_CHUNK_COUNT];   // published by page_table_populate()
+    uint8_t shifts[PAGE_TABLE_CHUNK_COUNT]; // log2 of pages per unit in every chunk
+};
+
+void page_table_init(struct page_table* table, size_t entry_size);
+
+// allocate zeroed chunks covering GFNs [gfn, gfn + count)
+//  huge: are GFNs backed by huge pages, then chunks fully in the range get huge units
+// a chunk keeps its units once allocated
+// it may run with readers, but only one thread may populate at a time
+// return 0 if succeed, or -1 if out of memory
+int page_table_populate(struct page_table* table, uint64_t gfn, uint64_t count, int huge);
+
+void page_table_deinit(struct page_table* table);
+
+// get the page information of the unit containing a GFN
+//  p_shift: output log2 of pages in the unit, the head GFN is gfn >> shift << shift
+// return NULL if it's not covered by any populated chunk
+static inline struct page_info* page_table_get(struct page_table* table, uint64_t gfn,
+    unsigned* p_shift)
+{
+    if(gfn >= PAGE_TABLE_MAX_GFN_COUNT)
+        return NULL;
+    size_t index = gfn >> PAGE_TABLE_CHUNK_SHIFT;
+    char* chunk = __atomic_load_n(&(table->chunks[index]), __ATOMIC_ACQUIRE);
+    if(!chunk)
+        return NULL;
+    // published before the chunk
+    unsigned shift = table->shifts[index];
+    if(p_shift)
+        (*p_shift) = shift;
+    return (struct page_info*)(chunk +
+        table->entry_size * ((gfn & (PAGE_TABLE_CHUNK_PAGES - 1)) >> shift));
+}
+
+#endif
@@ -0,0 +1,141 @@
+#include <math.h>
+#include <stdlib.h>
+
+#include "rank.h"
+
+void rank_init(struct rank* rank)
+{
+    rank->promote = NULL;
+    rank->demote = NULL;
+    rank->promote_count = 0;
+    rank->demote_count = 0;
+    rank->capacity = 0;
+}
+
+void rank_deinit(struct rank* rank)
+{
+    free(rank->promote);
+    free(rank->demote);
+    rank_init(rank);
+}
+
+size_t rank_histogram(size_t* bins, const struct rank_page* pages, size_t count)
+{
+    size_t total = 0;
+    memset(bins, 0, sizeof(size_t) * RANK_BIN_COUNT);
+    for(size_t i = 0; i < count; i++)
+    {
+        size_t weight = pages[i].huge ? RANK_HUGE_PAGES : 1;
+        bins[rank_bin(pages[i].temperature)] += weight;
+        total += weight;
+    }
+    return total;
+}
+
+float rank_histogram_cutoff(const size_t* bins, size_t total, size_t fast_capacity)
+{
+    if(fast_capacity >= total)
+        return 0;
+    if(!fast_capacity)
+        return INFINITY;
+    // accumulate from the hottest bin, until the next bin overflows fast memory
+    size_t hotter = 0;
+    size_t bin = RANK_BIN_COUNT;
+    while(bin > 0 && hotter + bins[bin - 1] <= fast_capacity)
+        hotter += bins[--bin];
+    // even the hottest bin overflows fast memory
+    if(bin == RANK_BIN_COUNT)
+        return INFINITY;
+    return rank_bin_floor(bin);
+}
+
+float rank_cutoff(struct rank* rank, const struct rank_page* pages, size_t count,
+    size_t fast_capacity)
+{
+    size_t total = rank_histogram(rank->promote_bins, pages, count);
+    return rank_histogram_cutoff(rank->promote_bins, total, fast_capacity);
+}
+
+static int reserve(struct rank* rank, size_t capacity)
+{
+    if(capacity <= rank->capacity)
+        return 0;
+    struct rank_page* promote = realloc(rank->promote, sizeof(struct rank_page) * capacity);
+    if(!promote)
+        return -1;
+    rank->promote = promote;
+    struct rank_page* demote = realloc(rank->demote, sizeof(struct rank_page) * capacity);
+    if(!demote)
+        return -1;
+    rank->demote = demote;
+    rank->capacity = capacity;
+    return 0;
+}
+
+int rank_select(struct rank* rank, const struct rank_page* pages, size_t count,
+    float cutoff, float tolerance, ssize_t fast_free)
+{
+    float hot_line = cutoff * (1 + tolerance);
+    float cold_line = cutoff / (1 + tolerance);
+    size_t* promote_bins = rank->promote_bins;
+    size_t* demote_bins = rank->demote_bins;
+    memset(promote_bins, 0, sizeof(rank->promote_bins));
+    memset(demote_bins, 0, sizeof(rank->demote_bins));
+    // pass 1: count pages crossing the band in every bin
+    size_t promote_count = 0, demote_count = 0, demoted_pages = 0;
+    for(size_t i = 0; i < count; i++)
+    {
+        float temperature = pages[i].temperature;
+        if(!pages[i].fast && temperature >= hot_line)
+        {
+            promote_bins[rank_bin(temperature)]++;
+            promote_count++;
+        }
+        else if(pages[i].fast && temperature < cold_line)
+        {
+            demote_bins[rank_bin(temperature)]++;
+            demote_count++;
+            demoted_pages += pages[i].huge ? RANK_HUGE_PAGES : 1;
+        }
+    }
+    if(reserve(rank, promote_count > demote_count ? promote_count : demote_count))
+        return -1;
+    // turn counts into offsets, the hottest bin first for promotions, and the coldest bin
+    // first for demotions
+    size_t offset = 0;
+    for(size_t bin = RANK_BIN_COUNT; bin > 0; bin--)
+    {
+        size_t bin_count = promote_bins[bin - 1];
+        promote_bins[bin - 1] = offset;
+        offset += bin_count;
+    }
+    offset = 0;
+    for(size_t bin = 0; bin < RANK_BIN_COUNT; bin++)
+    {
+        size_t bin_count = demote_bins[bin];
+        demote_bins[bin] = offset;
+        offset += bin_count;
+    }
+    // pass 2: place pages, which is a counting sort by bins
+    for(size_t i = 0; i < count; i++)
+    {
+        float temperature = pages[i].temperature;
+        if(!pages[i].fast && temperature >= hot_line)
+            rank->promote[promote_bins[rank_bin(temperature)]++] = pages[i];
+        else if(pages[i].fast && temperature < cold_line)
+            rank->demote[demote_bins[rank_bin(temperature)]++] = pages[i];
+    }
+    // fast memory can't hold more than its free pages plus the demoted ones
+    ssize_t room = fast_free + (ssize_t)demoted_pages;
+    size_t fit_count = 0;
+    for(; fit_count < promote_count; fit_count++)
+    {
+        room -= rank->promote[fit_count].huge ? RANK_HUGE_PAGES : 1;
+        if(room < 0)
+            break;
+    }
+    promote_count = fit_count;
+    rank->promote_count = promote_count;
+    rank->demote_count = demote_count;
+    return 0;
+}
@@ -0,0 +1,93 @@
+#ifndef RANK_H
+#define RANK_H
+
+// Rank pages by temperature in O(n) without a comparison sort.
+// Temperatures are bucketed into a log-scale histogram, taken from the bits of the float
+// itself: the exponent and the top RANK_MANTISSA_BITS bits of mantissa, so every bin is
+// 1/16 of an octave (about 4.4%) wide. One pass over the histogram gives the cutoff of the
+// hottest N pages, and a tolerance band around the cutoff keeps pages from bouncing
+// between tiers. Only pages that cross the band are emitted, ordered by bins.
+// A page may be a huge page, which weighs RANK_HUGE_PAGES pages in fast memory, so its
+// temperature should be given per 4KB page.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/types.h>
+
+#define RANK_MANTISSA_BITS  4
+#define RANK_BIN_SHIFT      (23 - RANK_MANTISSA_BITS)
+#define RANK_BIN_COUNT      (1 << (31 - RANK_BIN_SHIFT))
+#define RANK_HUGE_PAGES     512     // 4KB pages in a 2MB huge page
+
+// a page to rank
+struct rank_page
+{
+    float temperature;      // the temperature per 4KB page, never negative
+    uint32_t id : 30;       // an identifier of the caller, e.g. the GFN
+    uint32_t huge : 1;      // is it a 2MB huge page
+    uint32_t fast : 1;      // is the page in fast memory
+};
+
+struct rank
+{
+    struct rank_page* promote;  // pages to promote, hottest first
+    size_t promote_count;
+    struct rank_page* demote;   // pages to demote, coldest first
+    size_t demote_count;
+    size_t capacity;            // capacity of 'promote' and 'demote'
+    size_t promote_bins[RANK_BIN_COUNT];
+    size_t demote_bins[RANK_BIN_COUNT];
+};
+
+// the histogram bin of a temperature, higher temperatures never get lower bins
+static inline size_t rank_bin(float temperature)
+{
+    uint32_t bits;
+    memcpy(&bits, &temperature, sizeof(bits));
+    // negative temperatures are not expected, treat them as 0
+    if(bits >> 31)
+        return 0;
+    return bits >> RANK_BIN_SHIFT;
+}
+
+// the lowest temperature of a bin
+static inline float rank_bin_floor(size_t bin)
+{
+    uint32_t bits = (uint32_t)bin << RANK_BIN_SHIFT;
+    float temperature;
+    memcpy(&temperature, &bits, sizeof(temperature));
+    return temperature;
+}
+
+void rank_init(struct rank* rank);
+
+void rank_deinit(struct rank* rank);
+
+// count 4KB pages of pages in every bin of 'bins', RANK_BIN_COUNT of them
+// return the count of all 4KB pages
+size_t rank_histogram(size_t* bins, const struct rank_page* pages, size_t count);
+
+// find the temperature cutoff of the hottest 'fast_capacity' 4KB pages in a histogram
+//  total: the count of all 4KB pages in the histogram
+// return the cutoff, 0 if all pages fit in fast memory
+float rank_histogram_cutoff(const size_t* bins, size_t total, size_t fast_capacity);
+
+// find the temperature cutoff of the hottest 'fast_capacity' 4KB pages, in one pass
+// no more than 'fast_capacity' 4KB pages are hotter than or as hot as the cutoff
+// return the cutoff, 0 if all pages fit in fast memory
+float rank_cutoff(struct rank* rank, const struct rank_page* pages, size_t count,
+    size_t fast_capacity);
+
+// select pages that cross the tolerance band around the cutoff, in two passes
+//  cutoff: the cutoff from rank_cutoff(), maybe decayed since then
+//  tolerance: the band is [cutoff / (1 + tolerance), cutoff * (1 + tolerance))
+//  fast_free: free 4KB pages of fast memory, negative if fast memory is overcommitted
+// a page not in fast memory is promoted if it's above the band, and a page in fast memory
+// is demoted if it's below the band; the coldest promotions are dropped if fast memory
+// can't hold them after demotions
+// return 0 if succeed, or -1 if out of memory
+int rank_select(struct rank* rank, const struct rank_page* pages, size_t count,
+    float cutoff, float tolerance, ssize_t fast_free);
+
+#endif
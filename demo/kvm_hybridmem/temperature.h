@@ -0,0 +1,92 @@
+#ifndef TEMPERATURE_H
+#define TEMPERATURE_H
+
+// Fixed-point temperatures with lazy decay, so that updating a page on a sample is an
+// integer add (and a shift at most), without pow() per sample.
+// Time is split into epochs of TEMPERATURE_EPOCH_HALF_LIVES half-lives. A page keeps its
+// temperature as a fixed-point value relative to the start of an epoch, i.e. the real
+// temperature at time t is
+//      value * 2^(-(t - start of the epoch) / half_life) / 2^TEMPERATURE_SHIFT
+// so an addition at time t is scaled up by 2^((t - start of the epoch) / half_life), which
+// is the same for all samples read at the same time. Moving a value to a later epoch is a
+// right shift of TEMPERATURE_EPOCH_HALF_LIVES bits per epoch. The decay is only computed
+// when a temperature is read for ranking.
+
+#include <math.h>
+#include <stdint.h>
+
+#define TEMPERATURE_SHIFT           8   // fractional bits of fixed-point values
+#define TEMPERATURE_EPOCH_HALF_LIVES 8  // half-lives per epoch, also bits shifted per epoch
+#define TEMPERATURE_EPOCH_BITS      13  // bits of epochs, so they fit in bit-fields
+#define TEMPERATURE_EPOCH_MASK      ((1U << TEMPERATURE_EPOCH_BITS) - 1)
+
+struct temperature_clock
+{
+    uint64_t start_time;    // the start of epoch 0, in ms
+    float half_life;        // in ms
+    uint64_t epoch_length;  // in ms
+};
+
+static inline void temperature_clock_init(struct temperature_clock* clock,
+    uint64_t start_time, float half_life)
+{
+    clock->start_time = start_time;
+    clock->half_life = half_life;
+    clock->epoch_length = (uint64_t)(half_life * TEMPERATURE_EPOCH_HALF_LIVES);
+    if(!clock->epoch_length)
+        clock->epoch_length = 1;
+}
+
+// the epoch of a time, which wraps around after 2^TEMPERATURE_EPOCH_BITS epochs
+static inline uint16_t temperature_epoch(const struct temperature_clock* clock, uint64_t time)
+{
+    if(time < clock->start_time)
+        return 0;
+    return (uint16_t)((time - clock->start_time) / clock->epoch_length & TEMPERATURE_EPOCH_MASK);
+}
+
+// the scale of an addition at a time, relative to the start of its epoch
+static inline float temperature_scale(const struct temperature_clock* clock, uint64_t time)
+{
+    if(time < clock->start_time)
+        return 1;
+    uint64_t offset = (time - clock->start_time) % clock->epoch_length;
+    return exp2f(offset / clock->half_life);
+}
+
+// a fixed-point addition at a time, with the scale of temperature_scale()
+static inline uint32_t temperature_addition(float addition, float scale)
+{
+    float value = addition * scale * (1 << TEMPERATURE_SHIFT);
+    return value < UINT32_MAX ? (uint32_t)value : UINT32_MAX;
+}
+
+// move a value from an epoch to a later one, the distance wraps around at half of the
+// epochs, so a value must be rebased before it's that old
+static inline uint32_t temperature_rebase(uint32_t value, uint16_t from, uint16_t to)
+{
+    unsigned epochs = (to - from) & TEMPERATURE_EPOCH_MASK;
+    // a value from a little later (e.g. stamped by a racing thread) is taken as it is
+    if(!epochs || epochs > TEMPERATURE_EPOCH_MASK / 2)
+        return value;
+    if(epochs >= 32 / TEMPERATURE_EPOCH_HALF_LIVES)
+        return 0;
+    return value >> (epochs * TEMPERATURE_EPOCH_HALF_LIVES);
+}
+
+// add without overflow
+static inline uint32_t temperature_add(uint32_t value, uint32_t addition)
+{
+    uint32_t sum = value + addition;
+    return sum >= value ? sum : UINT32_MAX;
+}
+
+// the real temperature of a value of an epoch at a time
+static inline float temperature_read(const struct temperature_clock* clock, uint32_t value,
+    uint16_t epoch, uint64_t time)
+{
+    value = temperature_rebase(value, epoch, temperature_epoch(clock, time));
+    return value / temperature_scale(clock, time) / (1 << TEMPERATURE_SHIFT);
+}
+
+#endif
@@ -0,0 +1,1269 @@
+#define _GNU_SOURCE     // sched_getaffinity()
+
+#include <math.h>
+#include <time.h>
+#include <sched.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/syscall.h>
+
+#include "vm.h"
+#include "checkpoint.h"
+
+#define FORCE_REFRESH_LOOP  30
+#define CLOCK_MIN_VISITS    4096    // min upper pages visited by the clock hand per scan
+#define CLOCK_VISIT_RATIO   4       // upper pages visited per hot candidate per scan
+#define NODE_QUERY_BATCH    4096    // pages per move_pages() when querying NUMA nodes
+#define READ_BATCH          128     // samples per read()
+
+uint64_t get_current_ms()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000 + (uint64_t)tv.tv_usec / 1000;
+}
+
+// the current time of the VM, in ms
+static uint64_t get_time(struct vm* vm)
+{
+    const struct vm_hooks* hooks = vm->params.hooks;
+    return hooks ? hooks->get_time(hooks->privdata) : get_current_ms();
+}
+
+// move_pages(2) on the VM's process, which only queries nodes if 'nodes' is NULL
+// return 0 if succeed, or -1 with errno set
+static long call_move_pages(struct vm* vm, size_t count, void** addresses, const int* nodes,
+    int* status)
+{
+    const struct vm_hooks* hooks = vm->params.hooks;
+    if(hooks)
+        return hooks->move_pages(hooks->privdata, count, addresses, nodes, status);
+    return syscall(SYS_move_pages, vm->params.pid, count, addresses, nodes, status, 0) < 0 ?
+        -1 : 0;
+}
+
+// the temperature of a page at 'current_time', without updating it
+static float get_temperature(struct vm* vm, struct page_info* page, uint64_t current_time)
+{
+    return temperature_read(&(vm->clock), page->temperature, page->epoch, current_time);
+}
+
+// fixed-point additions of samples read at a time, indexed by xwr
+static void get_additions(struct vm* vm, uint64_t time, v8u32* p_additions)
+{
+    const struct vm_params* params = &(vm->params);
+    float scale = temperature_scale(&(vm->clock), time);
+    uint32_t x = temperature_addition(params->xaddition, scale);
+    uint32_t w = temperature_addition(params->waddition, scale);
+    uint32_t r = temperature_addition(params->raddition, scale);
+    // 'exec' goes first, then 'write', then 'read'
+    v8u32 additions = {0, r, w, w, x, x, x, x};
+    (*p_additions) = additions;
+}
+
+static void* alloc_page(void* privdata)
+{
+    void* page;
+    return posix_memalign(&page, PAGE_SIZE, PAGE_SIZE) ? NULL : page;
+}
+
+static void free_page(void* page, void* privdata)
+{
+    free(page);
+}
+
+static int gfn_list_push(struct gfn_list* list, uint64_t gfn)
+{
+    if(list->count == list->capacity)
+    {
+        size_t capacity = list->capacity ? list->capacity * 2 : 4096;
+        uint32_t* gfns = realloc(list->gfns, sizeof(uint32_t) * capacity);
+        if(!gfns)
+            return -1;
+        list->gfns = gfns;
+        list->capacity = capacity;
+    }
+    list->gfns[list->count++] = (uint32_t)gfn;
+    return 0;
+}
+
+// log2 of pages in the unit of a GFN in a populated chunk, see page_table.h
+static unsigned get_shift(struct vm* vm, uint64_t gfn)
+{
+    return vm->pages.shifts[gfn >> PAGE_TABLE_CHUNK_SHIFT];
+}
+
+// GFNs of a unit always go to the same shard, as units are never larger than chunks of
+// shards
+static struct shard* get_shard(struct vm* vm, uint64_t gfn)
+{
+    return vm->shards + (gfn >> SHARD_SHIFT) % vm->params.shard_count;
+}
+
+// the tier of a page, or -1 if it's not mapped or not known yet
+static int get_page_tier(struct vm* vm, struct page_info* page)
+{
+    if(!page->node_inited || page->node < 0)
+        return -1;
+    return vm->node_tiers[page->node];
+}
+
+// update where a unit is, and keep 'upper' and 'resident' of its shard in sync
+//  gfn: the head GFN of the unit
+// the lock of the shard must be held
+static void set_page_node(struct vm* vm, struct shard* shard, uint64_t gfn,
+    struct page_info* page, int inited, int node)
+{
+    int old_tier = get_page_tier(vm, page);
+    page->node = node;
+    page->node_inited = inited;
+    int tier = get_page_tier(vm, page);
+    if(old_tier != tier)
+    {
+        size_t unit_pages = 1UL << get_shift(vm, gfn);
+        if(old_tier >= 0)
+            shard->resident[old_tier] -= unit_pages;
+        if(tier >= 0)
+            shard->resident[tier] += unit_pages;
+    }
+    // if out of memory, the page is left out until the next full refresh
+    if(tier >= 0 && tier < (int)vm->params.tier_count - 1 && !page->upper_listed &&
+        !gfn_list_push(&(shard->upper), gfn))
+        page->upper_listed = 1;
+}
+
+// a page is sampled, make it a hot candidate if it may not be in the fastest tier
+// the lock of the shard must be held
+static void on_page_sampled(struct vm* vm, struct shard* shard, uint64_t gfn,
+    struct page_info* page)
+{
+    if(page->hot_listed || get_page_tier(vm, page) == 0)
+        return;
+    if(!gfn_list_push(&(shard->hot), gfn))
+        page->hot_listed = 1;
+}
+
+// count of guest pages in the normal address space
+static size_t get_guest_page_count(const struct kvm_ept_client* memslots)
+{
+    size_t page_count = 0;
+    for(size_t i = 0; i < memslots->sorted_count; i++)
+        page_count += memslots->sorted[i].page_count;
+    return page_count;
+}
+
+// a VMA in /proc/<pid>/smaps
+struct smaps_vma
+{
+    uint64_t start;
+    uint64_t end;
+    unsigned long kernel_page_size;     // in kB
+    unsigned long rss;                  // in kB
+    unsigned long pmd_mapped;           // in kB, THP of anonymous, shmem or file memory
+};
+
+// account a VMA in memslots it overlaps: a memslot stays huge only if every VMA of it is
+// hugetlbfs, or has all its resident memory mapped by THP
+//  covered: output bytes of memslots covered by such VMAs
+static void account_vma(const struct smaps_vma* vma,
+    const struct kvm_ept_sample_memslot_ex* memslots, size_t memslot_count, int* huge,
+    uint64_t* covered)
+{
+    int backed = vma->kernel_page_size >= HUGE_PAGE_SIZE / 1024 ||
+        (vma->rss && vma->pmd_mapped == vma->rss);
+    for(size_t i = 0; i < memslot_count; i++)
+    {
+        uint64_t start = memslots[i].hva;
+        uint64_t end = start + memslots[i].page_count * PAGE_SIZE;
+        if(vma->end <= start || vma->start >= end)
+            continue;
+        if(!backed)
+            huge[i] = 0;
+        else
+            covered[i] += (vma->end < end ? vma->end : end) -
+                (vma->start > start ? vma->start : start);
+    }
+}
+
+// find memslots backed by 2MB huge pages (THP or hugetlbfs) in /proc/<pid>/smaps
+// A memslot with any 4KB page mapped would have units that move_pages() moves by 4KB only,
+// so only memslots all mapped by huge pages are taken, and others fall back to 4KB pages.
+//  huge: output flags of memslots
+static void detect_huge_memslots(pid_t pid, const struct kvm_ept_sample_memslot_ex* memslots,
+    size_t memslot_count, int* huge)
+{
+    memset(huge, 0, sizeof(int) * memslot_count);
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/smaps", (int)pid);
+    FILE* file = fopen(path, "r");
+    // never allocate 0 bytes
+    uint64_t* covered = calloc(memslot_count + 1, sizeof(uint64_t));
+    // fall back to 4KB pages
+    if(!file || !covered)
+    {
+        if(file)
+            fclose(file);
+        free(covered);
+        return;
+    }
+    // a guest huge page must be a host huge page too
+    for(size_t i = 0; i < memslot_count; i++)
+        huge[i] = !((memslots[i].hva ^ memslots[i].gpa) & (HUGE_PAGE_SIZE - 1));
+    char line[256];
+    struct smaps_vma vma = {0};
+    int has_vma = 0;
+    while(fgets(line, sizeof(line), file))
+    {
+        unsigned long vma_start, vma_end, size;
+        if(sscanf(line, "%lx-%lx ", &vma_start, &vma_end) == 2)
+        {
+            if(has_vma)
+                account_vma(&vma, memslots, memslot_count, huge, covered);
+            memset(&vma, 0, sizeof(vma));
+            vma.start = vma_start;
+            vma.end = vma_end;
+            has_vma = 1;
+            continue;
+        }
+        char key[64];
+        if(sscanf(line, "%63[^:]: %lu kB", key, &size) != 2)
+            continue;
+        if(!strcmp(key, "KernelPageSize"))
+            vma.kernel_page_size = size;
+        else if(!strcmp(key, "Rss"))
+            vma.rss = size;
+        else if(!strcmp(key, "AnonHugePages") || !strcmp(key, "ShmemPmdMapped") ||
+            !strcmp(key, "FilePmdMapped"))
+            vma.pmd_mapped += size;
+    }
+    if(has_vma)
+        account_vma(&vma, memslots, memslot_count, huge, covered);
+    // parts of a memslot in no VMA are never mapped by huge pages
+    for(size_t i = 0; i < memslot_count; i++)
+    {
+        if(covered[i] != memslots[i].page_count * PAGE_SIZE)
+            huge[i] = 0;
+    }
+    free(covered);
+    fclose(file);
+}
+
+// populate page information for memslots of the normal address space the client has got,
+// then publish them
+// return 0 if succeed, or -1 with errno set
+static int publish_memslots(struct vm* vm)
+{
+    const struct kvm_ept_client* client = &(vm->client);
+    // never allocate 0 bytes
+    int* huge = malloc(sizeof(int) * (client->sorted_count + 1));
+    if(!huge)
+        return -1;
+    const struct vm_hooks* hooks = vm->params.hooks;
+    if(hooks)
+    {
+        for(size_t i = 0; i < client->sorted_count; i++)
+            huge[i] = hooks->huge;
+    }
+    else
+        detect_huge_memslots(vm->params.pid, client->sorted, client->sorted_count, huge);
+    for(size_t i = 0; i < client->sorted_count; i++)
+    {
+        uint64_t gfn = client->sorted[i].gpa / PAGE_SIZE;
+        if(page_table_populate(&(vm->pages), gfn, client->sorted[i].page_count, huge[i]))
+        {
+            free(huge);
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    free(huge);
+    pthread_mutex_lock(&(vm->memslot_lock));
+    int ret = kvm_ept_client_copy_memslots(&(vm->memslots), client);
+    if(!ret)
+        vm->guest_pages = get_guest_page_count(client);
+    pthread_mutex_unlock(&(vm->memslot_lock));
+    return ret;
+}
+
+static struct rank_page* reserve_input(struct vm* vm, size_t count)
+{
+    if(vm->input && count <= vm->input_capacity)
+        return vm->input;
+    // never return NULL for an empty input
+    if(!count)
+        count = 1;
+    struct rank_page* input = realloc(vm->input, sizeof(struct rank_page) * count);
+    if(!input)
+        return NULL;
+    vm->input = input;
+    int8_t* input_tiers = realloc(vm->input_tiers, sizeof(int8_t) * count);
+    if(!input_tiers)
+        return NULL;
+    vm->input_tiers = input_tiers;
+    struct rank_page* subset = realloc(vm->subset, sizeof(struct rank_page) * count);
+    if(!subset)
+        return NULL;
+    vm->subset = subset;
+    vm->input_capacity = count;
+    return input;
+}
+
+static void release_input(struct vm* vm)
+{
+    free(vm->input);
+    vm->input = NULL;
+    free(vm->input_tiers);
+    vm->input_tiers = NULL;
+    free(vm->subset);
+    vm->subset = NULL;
+    vm->input_capacity = 0;
+}
+
+// scans per cooldown epoch, so that a cooldown spans COOLDOWN_STAMPS - 3 epochs at most,
+// and a stamp expires well before it wraps around
+static size_t get_cooldown_length(struct vm* vm)
+{
+    size_t epochs = COOLDOWN_STAMPS - 3;
+    return (vm->params.cooldown + epochs - 1) / epochs;
+}
+
+// the stamp of the cooldown epoch of a count of scans, with a cooldown only
+static uint8_t get_cooldown_stamp(struct vm* vm, size_t scan_count)
+{
+    return scan_count / get_cooldown_length(vm) % COOLDOWN_STAMPS + 1;
+}
+
+// has a page moved in the latest 'cooldown' scans, so it may not move back yet
+// A page is stamped with the cooldown epoch it moves in, and cools down till the epoch
+// 'cooldown' scans later is over, so it stays for 'cooldown' scans at least, and 2
+// cooldown epochs more at most. Full refreshes clear expired stamps, so a stamp wraps
+// around only if it's left for long, which only holds the page a while more.
+// the lock of the shard must be held
+static int is_cooling_down(struct vm* vm, struct page_info* page)
+{
+    if(!vm->params.cooldown || !page->moved)
+        return 0;
+    size_t length = get_cooldown_length(vm);
+    // the count of scans is stamped after it's increased by the scan planning the move
+    uint8_t stamp = get_cooldown_stamp(vm, __atomic_load_n(&(vm->scan_count),
+        __ATOMIC_RELAXED));
+    unsigned epochs = (stamp + COOLDOWN_STAMPS - page->moved) % COOLDOWN_STAMPS;
+    return epochs <= (vm->params.cooldown + length - 1) / length;
+}
+
+// the lock of the shard must be held
+static void append_input(struct vm* vm, struct rank_page* input, size_t* p_count,
+    uint64_t gfn, struct page_info* page, uint64_t current_time)
+{
+    struct rank_page* input_page = input + (*p_count);
+    unsigned shift = get_shift(vm, gfn);
+    // rank huge pages by their temperature per 4KB page
+    input_page->temperature = get_temperature(vm, page, current_time) / (1 << shift);
+    input_page->id = (uint32_t)gfn;
+    input_page->huge = shift != 0;
+    // 'fast' is set per boundary of tiers, see vm_scan()
+    input_page->fast = 0;
+    // a page cooling down takes no part in ranking, but still in the histogram
+    vm->input_tiers[(*p_count)++] = is_cooling_down(vm, page) ? TIER_COOLING :
+        get_page_tier(vm, page);
+}
+
+// query NUMA nodes of a batch of pages, and add the mapped ones to the input
+static int query_nodes(struct vm* vm, void** addresses, uint64_t* gfns, size_t count,
+    struct rank_page* input, size_t* p_page_count, uint64_t current_time)
+{
+    int status[NODE_QUERY_BATCH];
+    uint16_t epoch = temperature_epoch(&(vm->clock), current_time);
+    if(call_move_pages(vm, count, addresses, NULL, status))
+        return -1;
+    struct shard* locked = NULL;
+    for(size_t i = 0; i < count; i++)
+    {
+        struct page_info* page = page_table_get(&(vm->pages), gfns[i], NULL);
+        struct shard* shard = get_shard(vm, gfns[i]);
+        // neighboring pages are mostly in the same shard, so switch locks only when needed
+        if(shard != locked)
+        {
+            if(locked)
+                pthread_mutex_unlock(&(locked->lock));
+            pthread_mutex_lock(&(shard->lock));
+            locked = shard;
+        }
+        // a negative status (e.g. -ENOENT) means the page is not mapped
+        set_page_node(vm, shard, gfns[i], page, 1, status[i]);
+        // move the temperature to the current epoch, so that epochs of pages never
+        // sampled again don't wrap around
+        page->temperature = temperature_rebase(page->temperature, page->epoch, epoch);
+        page->epoch = epoch;
+        // and clear the stamp of a cooldown that's over, so that it doesn't wrap around
+        if(!is_cooling_down(vm, page))
+            page->moved = 0;
+        if(status[i] >= 0)
+            append_input(vm, input, p_page_count, gfns[i], page, current_time);
+    }
+    if(locked)
+        pthread_mutex_unlock(&(locked->lock));
+    return 0;
+}
+
+// refresh NUMA nodes of all guest pages, and build input of the mapped ones
+// it costs O(guest size), so it's only done once in a while, to catch pages moved by
+// others (e.g. NUMA balancing) and pages never sampled
+static struct rank_page* build_full_input(struct vm* vm, struct kvm_ept_client* memslots,
+    uint64_t current_time, size_t* p_page_count)
+{
+    struct rank_page* input = reserve_input(vm, get_guest_page_count(memslots));
+    if(!input)
+        return NULL;
+    // all pages are in the input, so hot candidates are all handled
+    for(size_t i = 0; i < vm->params.shard_count; i++)
+    {
+        struct shard* shard = vm->shards + i;
+        pthread_mutex_lock(&(shard->lock));
+        for(size_t j = 0; j < shard->hot.count; j++)
+            page_table_get(&(vm->pages), shard->hot.gfns[j], NULL)->hot_listed = 0;
+        shard->hot.count = 0;
+        pthread_mutex_unlock(&(shard->lock));
+    }
+    void* addresses[NODE_QUERY_BATCH];
+    uint64_t gfns[NODE_QUERY_BATCH];
+    size_t batch_count = 0, page_count = 0;
+    for(size_t i = 0; i < memslots->sorted_count; i++)
+    {
+        uint64_t gfn = memslots->sorted[i].gpa / PAGE_SIZE;
+        uint64_t hva = memslots->sorted[i].hva;
+        size_t slot_page_count = memslots->sorted[i].page_count;
+        // query the head of every unit, a huge page is never split by a memslot, as only
+        // chunks fully in a memslot have huge units
+        for(size_t j = 0; j < slot_page_count; )
+        {
+            unsigned shift;
+            // skip GFNs beyond the page table
+            if(!page_table_get(&(vm->pages), gfn + j, &shift))
+            {
+                j++;
+                continue;
+            }
+            addresses[batch_count] = (void*)(hva + j * PAGE_SIZE);
+            gfns[batch_count] = gfn + j;
+            j += 1UL << shift;
+            if(++batch_count == NODE_QUERY_BATCH)
+            {
+                if(query_nodes(vm, addresses, gfns, batch_count, input, &page_count,
+                    current_time))
+                    return NULL;
+                batch_count = 0;
+            }
+        }
+    }
+    if(batch_count && query_nodes(vm, addresses, gfns, batch_count, input, &page_count,
+        current_time))
+        return NULL;
+    (*p_page_count) = page_count;
+    return input;
+}
+
+// build input of hot-in-lower and cold-in-upper candidates only
+static struct rank_page* build_candidate_input(struct vm* vm,
+    struct kvm_ept_client* memslots, uint64_t current_time, size_t* p_page_count)
+{
+    size_t page_count = 0;
+    for(size_t i = 0; i < vm->params.shard_count; i++)
+    {
+        struct shard* shard = vm->shards + i;
+        pthread_mutex_lock(&(shard->lock));
+        struct gfn_list* hot = &(shard->hot);
+        struct gfn_list* upper = &(shard->upper);
+        size_t visits = hot->count * CLOCK_VISIT_RATIO;
+        if(visits < CLOCK_MIN_VISITS / vm->params.shard_count)
+            visits = CLOCK_MIN_VISITS / vm->params.shard_count;
+        if(visits > upper->count)
+            visits = upper->count;
+        // the input may move, so get it again for every shard
+        struct rank_page* input = reserve_input(vm, page_count + hot->count + visits);
+        if(!input)
+        {
+            pthread_mutex_unlock(&(shard->lock));
+            return NULL;
+        }
+        // hot-in-lower: all pages sampled since the latest scan, then the list starts over
+        for(size_t j = 0; j < hot->count; j++)
+        {
+            struct page_info* page = page_table_get(&(vm->pages), hot->gfns[j], NULL);
+            page->hot_listed = 0;
+            // skip pages that have been promoted to the fastest tier or are not mapped
+            if(page->node_inited && get_page_tier(vm, page) <= 0)
+                continue;
+            if(!kvm_ept_client_gfn_to_hva(memslots, hot->gfns[j]))
+                continue;
+            append_input(vm, input, &page_count, hot->gfns[j], page, current_time);
+        }
+        hot->count = 0;
+        // cold-in-upper: advance the CLOCK hand over a window of pages in upper tiers, the
+        // ranking engine picks the ones below the band
+        for(; visits && upper->count; visits--)
+        {
+            if(shard->hand >= upper->count)
+                shard->hand = 0;
+            uint32_t gfn = upper->gfns[shard->hand];
+            struct page_info* page = page_table_get(&(vm->pages), gfn, NULL);
+            int tier = get_page_tier(vm, page);
+            if(tier < 0 || tier == (int)vm->params.tier_count - 1 ||
+                !kvm_ept_client_gfn_to_hva(memslots, gfn))
+            {
+                // the page has left upper tiers, drop it
+                page->upper_listed = 0;
+                upper->gfns[shard->hand] = upper->gfns[--upper->count];
+                continue;
+            }
+            shard->hand++;
+            append_input(vm, input, &page_count, gfn, page, current_time);
+        }
+        pthread_mutex_unlock(&(shard->lock));
+    }
+    (*p_page_count) = page_count;
+    return vm->input;
+}
+
+// count pages in every tier
+static void get_resident(struct vm* vm, ssize_t* resident)
+{
+    memset(resident, 0, sizeof(ssize_t) * vm->params.tier_count);
+    for(size_t i = 0; i < vm->params.shard_count; i++)
+    {
+        struct shard* shard = vm->shards + i;
+        pthread_mutex_lock(&(shard->lock));
+        for(size_t j = 0; j < vm->params.tier_count; j++)
+            resident[j] += shard->resident[j];
+        pthread_mutex_unlock(&(shard->lock));
+    }
+}
+
+static void append_task(struct vm* vm, struct kvm_ept_client* memslots,
+    const struct rank_page* selected, int node, float benefit)
+{
+    struct vm_task* task = vm->plan + (vm->plan_count++);
+    // the head of a huge page, so that the whole folio moves at once
+    task->address = kvm_ept_client_gfn_to_hva(memslots, selected->id);
+    task->benefit = benefit;
+    task->gfn = selected->id;
+    task->node = node;
+}
+
+// the time a page costs in the lower tier than in the upper one within the payoff horizon,
+// in ns, as the temperature is the decayed sum of samples, i.e. samples per half-life / ln2
+static double get_gain(struct vm* vm, const struct rank_page* page, size_t boundary)
+{
+    const struct vm_params* params = &(vm->params);
+    double pages = page->huge ? RANK_HUGE_PAGES : 1;
+    double samples_per_second = page->temperature * pages * M_LN2 * 1000 / params->half_life;
+    double gap = (double)params->tiers[boundary + 1].latency - params->tiers[boundary].latency;
+    return samples_per_second * params->accesses_per_sample * params->payoff_horizon * gap;
+}
+
+// the time to migrate a page, in ns
+static double get_cost(struct vm* vm, const struct rank_page* page)
+{
+    const struct vm_params* params = &(vm->params);
+    return (page->huge ? RANK_HUGE_PAGES : 1) * (double)params->copy_ns + params->shootdown_ns;
+}
+
+// append pages selected by the ranking engine at a boundary of tiers to the plan of
+// migration, ordered by benefit: promotions go hottest first, and demotions go just
+// before the promotions that need their room, with the benefit of those promotions
+// With the cost model, a promotion only goes if its gain pays for itself and the
+// demotions it needs, which stops at the first one that doesn't as colder ones gain less,
+// and other demotions only go to fit the VM's share.
+//  boundary: pages move between tier 'boundary' and tier 'boundary' + 1
+//  p_upper_free: free 4KB pages of the upper tier, updated by the moves
+//  p_lower_free: free 4KB pages of the lower tier, updated by the moves
+// return 0 if succeed, or -1 if out of memory
+static int build_plan(struct vm* vm, struct kvm_ept_client* memslots, size_t boundary,
+    ssize_t* p_upper_free, ssize_t* p_lower_free, float cutoff)
+{
+    struct rank* rank = &(vm->rank);
+    size_t count = vm->plan_count + rank->promote_count + rank->demote_count;
+    if(!vm->plan || count > vm->plan_capacity)
+    {
+        // never fail for no task
+        size_t capacity = count ? count : 1;
+        struct vm_task* plan = realloc(vm->plan, sizeof(struct vm_task) * capacity);
+        if(!plan)
+            return -1;
+        vm->plan = plan;
+        vm->plan_capacity = capacity;
+    }
+    // move to the node of the tier nearest to the VM
+    int upper_node = vm->tier_nodes[boundary];
+    int lower_node = vm->tier_nodes[boundary + 1];
+    ssize_t upper_free = *p_upper_free, lower_free = *p_lower_free;
+    size_t demoted = 0;
+    int cost_model = vm->params.payoff_horizon > 0;
+    for(size_t i = 0; i < rank->promote_count; i++)
+    {
+        const struct rank_page* promoted = rank->promote + i;
+        ssize_t size = promoted->huge ? RANK_HUGE_PAGES : 1;
+        if(cost_model)
+        {
+            double net = get_gain(vm, promoted, boundary) - get_cost(vm, promoted);
+            ssize_t free = upper_free;
+            for(size_t j = demoted; free < size && j < rank->demote_count; j++)
+            {
+                const struct rank_page* selected = rank->demote + j;
+                net -= get_gain(vm, selected, boundary) + get_cost(vm, selected);
+                free += selected->huge ? RANK_HUGE_PAGES : 1;
+            }
+            if(net <= 0)
+                break;
+        }
+        while(upper_free < size && demoted < rank->demote_count)
+        {
+            const struct rank_page* selected = rank->demote + (demoted++);
+            ssize_t demoted_size = selected->huge ? RANK_HUGE_PAGES : 1;
+            upper_free += demoted_size;
+            lower_free -= demoted_size;
+            append_task(vm, memslots, selected, lower_node,
+                promoted->temperature);
+        }
+        upper_free -= size;
+        lower_free += size;
+        append_task(vm, memslots, promoted, upper_node, promoted->temperature);
+    }
+    // the rest make room for pages around the cutoff
+    for(; demoted < rank->demote_count && (!cost_model || upper_free < 0); demoted++)
+    {
+        const struct rank_page* selected = rank->demote + demoted;
+        ssize_t size = selected->huge ? RANK_HUGE_PAGES : 1;
+        upper_free += size;
+        lower_free -= size;
+        append_task(vm, memslots, selected, lower_node, cutoff);
+    }
+    (*p_upper_free) = upper_free;
+    (*p_lower_free) = lower_free;
+    return 0;
+}
+
+// (PLACEMENT_ARC) adjust temperatures of the subset of a boundary of tiers, so that only
+// frequent pages and pages of ghost regions are promoted, and recent pages in the fastest
+// tier are demoted first if there are more of them than the target
+//  resident: pages of the VM in the fastest tier
+static void apply_arc(struct vm* vm, size_t subset_count, size_t boundary, size_t resident)
+{
+    size_t fast_pages = 0, recent_pages = 0;
+    for(size_t i = 0; i < subset_count; i++)
+    {
+        struct rank_page* input_page = vm->subset + i;
+        struct page_info* page = page_table_get(&(vm->pages), input_page->id, NULL);
+        unsigned shift = get_shift(vm, input_page->id);
+        if(input_page->fast)
+        {
+            fast_pages += 1UL << shift;
+            recent_pages += page->intervals < 2 ? 1UL << shift : 0;
+            continue;
+        }
+        if(page->intervals >= 2)
+            continue;
+        // a page of a ghost region is frequent once it's back
+        if(!boundary && arc_on_hit(&(vm->arc), input_page->id >> ARC_REGION_SHIFT,
+            1UL << shift, vm->capacities[0]))
+        {
+            struct shard* shard = get_shard(vm, input_page->id);
+            pthread_mutex_lock(&(shard->lock));
+            page->intervals = 2;
+            pthread_mutex_unlock(&(shard->lock));
+            continue;
+        }
+        // seen in one interval only, e.g. by a sequential scan
+        input_page->temperature = 0;
+    }
+    if(boundary || !recent_pages)
+        return;
+    // pages in the fastest tier are sampled in the input, by the CLOCK hand or a full
+    // refresh, so the ratio of recent ones holds for the whole tier
+    float weight = arc_recent_weight(&(vm->arc), resident * recent_pages / fast_pages);
+    if(weight >= 1)
+        return;
+    for(size_t i = 0; i < subset_count; i++)
+    {
+        struct rank_page* input_page = vm->subset + i;
+        if(input_page->fast &&
+            page_table_get(&(vm->pages), input_page->id, NULL)->intervals < 2)
+            input_page->temperature *= weight;
+    }
+}
+
+int vm_scan(struct vm* vm)
+{
+    const struct vm_params* params = &(vm->params);
+    uint64_t current_time = get_time(vm);
+    // shards stamp pages with the count of scans
+    size_t scan_index = __atomic_fetch_add(&(vm->scan_count), 1, __ATOMIC_RELAXED);
+    int full_refresh = scan_index >= vm->next_refresh;
+    if(full_refresh)
+        vm->next_refresh = scan_index + FORCE_REFRESH_LOOP;
+    // take a snapshot of memslots, as the reader may refresh them at any time
+    struct kvm_ept_client* memslots = &(vm->scan_memslots);
+    pthread_mutex_lock(&(vm->memslot_lock));
+    int copied = !kvm_ept_client_copy_memslots(memslots, &(vm->memslots));
+    pthread_mutex_unlock(&(vm->memslot_lock));
+    if(!copied)
+    {
+        perror("kvm_ept_client_copy_memslots() failed");
+        return -1;
+    }
+    // ghosts may be any region of memslots, the last one ends highest as they are sorted
+    if(params->placement == PLACEMENT_ARC)
+    {
+        uint64_t gfn_limit = 0;
+        if(memslots->sorted_count)
+        {
+            const struct kvm_ept_sample_memslot_ex* last = memslots->sorted +
+                memslots->sorted_count - 1;
+            gfn_limit = last->gpa / PAGE_SIZE + last->page_count;
+        }
+        if(arc_reserve(&(vm->arc), (gfn_limit >> ARC_REGION_SHIFT) + 1))
+        {
+            fprintf(stderr, "arc_reserve() failed\n");
+            return -1;
+        }
+    }
+    // build input of the ranking engine, from all pages once in a while, or from the
+    // candidates only
+    struct rank_page* input;
+    size_t page_count;
+    if(full_refresh)
+        input = build_full_input(vm, memslots, current_time, &page_count);
+    else
+        input = build_candidate_input(vm, memslots, current_time, &page_count);
+    if(!input)
+    {
+        fprintf(stderr, "failed to build the input of ranking\n");
+        return -1;
+    }
+    // the histogram is taken from all pages, and then cools down as all pages do, since
+    // pages not sampled keep their order
+    if(full_refresh)
+    {
+        // built aside, so that readers only wait for the copy
+        size_t histogram[RANK_BIN_COUNT];
+        size_t total = rank_histogram(histogram, input, page_count);
+        double sum = 0;
+        for(size_t i = 0; i < page_count; i++)
+            sum += (double)input[i].temperature * (input[i].huge ? RANK_HUGE_PAGES : 1);
+        pthread_mutex_lock(&(vm->histogram_lock));
+        memcpy(vm->histogram, histogram, sizeof(histogram));
+        vm->histogram_total = total;
+        vm->histogram_sum = sum;
+        vm->histogram_time = current_time;
+        pthread_mutex_unlock(&(vm->histogram_lock));
+    }
+    // free pages of every tier in the VM's share, the slowest tier takes all the rest
+    size_t tier_count = params->tier_count;
+    ssize_t frees[MAX_TIERS];
+    get_resident(vm, frees);
+    for(size_t i = 0; i < tier_count; i++)
+    {
+        size_t capacity = i + 1 < tier_count ? vm->capacities[i] : SIZE_MAX / 2;
+        size_t upper_capacity = i ? vm->capacities[i - 1] : 0;
+        frees[i] = (ssize_t)(capacity - upper_capacity) - frees[i];
+    }
+    // pages only move between adjacent tiers, so every boundary of tiers is ranked as a
+    // fast and a slow tier, from the fastest boundary down, and a page goes one tier per
+    // scan at most
+    vm->plan_count = 0;
+    float decay = pow(0.5f, (current_time - vm->histogram_time) / params->half_life);
+    for(size_t boundary = 0; boundary + 1 < tier_count; boundary++)
+    {
+        // shares of tiers may change in every scan, so find the cutoff again
+        float cutoff = rank_histogram_cutoff(vm->histogram, vm->histogram_total,
+            vm->capacities[boundary]) * decay;
+        // pages of unknown tiers are taken as in the slowest tier
+        size_t subset_count = 0;
+        for(size_t i = 0; i < page_count; i++)
+        {
+            if(vm->input_tiers[i] == TIER_COOLING)
+                continue;
+            size_t tier = vm->input_tiers[i] < 0 ? tier_count - 1 : vm->input_tiers[i];
+            if(tier != boundary && tier != boundary + 1)
+                continue;
+            vm->subset[subset_count] = input[i];
+            vm->subset[subset_count++].fast = tier == boundary;
+        }
+        if(params->placement == PLACEMENT_ARC)
+            apply_arc(vm, subset_count, boundary, vm->capacities[0] > (size_t)frees[0] ?
+                vm->capacities[0] - frees[0] : 0);
+        if(rank_select(&(vm->rank), vm->subset, subset_count, cutoff,
+            params->temperature_tolerance_ratio, frees[boundary]))
+        {
+            fprintf(stderr, "rank_select() failed\n");
+            return -1;
+        }
+        if(build_plan(vm, memslots, boundary, frees + boundary,
+            frees + boundary + 1, cutoff))
+        {
+            fprintf(stderr, "build_plan() failed\n");
+            return -1;
+        }
+    }
+    // the input of a full refresh is as large as the guest, don't keep it
+    if(full_refresh)
+        release_input(vm);
+    // the new plan replaces the old one, so queued tasks of pages that have cooled down
+    // or warmed up since the latest scan are cancelled
+    pthread_mutex_lock(&(vm->task_lock));
+    struct vm_task* tasks = vm->tasks;
+    size_t task_capacity = vm->task_capacity;
+    vm->tasks = vm->plan;
+    vm->task_capacity = vm->plan_capacity;
+    vm->task_count = vm->plan_count;
+    vm->task_next = 0;
+    pthread_mutex_unlock(&(vm->task_lock));
+    vm->plan = tasks;
+    vm->plan_capacity = task_capacity;
+    return 0;
+}
+
+float vm_next_benefit(struct vm* vm)
+{
+    pthread_mutex_lock(&(vm->task_lock));
+    float benefit = vm->task_next < vm->task_count ? vm->tasks[vm->task_next].benefit : -1;
+    pthread_mutex_unlock(&(vm->task_lock));
+    return benefit;
+}
+
+size_t vm_take_tasks(struct vm* vm, struct migrate_batch* batch, size_t max_bytes)
+{
+    batch->pid = vm->params.pid;
+    batch->count = 0;
+    batch->bytes = 0;
+    pthread_mutex_lock(&(vm->task_lock));
+    while(vm->task_next < vm->task_count && batch->count < MIGRATE_BATCH)
+    {
+        struct vm_task* task = vm->tasks + vm->task_next;
+        size_t bytes = PAGE_SIZE << get_shift(vm, task->gfn);
+        if(batch->count && batch->bytes + bytes > max_bytes)
+            break;
+        vm->task_next++;
+        // the page has left memslots since the scan
+        if(!task->address)
+            continue;
+        batch->addresses[batch->count] = (void*)task->address;
+        batch->nodes[batch->count] = task->node;
+        batch->ids[batch->count] = task->gfn;
+        batch->bytes += bytes;
+        batch->count++;
+    }
+    pthread_mutex_unlock(&(vm->task_lock));
+    return batch->count;
+}
+
+size_t vm_on_migrated(struct vm* vm, const struct migrate_batch* batch)
+{
+    size_t moved_bytes = 0;
+    for(size_t i = 0; i < batch->count; i++)
+    {
+        uint64_t gfn = batch->ids[i];
+        struct page_info* page = page_table_get(&(vm->pages), gfn, NULL);
+        assert(page);
+        struct shard* shard = get_shard(vm, gfn);
+        pthread_mutex_lock(&(shard->lock));
+        // only pages that were elsewhere have moved
+        if(batch->status[i] == batch->nodes[i] &&
+            (!page->node_inited || page->node != batch->nodes[i]))
+        {
+            moved_bytes += PAGE_SIZE << get_shift(vm, gfn);
+            // a page from nowhere known is promoted unless it goes to the slowest tier
+            int old_tier = get_page_tier(vm, page);
+            int tier = vm->node_tiers[batch->nodes[i]];
+            if(old_tier < 0 ? tier + 1 < (int)vm->params.tier_count : tier < old_tier)
+                __atomic_add_fetch(&(shard->promoted), 1, __ATOMIC_RELAXED);
+            else
+                __atomic_add_fetch(&(shard->demoted), 1, __ATOMIC_RELAXED);
+            if(!old_tier && tier && vm->params.placement == PLACEMENT_ARC)
+                arc_on_demoted(&(vm->arc), gfn >> ARC_REGION_SHIFT, page->intervals >= 2);
+            if(vm->params.cooldown)
+                page->moved = get_cooldown_stamp(vm, __atomic_load_n(&(vm->scan_count),
+                    __ATOMIC_RELAXED));
+        }
+        else if(batch->status[i] < 0)
+            __atomic_add_fetch(&(shard->failed), 1, __ATOMIC_RELAXED);
+        set_page_node(vm, shard, gfn, page, 1, batch->status[i]);
+        pthread_mutex_unlock(&(shard->lock));
+    }
+    return moved_bytes;
+}
+
+size_t vm_update(struct vm* vm, size_t shard_index)
+{
+    struct shard* shard = vm->shards + shard_index;
+    uint32_t gfns[SHARD_BATCH];
+    struct page_info* pages[SHARD_BATCH];
+    int8_t nodes[SHARD_BATCH];
+    v8u32 xwrs[SHARD_BATCH / SHARD_BLOCK];
+    // take a batch of samples read at the same time, as a structure of arrays
+    struct shard_sample* sample;
+    uint64_t batch_time = 0;
+    size_t count = 0, taken = 0;
+    while(count < SHARD_BATCH && (sample = lfqueue_glance(&(shard->queue))) &&
+        (!count || sample->time == batch_time))
+    {
+        batch_time = sample->time;
+        taken++;
+        // drop samples of memslots not known yet, which are rare and soon reported
+        unsigned shift;
+        if(!(pages[count] = page_table_get(&(vm->pages), sample->gfn, &shift)))
+        {
+            lfqueue_take(&(shard->queue));
+            continue;
+        }
+        if(count % SHARD_BLOCK == 0)
+            xwrs[count / SHARD_BLOCK] = (v8u32){0};
+        // samples of a huge page all go to its head
+        gfns[count] = sample->gfn >> shift << shift;
+        nodes[count] = sample->node;
+        xwrs[count / SHARD_BLOCK][count % SHARD_BLOCK] = sample->xwr;
+        lfqueue_take(&(shard->queue));
+        count++;
+    }
+    if(!count)
+        return taken;
+    // the scale of additions only changes with time, not per sample
+    if(batch_time != shard->time)
+    {
+        shard->time = batch_time;
+        shard->epoch = temperature_epoch(&(vm->clock), batch_time);
+        get_additions(vm, batch_time, &(shard->additions));
+    }
+    for(size_t i = 0; i < count && i < SHARD_BLOCK; i++)
+        __builtin_prefetch(pages[i], 1);
+    size_t sampled[MAX_TIERS + 1] = {0};
+    // 0 is for pages never sampled
+    uint8_t stamp = __atomic_load_n(&(vm->scan_count), __ATOMIC_RELAXED) % 7 + 1;
+    // hold the lock for a batch of samples, the policy thread rarely takes it
+    pthread_mutex_lock(&(shard->lock));
+    for(size_t block = 0; block < count; block += SHARD_BLOCK)
+    {
+        // look up additions of a block at once, and prefetch pages of the next block,
+        // as pages are scattered, updating them is left scalar
+        v8u32 block_additions = __builtin_shuffle(shard->additions, xwrs[block / SHARD_BLOCK]);
+        for(size_t i = block + SHARD_BLOCK; i < count && i < block + 2 * SHARD_BLOCK; i++)
+            __builtin_prefetch(pages[i], 1);
+        for(size_t i = block; i < count && i < block + SHARD_BLOCK; i++)
+        {
+            struct page_info* page = pages[i];
+            // natural cooling, only when the page is from an older epoch
+            if(page->epoch != shard->epoch)
+            {
+                page->temperature = temperature_rebase(page->temperature, page->epoch,
+                    shard->epoch);
+                page->epoch = shard->epoch;
+            }
+            // count intervals the page is sampled in, a page cooled down to nothing starts
+            // over
+            if(!page->temperature)
+                page->intervals = 0;
+            if(page->stamp != stamp)
+            {
+                page->stamp = stamp;
+                page->intervals += page->intervals < 3;
+            }
+            page->temperature = temperature_add(page->temperature,
+                block_additions[i - block]);
+            // the kernel knows where the page is right now
+            if(nodes[i] >= 0)
+                set_page_node(vm, shard, gfns[i], page, 1, nodes[i]);
+            on_page_sampled(vm, shard, gfns[i], page);
+            int tier = get_page_tier(vm, page);
+            sampled[tier < 0 ? MAX_TIERS : tier]++;
+        }
+    }
+    pthread_mutex_unlock(&(shard->lock));
+    for(size_t i = 0; i <= MAX_TIERS; i++)
+    {
+        if(sampled[i])
+            __atomic_store_n(shard->sampled + i, shard->sampled[i] + sampled[i],
+                __ATOMIC_RELAXED);
+    }
+    return taken;
+}
+
+int vm_dispatch(struct vm* vm, const struct kvm_ept_sample_annotated* samples, size_t count)
+{
+    uint64_t current_time = get_time(vm);
+    __atomic_store_n(&(vm->read_count), vm->read_count + count, __ATOMIC_RELAXED);
+    int published = 0;
+    for(size_t i = 0; i < count; i++)
+    {
+        // memslots have changed, and the client has refreshed them once for the batch,
+        // publish them before samples of new memslots reach shards
+        if(!samples[i].xwr)
+        {
+            if(!published && publish_memslots(vm))
+            {
+                perror("publish_memslots() failed");
+                return -1;
+            }
+            published = 1;
+            continue;
+        }
+        struct shard* shard = get_shard(vm, samples[i].gfn);
+        struct shard_sample* sample = lfqueue_add(&(shard->queue));
+        if(!sample)
+        {
+            fprintf(stderr, "lfqueue_add() failed\n");
+            return -1;
+        }
+        sample->time = current_time;
+        sample->gfn = samples[i].gfn;
+        sample->node = samples[i].node;
+        sample->xwr = samples[i].xwr;
+        lfqueue_commit(&(shard->queue));
+    }
+    return 0;
+}
+
+int vm_read(struct vm* vm)
+{
+    struct kvm_ept_sample_annotated samples[READ_BATCH];
+    ssize_t len;
+    while((len = kvm_ept_client_read(&(vm->client), samples, sizeof(samples))) > 0)
+    {
+        if(vm_dispatch(vm, samples, len / sizeof(struct kvm_ept_sample_annotated)))
+            return -1;
+    }
+    if(len < 0)
+    {
+        perror("kvm_ept_client_read() failed");
+        return -1;
+    }
+    return 0;
+}
+
+// find the home node of a process, the node with most of the CPUs it may run on
+// return the node, or -1 if it's unknown
+static int get_home_node(pid_t pid)
+{
+    cpu_set_t cpus;
+    if(sched_getaffinity(pid, sizeof(cpus), &cpus))
+        return -1;
+    int home_node = -1, home_cpu_count = 0;
+    for(int node = 0; node < MAX_NODES; node++)
+    {
+        char path[64];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        FILE* file = fopen(path, "r");
+        if(!file)
+            continue;
+        // a list like "0-15,32-47"
+        int cpu_count = 0;
+        unsigned first, last;
+        while(fscanf(file, "%u", &first) == 1)
+        {
+            int separator = fgetc(file);
+            last = first;
+            if(separator == '-')
+            {
+                if(fscanf(file, "%u", &last) != 1)
+                    break;
+                separator = fgetc(file);
+            }
+            for(unsigned cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+                cpu_count += CPU_ISSET(cpu, &cpus) != 0;
+            if(separator != ',')
+                break;
+        }
+        fclose(file);
+        if(cpu_count > home_cpu_count)
+        {
+            home_node = node;
+            home_cpu_count = cpu_count;
+        }
+    }
+    return home_node;
+}
+
+// find the node of a tier nearest to the home node by NUMA distance
+static int get_nearest_node(const struct tier* tier, int home_node)
+{
+    int nearest_node = tier->nodes[0];
+    if(home_node < 0 || tier->node_count == 1)
+        return nearest_node;
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/distance", home_node);
+    FILE* file = fopen(path, "r");
+    if(!file)
+        return nearest_node;
+    // distances to all nodes, indexed by node IDs
+    int distances[MAX_NODES];
+    int count = 0;
+    while(count < MAX_NODES && fscanf(file, "%d", distances + count) == 1)
+        count++;
+    fclose(file);
+    int nearest_distance = INT_MAX;
+    for(size_t i = 0; i < tier->node_count; i++)
+    {
+        int node = tier->nodes[i];
+        if(node < count && distances[node] < nearest_distance)
+        {
+            nearest_node = node;
+            nearest_distance = distances[node];
+        }
+    }
+    return nearest_node;
+}
+
+int vm_init(struct vm* vm, const struct vm_params* params)
+{
+    vm->params = *params;
+    vm->shard_inited = 0;
+    vm->read_count = 0;
+    assert(params->tier_count >= 2 && params->tier_count <= MAX_TIERS);
+    memset(vm->node_tiers, params->tier_count - 1, sizeof(vm->node_tiers));
+    for(size_t i = 0; i < params->tier_count; i++)
+    {
+        for(size_t j = 0; j < params->tiers[i].node_count; j++)
+        {
+            if(params->tiers[i].nodes[j] >= 0 && params->tiers[i].nodes[j] < MAX_NODES)
+                vm->node_tiers[params->tiers[i].nodes[j]] = i;
+        }
+    }
+    // respect the socket affinity of the VM, so its pages stay on its socket in every tier
+    int home_node = params->hooks ? -1 : get_home_node(params->pid);
+    for(size_t i = 0; i < params->tier_count; i++)
+        vm->tier_nodes[i] = get_nearest_node(params->tiers + i, home_node);
+    temperature_clock_init(&(vm->clock), get_time(vm), params->half_life);
+    assert(params->shard_count >= 1 && params->shard_count <= MAX_SHARDS);
+    // samples are annotated with the host NUMA node, so nodes of sampled pages are
+    // always fresh without querying
+    if(params->hooks)
+    {
+        kvm_ept_client_init_copy(&(vm->client));
+        if(kvm_ept_client_set_memslots(&(vm->client), params->hooks->memslots,
+            params->hooks->memslot_count))
+        {
+            perror("kvm_ept_client_set_memslots() failed");
+            kvm_ept_client_close(&(vm->client));
+            return -1;
+        }
+    }
+    else if(kvm_ept_client_open(&(vm->client), params->pid, KVM_EPT_SAMPLE_FORMAT_ANNOTATED))
+    {
+        perror("kvm_ept_client_open() failed");
+        return -1;
+    }
+    pthread_mutex_init(&(vm->memslot_lock), NULL);
+    kvm_ept_client_init_copy(&(vm->memslots));
+    kvm_ept_client_init_copy(&(vm->scan_memslots));
+    pthread_mutex_init(&(vm->task_lock), NULL);
+    pthread_mutex_init(&(vm->histogram_lock), NULL);
+    page_table_init(&(vm->pages), sizeof(struct page_info));
+    vm->input = NULL;
+    vm->input_tiers = NULL;
+    vm->subset = NULL;
+    vm->input_capacity = 0;
+    rank_init(&(vm->rank));
+    vm->tasks = NULL;
+    vm->task_count = 0;
+    vm->task_next = 0;
+    vm->task_capacity = 0;
+    vm->plan = NULL;
+    vm->plan_count = 0;
+    vm->plan_capacity = 0;
+    vm->arc.ring = NULL;
+    if(!params->hooks && (kvm_ept_client_set_prot(&(vm->client), params->xwr) ||
+        kvm_ept_client_set_freq(&(vm->client), params->freq)))
+    {
+        perror("ioctl() failed");
+        vm_deinit(vm);
+        return -1;
+    }
+    // allocate page information for all memory slots the client has got
+    if(publish_memslots(vm))
+    {
+        perror("publish_memslots() failed");
+        vm_deinit(vm);
+        return -1;
+    }
+    // ghosts of as many regions as the fastest tier may hold
+    if(params->placement == PLACEMENT_ARC && arc_init(&(vm->arc),
+        (size_t)(vm->guest_pages * params->max_fast_ratio) >> ARC_REGION_SHIFT))
+    {
+        fprintf(stderr, "arc_init() failed\n");
+        vm_deinit(vm);
+        return -1;
+    }
+    // temperatures are known already, so there is no need to warm up
+    int restored = 0;
+    vm->scan_count = 0;
+    if(params->checkpoint_dir && (restored = checkpoint_load(vm)) < 0)
+        perror("checkpoint_load() failed");
+    for(size_t i = 0; i < params->shard_count; i++)
+    {
+        struct shard* shard = vm->shards + i;
+        if(lfqueue_init(&(shard->queue), sizeof(struct shard_sample), PAGE_SIZE,
+            alloc_page, free_page, NULL))
+        {
+            fprintf(stderr, "lfqueue_init() failed\n");
+            vm_deinit(vm);
+            return -1;
+        }
+        pthread_mutex_init(&(shard->lock), NULL);
+        memset(&(shard->hot), 0, sizeof(struct gfn_list));
+        memset(&(shard->upper), 0, sizeof(struct gfn_list));
+        shard->hand = 0;
+        memset(shard->resident, 0, sizeof(shard->resident));
+        shard->promoted = 0;
+        shard->demoted = 0;
+        shard->failed = 0;
+        memset(shard->sampled, 0, sizeof(shard->sampled));
+        shard->time = 0;
+        shard->epoch = 0;
+        get_additions(vm, 0, &(shard->additions));
+        vm->shard_inited++;
+    }
+    memset(vm->capacities, 0, sizeof(vm->capacities));
+    memset(vm->histogram, 0, sizeof(vm->histogram));
+    vm->histogram_total = 0;
+    vm->histogram_sum = 0;
+    vm->histogram_time = 0;
+    // nodes are unknown, so the first scan is a full refresh
+    vm->next_refresh = vm->scan_count;
+    vm->start_time = get_time(vm) + (restored > 0 ? 0 : params->migration_delay * 1000);
+    if(restored > 0)
+        printf("\nVM %d is resumed from its checkpoint\n", (int)params->pid);
+    return 0;
+}
+
+void vm_deinit(struct vm* vm)
+{
+    for(size_t i = 0; i < vm->shard_inited; i++)
+    {
+        struct shard* shard = vm->shards + i;
+        lfqueue_deinit(&(shard->queue), NULL);
+        pthread_mutex_destroy(&(shard->lock));
+        free(shard->hot.gfns);
+        free(shard->upper.gfns);
+    }
+    vm->shard_inited = 0;
+    free(vm->tasks);
+    vm->tasks = NULL;
+    free(vm->plan);
+    vm->plan = NULL;
+    release_input(vm);
+    rank_deinit(&(vm->rank));
+    if(vm->arc.ring)
+        arc_deinit(&(vm->arc));
+    page_table_deinit(&(vm->pages));
+    pthread_mutex_destroy(&(vm->histogram_lock));
+    pthread_mutex_destroy(&(vm->task_lock));
+    pthread_mutex_destroy(&(vm->memslot_lock));
+    kvm_ept_client_close(&(vm->memslots));
+    kvm_ept_client_close(&(vm->scan_memslots));
+    kvm_ept_client_close(&(vm->client));
+}
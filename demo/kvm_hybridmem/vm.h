@@ -0,0 +1,261 @@
+#ifndef VM_H
+#define VM_H
+
+// The state of one VM under kvm_hybridmem, and the stages of the pipeline working on it,
+// which are driven by threads of the host (see host.h):
+//  vm_read(): drains samples from kvm-ept-sample, and dispatches them to shards by GFN
+//  vm_update(): a shard owns a range of GFNs, fed by a lock-free queue, and updates
+//      temperatures and migration candidates of its pages
+//  vm_scan(): ranks the candidates and plans migration tasks between adjacent tiers of
+//      memory, within the VM's share of every tier
+//  vm_take_tasks() / vm_on_migrated(): hand planned tasks to the migrator (see migrate.h)
+//      and take in their results
+// So neither a scan nor a migration batch stalls reading samples.
+// With hooks (see struct vm_hooks), a simulator stands in for the guest and the host, and
+// drives the same stages with vm_dispatch() instead of vm_read().
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "arc.h"
+#include "rank.h"
+#include "lfqueue.h"
+#include "page_table.h"
+#include "temperature.h"
+#include "migrate.h"
+#include "kvm_ept_client.h"
+
+#define PAGE_SIZE           4096
+#define HUGE_PAGE_SIZE      (PAGE_SIZE << PAGE_TABLE_HUGE_SHIFT)
+
+#define MAX_TIERS           4
+#define MAX_TIER_NODES      8
+#define MAX_NODES           128         // NUMA nodes, as nodes of pages are int8_t
+#define MAX_SHARDS          64
+#define SHARD_SHIFT         PAGE_TABLE_HUGE_SHIFT   // GFNs go to shards by 2MB chunks
+#define SHARD_BATCH         256         // max samples handled by a shard per lock
+#define SHARD_BLOCK         8           // samples handled as a vector
+
+#define PLACEMENT_DECAY     0           // pages are placed by temperature only
+#define PLACEMENT_ARC       1           // only pages sampled in 2 intervals are promoted, see arc.h
+
+#define COOLDOWN_STAMPS     7           // stamps of cooldown epochs, see is_cooling_down()
+#define TIER_COOLING        INT8_MIN    // the tier of a page cooling down in 'input_tiers'
+
+typedef uint32_t v8u32 __attribute__((vector_size(SHARD_BLOCK * sizeof(uint32_t))));
+
+// information of a unit, a 4KB page, or a 2MB huge page in memslots backed by huge pages
+struct page_info
+{
+    uint32_t temperature;       // the fixed-point temperature, relative to 'epoch'
+    uint16_t epoch : TEMPERATURE_EPOCH_BITS;    // the epoch of 'temperature', see temperature.h
+    uint16_t moved : 3;         // the cooldown epoch it moved latest in, modulo
+                                // COOLDOWN_STAMPS, plus 1, or 0 if it's not cooling down
+    int8_t node;                // the NUMA node of this page, or a negative errno
+    uint8_t node_inited : 1;    // is 'node' initiated
+    uint8_t hot_listed : 1;     // is this page in 'hot' of its shard
+    uint8_t upper_listed : 1;   // is this page in 'upper' of its shard
+    uint8_t stamp : 3;          // the scan interval it's sampled latest, modulo 7, plus 1
+    uint8_t intervals : 2;      // count of scan intervals it's sampled in, 3 at most
+};
+
+// a page table of millions of units must stay compact
+_Static_assert(sizeof(struct page_info) == 8, "struct page_info must fit in 8 bytes");
+
+// a growable array of GFNs
+struct gfn_list
+{
+    uint32_t* gfns;
+    size_t count;
+    size_t capacity;
+};
+
+// a sample on its way from the reader to a shard
+struct shard_sample
+{
+    uint64_t time;              // when the sample is read, in ms
+    uint32_t gfn;
+    int16_t node;               // the host NUMA node, or -1
+    uint8_t xwr;
+};
+
+// Candidates of migration in a shard, kept up to date incrementally, so that a scan only
+// costs O(candidates) instead of O(guest size):
+//  hot: pages sampled since the latest scan while not in the fastest tier (hot-in-lower)
+//  upper: pages known to be in any tier but the slowest, swept by a CLOCK hand to find
+//      the cold ones (cold-in-upper); pages that have left them are dropped lazily
+struct shard
+{
+    struct lfqueue queue;       // samples from the reader
+    // owned by the consumer of 'queue'
+    uint64_t time;              // when the latest batch is read
+    uint16_t epoch;             // the epoch of 'time'
+    v8u32 additions;            // fixed-point additions at 'time', indexed by xwr
+    // count of samples by the tier of their pages, the last one for unknown tiers, read by
+    // the metrics without lock
+    size_t sampled[MAX_TIERS + 1];
+    // protects everything below, and page_info of pages in this shard
+    pthread_mutex_t lock __attribute__((aligned(CACHELINE_SIZE)));
+    struct gfn_list hot;        // hot-in-lower candidates
+    struct gfn_list upper;      // pages in upper tiers
+    size_t hand;                // the CLOCK hand in 'upper'
+    size_t resident[MAX_TIERS]; // count of pages known to be in every tier
+    // counters of migration, read by the metrics without lock
+    size_t promoted;            // count of units moved to faster tiers
+    size_t demoted;             // count of units moved to slower tiers
+    size_t failed;              // count of units failed to move
+};
+
+// a planned migration of a unit
+struct vm_task
+{
+    uint64_t address;           // the HVA of the head of the unit, or 0 if it's unmapped
+    float benefit;              // the temperature gained by upper tiers for the task
+    uint32_t gfn;               // the head GFN of the unit
+    int node;                   // the target node
+};
+
+// a tier of memory, tiers are ordered from the fastest to the slowest
+struct tier
+{
+    int nodes[MAX_TIER_NODES];  // NUMA nodes of the tier, e.g. one per socket
+    size_t node_count;
+    size_t capacity;            // pages of the tier shared by all VMs, but the slowest tier
+                                // takes all the rest
+    unsigned long latency;      // ns per access, for the cost model
+};
+
+// stand-ins for kvm-ept-sample and the host of a VM
+struct vm_hooks
+{
+    // the current time in ms
+    uint64_t (*get_time)(void* privdata);
+    // move_pages(2) on the VM's process, which only queries nodes if 'nodes' is NULL
+    // return 0 if succeed, or -1 with errno set
+    long (*move_pages)(void* privdata, size_t count, void** addresses, const int* nodes,
+        int* status);
+    const struct kvm_ept_sample_memslot_ex* memslots;  // memslots of the guest
+    size_t memslot_count;
+    int huge;                   // are memslots backed by 2MB huge pages
+    void* privdata;
+};
+
+struct vm_params
+{
+    pid_t pid;                  // pid of target QEMU-KVM instance
+    int xwr;                    // access type to sample
+    unsigned long freq;         // sample frequency
+    float half_life;            // half-life of natural cooling, in ms
+    float xaddition;            // temperature addition when 'exec'
+    float waddition;            // temperature addition when 'write'
+    float raddition;            // temperature addition when 'read'
+    unsigned long migration_delay;          // seconds before migration starts
+    unsigned long migration_interval;       // seconds between loops of migration
+    unsigned long max_migration_bandwidth;  // max bandwitth to migrate, in MB/s
+    struct tier tiers[MAX_TIERS];   // tiers of memory, 2 at least
+    size_t tier_count;
+    float min_fast_ratio;       // the ratio of the fastest tier guaranteed to the VM
+    float max_fast_ratio;       // the max ratio of the fastest tier the VM may get
+    float temperature_tolerance_ratio;      // the temperature anti-shaking tolerance ratio
+    size_t shard_count;         // count of shards, 1 ~ MAX_SHARDS
+    int placement;              // PLACEMENT_*
+    // the cost model: a migration only goes if the time it saves within the horizon is
+    // more than the time it takes, see build_plan()
+    float payoff_horizon;       // seconds a migration should pay off in, or 0 for no model
+    float accesses_per_sample;  // accesses of the guest a sample stands for
+    unsigned long cooldown;     // scans a migrated page stays where it is at least, or 0
+    unsigned long copy_ns;      // ns to copy 4KB between nodes
+    unsigned long shootdown_ns; // ns of the TLB shootdown of a migration
+    const char* checkpoint_dir; // where checkpoints go, or NULL, see checkpoint.h
+    const struct vm_hooks* hooks;   // stand-ins for kvm-ept-sample and the host, or NULL
+};
+
+struct vm
+{
+    struct vm_params params;
+    struct kvm_ept_client client;   // the client of kvm-ept-sample, owned by the reader
+    size_t read_count;          // count of samples read, owned by the reader
+    struct temperature_clock clock;
+    struct page_table pages;    // page information of GFNs in memslots
+    // a copy of memslots of 'client', published by the reader when they change, and chunks
+    // of 'pages' are populated before new memslots are published here
+    pthread_mutex_t memslot_lock;
+    struct kvm_ept_client memslots;
+    size_t guest_pages;         // count of pages in memslots of the normal address space
+    // the plan of migration, replaced by the policy in every scan, and executed by the
+    // migration thread in order
+    pthread_mutex_t task_lock;
+    struct vm_task* tasks;
+    size_t task_count;
+    size_t task_next;           // the next task to execute
+    size_t task_capacity;
+    // owned by the policy thread
+    struct rank_page* input;    // the input buffer of the ranking engine
+    int8_t* input_tiers;        // tiers of pages in 'input', or TIER_COOLING
+    struct rank_page* subset;   // pages of 'input' at a boundary of tiers
+    size_t input_capacity;
+    struct rank rank;           // the ranking engine
+    struct arc arc;             // the ghost history, only with PLACEMENT_ARC
+    int8_t node_tiers[MAX_NODES];   // the tier of every node, nodes in no tier are taken
+                                    // as in the slowest one
+    int tier_nodes[MAX_TIERS];  // the node nearest to the VM in every tier
+    struct kvm_ept_client scan_memslots;    // the snapshot of 'memslots' taken by a scan
+    // the share of the fastest N + 1 tiers in pages, set by the host
+    size_t capacities[MAX_TIERS];
+    size_t scan_count;          // count of scans, kept by checkpoints
+    size_t next_refresh;        // the count of scans of the next full refresh
+    // the histogram of all pages in the latest full refresh, see rank.h, written by the
+    // policy thread under 'histogram_lock', which others (e.g. the metrics) read it under
+    pthread_mutex_t histogram_lock;
+    size_t histogram[RANK_BIN_COUNT];
+    size_t histogram_total;     // count of pages in 'histogram'
+    double histogram_sum;       // the sum of temperatures of pages in 'histogram'
+    uint64_t histogram_time;    // when 'histogram' is taken
+    struct vm_task* plan;       // the plan being built, swapped with 'tasks' when done
+    size_t plan_count;
+    size_t plan_capacity;
+    uint64_t start_time;        // when migration may start, in ms
+    size_t shard_inited;        // count of shards inited
+    struct shard shards[MAX_SHARDS];
+};
+
+// current time in ms
+uint64_t get_current_ms();
+
+// open kvm-ept-sample and start sampling, and resume from the checkpoint if there is one
+// return 0 if succeed, or -1 with a message printed
+int vm_init(struct vm* vm, const struct vm_params* params);
+
+// stop sampling and release the VM, no stage of it may be running
+void vm_deinit(struct vm* vm);
+
+// (the reader) drain samples that have been read, and dispatch them to shards
+// return 0 if succeed, or -1 with a message printed
+int vm_read(struct vm* vm);
+
+// (the reader) dispatch samples to shards, and publish memslots if they have changed
+// return 0 if succeed, or -1 with a message printed
+int vm_dispatch(struct vm* vm, const struct kvm_ept_sample_annotated* samples, size_t count);
+
+// (the consumer of a shard) update pages with a batch of samples of a shard
+// return count of samples taken from the shard
+size_t vm_update(struct vm* vm, size_t shard_index);
+
+// (the policy) rank pages of the VM within 'capacities', and plan migration tasks
+// return 0 if succeed, or -1 with a message printed
+int vm_scan(struct vm* vm);
+
+// (the migration) the benefit of the next task, or a negative value if there is no task
+float vm_next_benefit(struct vm* vm);
+
+// (the migration) take the next tasks into a batch, up to 'max_bytes' but one task at
+// least, so a huge page is never starved by a small budget
+// return count of tasks taken
+size_t vm_take_tasks(struct vm* vm, struct migrate_batch* batch, size_t max_bytes);
+
+// (a migration worker) update nodes of pages in a batch that is done
+// return bytes moved
+size_t vm_on_migrated(struct vm* vm, const struct migrate_batch* batch);
+
+#endif
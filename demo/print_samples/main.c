@@ -1,20 +1,74 @@
+#include <math.h>
+#include <time.h>
 #include <fcntl.h>
 #include <stdio.h>
-#include <assert.h>
 #include <stdint.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
 
-#include "kvm_ept_sample.h"
+#include "kvm_ept_client.h"
+#include "kvm_ept_trace.h"
 
-int main(int argc, char* argv[])
+static void print_memslots(struct kvm_ept_sample_memslot_ex* memslots, size_t count)
 {
-    pid_t pid;
-    if(argc != 2 || sscanf(argv[1], "%d", &pid) != 1)
+    for(size_t i = 0; i < count; i++)
+        printf("memslot[%lu]: as: %u, id: %u, gpa: %lx, hva: %lx, count: %lu\n",
+            i, memslots[i].as_id, memslots[i].id,
+            memslots[i].gpa, memslots[i].hva, memslots[i].page_count);
+}
+
+static void print_samples(struct kvm_ept_sample_sample* samples, size_t count)
+{
+    for(size_t i = 0; i < count; i++)
     {
-        printf("USAGE: %s <pid>\n", argv[0]);
+        uint32_t gfn = samples[i].gfn;
+        uint32_t xwr = samples[i].xwr;
+        if(!xwr)
+        {
+            printf("memslots changed, generation: %x\n", gfn);
+            continue;
+        }
+        printf("%6x, %c%c%c\n",
+            gfn,
+            xwr & 1 ? 'r' : '-',
+            xwr & 2 ? 'w' : '-',
+            xwr & 4 ? 'x' : '-');
+    }
+}
+
+// replay a trace recorded by record_samples
+static int replay(const char* path)
+{
+    static struct kvm_ept_trace_reader reader;
+    if(kvm_ept_trace_reader_open(&reader, path))
+    {
+        perror("kvm_ept_trace_reader_open() failed");
         return 1;
     }
+    // the reader keeps all memslots of the header, however many there are
+    print_memslots(reader.memslots, reader.header.memslot_count);
+    while(1)
+    {
+        struct kvm_ept_sample_sample samples[128];
+        ssize_t len = kvm_ept_trace_read(&reader, samples, sizeof(samples));
+        if(len < 0)
+        {
+            perror("kvm_ept_trace_read() failed");
+            return 1;
+        }
+        else if(len == 0)
+            break;  // end of trace
+        printf("@%lu us\n", kvm_ept_trace_time_us(&reader) - reader.header.start_time_us);
+        print_samples(samples, len / sizeof(struct kvm_ept_sample_sample));
+    }
+    kvm_ept_trace_reader_close(&reader);
+    return 0;
+}
+
+// print the working-set-size of every interval
+static int print_wss(pid_t pid, unsigned long interval)
+{
     int fd = open(KVM_EPT_SAMPLE_PATH, O_RDWR);
     if(fd < 0)
     {
@@ -27,43 +81,255 @@ int main(int argc, char* argv[])
         perror("ioctl() failed");
         return 1;
     }
-    // set prot, xwr = 6 means sampleing 'exec' and 'write'
-    if(ioctl(fd, KVM_EPT_SAMPLE_CMD_SET_PROT, 6) < 0)
+    // start WSS mode, no sample will be reported
+    if(ioctl(fd, KVM_EPT_SAMPLE_CMD_SET_WSS, interval) < 0)
     {
         perror("ioctl() failed");
         return 1;
     }
-    // sample at 10000 Hz
-    if(ioctl(fd, KVM_EPT_SAMPLE_CMD_SET_FREQ, 10000) < 0)
+    printf("%16s %8s %10s %10s %10s %10s\n",
+        "time (ms)", "interval", "present", "read (MB)", "write (MB)", "exec (MB)");
+    while(1)
+    {
+        struct kvm_ept_sample_wss records[16];
+        struct kvm_ept_sample_get_wss get_wss =
+        {
+            .records = records,
+            .capacity = 16,
+            .count = 0,
+        };
+        if(ioctl(fd, KVM_EPT_SAMPLE_CMD_GET_WSS, &get_wss) < 0)
+        {
+            perror("ioctl() failed");
+            return 1;
+        }
+        // a region is 2MB
+        for(size_t i = 0; i < get_wss.count; i++)
+            printf("%16lu %8u %10u %10u %10u %10u\n",
+                records[i].time, records[i].interval, records[i].present,
+                records[i].read * 2, records[i].write * 2, records[i].exec * 2);
+        fflush(stdout);
+        usleep(interval * 1000);
+    }
+    return 0;
+}
+
+#define TOP_REGION_SHIFT    9       // 2MB regions
+#define TOP_REGION_COUNT    (1 << (29 - TOP_REGION_SHIFT))
+#define TOP_HALF_LIFE       5       // seconds
+#define TOP_REGIONS         16      // regions shown
+#define TOP_MEMSLOTS        8       // memslots shown
+
+// decayed counts of samples of a region, in total and by access type
+struct top_region
+{
+    float total;
+    float xwr[3];
+};
+
+// all regions a gfn may be in, too large for the stack
+static struct top_region top_regions[TOP_REGION_COUNT];
+
+static double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// redraw the screen with the hottest regions and memslots
+//  end: 1 + the highest region ever sampled
+//  latency: latencies of the module, or NULL if it's built without them
+static void draw_top(struct kvm_ept_client* client, size_t end,
+    double sample_rate, double drop_rate, int has_stats,
+    const struct kvm_ept_sample_latency* latency)
+{
+    // the hottest regions, hottest first, by insertion as few regions beat the coldest one
+    size_t hottest[TOP_REGIONS];
+    size_t hottest_count = 0;
+    float total = 0;
+    for(size_t i = 0; i < end; i++)
+    {
+        float heat = top_regions[i].total;
+        total += heat;
+        if(heat < 0.5f ||
+            (hottest_count == TOP_REGIONS && heat <= top_regions[hottest[TOP_REGIONS - 1]].total))
+            continue;
+        size_t j = hottest_count < TOP_REGIONS ? hottest_count++ : TOP_REGIONS - 1;
+        for(; j && top_regions[hottest[j - 1]].total < heat; j--)
+            hottest[j] = hottest[j - 1];
+        hottest[j] = i;
+    }
+    printf("\033[H\033[2J");
+    printf("samples: %.0f/s, dropped: ", sample_rate);
+    if(has_stats)
+        printf("%.0f/s", drop_rate);
+    else
+        printf("-");
+    printf(", heat (samples decayed by half every %d s): %.0f\n", TOP_HALF_LIFE, total);
+    if(latency)
+    {
+        const struct kvm_ept_sample_latency_histogram* sample =
+            latency->histograms + KVM_EPT_SAMPLE_LATENCY_SAMPLE;
+        const struct kvm_ept_sample_latency_histogram* sweep =
+            latency->histograms + KVM_EPT_SAMPLE_LATENCY_SWEEP;
+        printf("latency (ns) of a sample p50/p99/max: %lu/%lu/%lu, "
+            "of a sweep p50/p99/max: %lu/%lu/%lu\n", sample->p50, sample->p99, sample->max,
+            sweep->p50, sweep->p99, sweep->max);
+    }
+    printf("\n");
+    printf("%-36s %8s %6s %8s %8s %8s\n", "memslot", "heat", "%", "exec", "write", "read");
+    // memslots of the normal address space, by GPA
+    for(size_t i = 0; i < client->sorted_count && i < TOP_MEMSLOTS; i++)
+    {
+        const struct kvm_ept_sample_memslot_ex* memslot = client->sorted + i;
+        size_t first = memslot->gpa >> 12 >> TOP_REGION_SHIFT;
+        size_t last = ((memslot->gpa >> 12) + memslot->page_count - 1) >> TOP_REGION_SHIFT;
+        struct top_region sum = {0};
+        for(size_t j = first; j <= last && j < end; j++)
+        {
+            sum.total += top_regions[j].total;
+            for(size_t k = 0; k < 3; k++)
+                sum.xwr[k] += top_regions[j].xwr[k];
+        }
+        char name[64];
+        snprintf(name, sizeof(name), "%u: %lx-%lx", memslot->id, memslot->gpa,
+            memslot->gpa + (memslot->page_count << 12));
+        printf("%-36s %8.0f %6.1f %8.0f %8.0f %8.0f\n", name, sum.total,
+            total ? sum.total * 100 / total : 0, sum.xwr[2], sum.xwr[1], sum.xwr[0]);
+    }
+    printf("\n%-36s %8s %6s %8s %8s %8s\n", "region", "heat", "%", "exec", "write", "read");
+    for(size_t i = 0; i < hottest_count; i++)
+    {
+        struct top_region* region = top_regions + hottest[i];
+        char name[64];
+        uint64_t gpa = (uint64_t)hottest[i] << TOP_REGION_SHIFT << 12;
+        snprintf(name, sizeof(name), "%lx-%lx", gpa, gpa + (1ul << TOP_REGION_SHIFT << 12));
+        printf("%-36s %8.0f %6.1f %8.0f %8.0f %8.0f\n", name, region->total,
+            region->total * 100 / total, region->xwr[2], region->xwr[1], region->xwr[0]);
+    }
+    fflush(stdout);
+}
+
+// aggregate samples by 2MB regions and show the hottest ones every second
+// A sample costs a few additions only, so it keeps up with sampling at full rate.
+static int print_top(pid_t pid, unsigned long freq)
+{
+    struct kvm_ept_client client;
+    if(kvm_ept_client_open(&client, pid, KVM_EPT_SAMPLE_FORMAT_COMPACT))
+    {
+        perror("kvm_ept_client_open() failed");
+        return 1;
+    }
+    // sample all access types, for the breakdown
+    if(kvm_ept_client_set_prot(&client, 7) || kvm_ept_client_set_freq(&client, freq))
     {
         perror("ioctl() failed");
         return 1;
     }
-    struct kvm_ept_sample_memslot memslots[64];
-    struct kvm_ept_sample_get_memslots get_memslots = 
+    // the kernel may not support it
+    struct kvm_ept_sample_stats stats;
+    int has_stats = !ioctl(client.fd, KVM_EPT_SAMPLE_CMD_GET_STATS, &stats);
+    uint64_t last_dropped = has_stats ? stats.dropped : 0;
+    size_t end = 0, sample_count = 0;
+    double last_time = now_seconds();
+    float decay = pow(0.5, 1.0 / TOP_HALF_LIFE);
+    while(1)
     {
-        .memslots = memslots,
-        .capacity = 64,
-        .count = 0,
-    };
-    // get all memory slots
-    if(ioctl(fd, KVM_EPT_SAMPLE_CMD_GET_MEMSLOTS, &get_memslots) < 0)
+        struct kvm_ept_sample_sample samples[1024];
+        // memslots are refreshed by the client when they change
+        ssize_t len = kvm_ept_client_read(&client, samples, sizeof(samples));
+        if(len < 0)
+        {
+            perror("kvm_ept_client_read() failed");
+            return 1;
+        }
+        size_t count = len / sizeof(struct kvm_ept_sample_sample);
+        for(size_t i = 0; i < count; i++)
+        {
+            if(!samples[i].xwr)
+                continue;
+            size_t index = samples[i].gfn >> TOP_REGION_SHIFT;
+            struct top_region* region = top_regions + index;
+            region->total++;
+            for(size_t j = 0; j < 3; j++)
+                region->xwr[j] += (samples[i].xwr >> j) & 1;
+            end = index >= end ? index + 1 : end;
+        }
+        sample_count += count;
+        double time = now_seconds();
+        if(time - last_time >= 1)
+        {
+            double drop_rate = 0;
+            if(has_stats && !ioctl(client.fd, KVM_EPT_SAMPLE_CMD_GET_STATS, &stats))
+            {
+                drop_rate = (stats.dropped - last_dropped) / (time - last_time);
+                last_dropped = stats.dropped;
+            }
+            // the module may be built without latencies
+            struct kvm_ept_sample_latency latency;
+            int has_latency = !ioctl(client.fd, KVM_EPT_SAMPLE_CMD_GET_LATENCY, &latency);
+            draw_top(&client, end, sample_count / (time - last_time), drop_rate, has_stats,
+                has_latency ? &latency : NULL);
+            // decay once a second rather than per sample
+            for(size_t i = 0; i < end; i++)
+            {
+                top_regions[i].total *= decay;
+                for(size_t j = 0; j < 3; j++)
+                    top_regions[i].xwr[j] *= decay;
+            }
+            sample_count = 0;
+            last_time = time;
+        }
+        if(!count)
+            usleep(10000);  // try again later
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    pid_t pid;
+    unsigned long interval, freq;
+    if(argc == 3 && strcmp(argv[1], "-r") == 0)
+        return replay(argv[2]);
+    if(argc == 4 && strcmp(argv[1], "-w") == 0 && sscanf(argv[2], "%lu", &interval) == 1 &&
+        interval && sscanf(argv[3], "%d", &pid) == 1)
+        return print_wss(pid, interval);
+    if(argc == 4 && strcmp(argv[1], "-t") == 0 && sscanf(argv[2], "%lu", &freq) == 1 &&
+        freq && sscanf(argv[3], "%d", &pid) == 1)
+        return print_top(pid, freq);
+    if(argc != 2 || sscanf(argv[1], "%d", &pid) != 1)
+    {
+        printf("USAGE: %s <pid>\n"
+            "       %s -r <trace-file>\n"
+            "       %s -w <interval (ms)> <pid>\n"
+            "       %s -t <freq (Hz)> <pid>\n", argv[0], argv[0], argv[0], argv[0]);
+        return 1;
+    }
+    // the client gets all memory slots
+    struct kvm_ept_client client;
+    if(kvm_ept_client_open(&client, pid, KVM_EPT_SAMPLE_FORMAT_COMPACT))
+    {
+        perror("kvm_ept_client_open() failed");
+        return 1;
+    }
+    // set prot, xwr = 6 means sampleing 'exec' and 'write', and sample at 10000 Hz
+    if(kvm_ept_client_set_prot(&client, 6) || kvm_ept_client_set_freq(&client, 10000))
     {
         perror("ioctl() failed");
         return 1;
     }
     // print memory slots
-    for(size_t i = 0; i < get_memslots.count; i++)
-        printf("memslot[%lu]: gpa: %lx, hva: %lx, count: %lu\n",
-            i, memslots[i].gpa, memslots[i].hva, memslots[i].page_count);
+    print_memslots(client.memslots, client.memslot_count);
     // read and print samples
     while(1)
     {
-        struct kvm_ept_sample_sample samples[128];
-        ssize_t len = read(fd, samples, sizeof(samples));
+        struct kvm_ept_sample_sample samples[1024];
+        ssize_t len = kvm_ept_client_read(&client, samples, sizeof(samples));
         if(len < 0)
         {
-            perror("read() failed");
+            perror("kvm_ept_client_read() failed");
             return 1;
         }
         else if(len == 0)
@@ -71,18 +337,8 @@ int main(int argc, char* argv[])
             usleep(10000);  // try again later
             continue;
         }
-        assert(len % sizeof(struct kvm_ept_sample_sample) == 0);
         size_t count = len / sizeof(struct kvm_ept_sample_sample);  // count of samples
-        for(size_t i = 0; i < count; i++)
-        {
-            uint32_t gfn = samples[i].gfn;
-            uint32_t xwr = samples[i].xwr;
-            printf("%6x, %c%c%c\n",
-                gfn,
-                xwr & 1 ? 'r' : '-',
-                xwr & 2 ? 'w' : '-',
-                xwr & 4 ? 'x' : '-');
-        }
+        print_samples(samples, count);
     }
     return 0;
 }
@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include <signal.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "kvm_ept_client.h"
+#include "kvm_ept_trace.h"
+
+#define BATCH_SIZE      4096
+
+static volatile sig_atomic_t stopped = 0;
+
+static void on_signal(int signal)
+{
+    stopped = 1;
+}
+
+static uint64_t get_current_us()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + (uint64_t)tv.tv_usec;
+}
+
+int main(int argc, char* argv[])
+{
+    pid_t pid;
+    int xwr;
+    unsigned long freq, duration;
+    if(argc != 6 ||
+        // pid of target QEMU-KVM instance
+        sscanf(argv[1], "%d", &pid) != 1 ||
+        // access type to sample
+        sscanf(argv[2], "%d", &xwr) != 1 ||
+        // sample frequency
+        sscanf(argv[3], "%lu", &freq) != 1 ||
+        // seconds to record, 0 means until SIGINT or SIGTERM
+        sscanf(argv[4], "%lu", &duration) != 1)
+    {
+        fprintf(stderr, "USAGE: %s <pid> <xwr> <freq (Hz)> <duration (s)> <output-file>\n",
+            argv[0]);
+        return 1;
+    }
+    const char* path = argv[5];
+    // all memory slots are got before sampling, they are the header of the trace
+    struct kvm_ept_client client;
+    if(kvm_ept_client_open(&client, pid, KVM_EPT_SAMPLE_FORMAT_COMPACT))
+    {
+        perror("kvm_ept_client_open() failed");
+        return 1;
+    }
+    static struct kvm_ept_trace_writer writer;
+    uint64_t start_time = get_current_us();
+    if(kvm_ept_trace_writer_open(&writer, path, client.memslots, client.memslot_count,
+        start_time))
+    {
+        perror("kvm_ept_trace_writer_open() failed");
+        return 1;
+    }
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    if(kvm_ept_client_set_prot(&client, xwr) || kvm_ept_client_set_freq(&client, freq))
+    {
+        perror("ioctl() failed");
+        return 1;
+    }
+    uint64_t end_time = duration ? start_time + duration * 1000000 : UINT64_MAX;
+    uint64_t sample_count = 0, current_time;
+    while(!stopped && (current_time = get_current_us()) < end_time)
+    {
+        // read in large batches, so that 100 kHz+ costs few syscalls
+        static struct kvm_ept_sample_sample samples[BATCH_SIZE];
+        ssize_t len = kvm_ept_client_read(&client, samples, sizeof(samples));
+        if(len < 0)
+        {
+            perror("kvm_ept_client_read() failed");
+            return 1;
+        }
+        else if(len == 0)
+        {
+            usleep(10000);  // try again later
+            continue;
+        }
+        size_t count = len / sizeof(struct kvm_ept_sample_sample);  // count of samples
+        if(kvm_ept_trace_write(&writer, samples, count, current_time))
+        {
+            perror("kvm_ept_trace_write() failed");
+            return 1;
+        }
+        sample_count += count;
+    }
+    // stop sampling before closing the trace
+    if(kvm_ept_client_set_freq(&client, 0))
+    {
+        perror("ioctl() failed");
+        return 1;
+    }
+    if(kvm_ept_trace_writer_close(&writer))
+    {
+        perror("kvm_ept_trace_writer_close() failed");
+        return 1;
+    }
+    kvm_ept_client_close(&client);
+    printf("%lu samples recorded\n", sample_count);
+    return 0;
+}
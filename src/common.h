@@ -94,6 +94,10 @@
 #define unlikely(x)     __builtin_expect(!!(x), 0)
 #endif
 
+#ifndef CACHELINE_SIZE
+#define CACHELINE_SIZE  64
+#endif
+
 #ifndef MIN2
 #define MIN2(a, b)          \
 ({                          \
@@ -0,0 +1,56 @@
+#ifndef COMPAT_H
+#define COMPAT_H
+
+// shims over kernel APIs that changed between the kernels this module is built on
+
+#include <linux/version.h>
+#include <linux/kvm_host.h>
+
+// the root of the EPT of a vCPU, for the legacy MMU
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 18, 0)
+#define COMPAT_VCPU_ROOT_HPA(vcpu)      ((vcpu)->arch.mmu->root.hpa)
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0)
+#define COMPAT_VCPU_ROOT_HPA(vcpu)      ((vcpu)->arch.mmu->root_hpa)
+#else
+#define COMPAT_VCPU_ROOT_HPA(vcpu)      ((vcpu)->arch.mmu.root_hpa)
+#endif
+
+// iterate memslots of an address space, 'bkt' is an int used by newer kernels only
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 17, 0)
+#define COMPAT_FOR_EACH_MEMSLOT(memslot, bkt, slots)    kvm_for_each_memslot(memslot, bkt, slots)
+#else
+#define COMPAT_FOR_EACH_MEMSLOT(memslot, bkt, slots)    kvm_for_each_memslot(memslot, slots)
+#endif
+
+// CPUs not isolated from the scheduler domains, i.e. those left by 'isolcpus='
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 18, 0)
+#include <linux/sched/isolation.h>
+#define COMPAT_HOUSEKEEPING_CPUMASK()   housekeeping_cpumask(HK_TYPE_DOMAIN)
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 15, 0)
+#include <linux/sched/isolation.h>
+#define COMPAT_HOUSEKEEPING_CPUMASK()   housekeeping_cpumask(HK_FLAG_DOMAIN)
+#else
+#define COMPAT_HOUSEKEEPING_CPUMASK()   cpu_possible_mask
+#endif
+
+// the generation of memslots of an address space, without the flag of an update in progress
+// set by newer kernels, so that the sum over address spaces only grows
+#ifdef KVM_MEMSLOT_GEN_UPDATE_IN_PROGRESS
+#define COMPAT_MEMSLOTS_GENERATION(slots)   \
+    ((slots)->generation & ~KVM_MEMSLOT_GEN_UPDATE_IN_PROGRESS)
+#else
+#define COMPAT_MEMSLOTS_GENERATION(slots)   ((slots)->generation)
+#endif
+
+// is dirty logging enabled on a memslot
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0)
+#define COMPAT_SLOT_DIRTY_TRACKED(memslot)  kvm_slot_dirty_track_enabled(memslot)
+#else
+#define COMPAT_SLOT_DIRTY_TRACKED(memslot)  ((memslot)->flags & KVM_MEM_LOG_DIRTY_PAGES)
+#endif
+
+#ifndef KVM_ADDRESS_SPACE_NUM
+#define KVM_ADDRESS_SPACE_NUM           KVM_MAX_NR_ADDRESS_SPACES
+#endif
+
+#endif
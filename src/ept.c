@@ -0,0 +1,153 @@
+#include "common.h"
+#include "compat.h"
+#include "ept.h"
+
+#define EPT_HUGE_ADDR_MASK      ((uint64_t)0xffffffe00000)
+
+#ifdef KVM_EPT_SAMPLE_TDP_MMU
+
+int ept_init(struct ept* ept, struct kvm* kvm)
+{
+    ept->kvm = kvm;
+    return 0;
+}
+
+struct region_update
+{
+    ept_update_func update;
+    void* data;
+};
+
+static u64 update_region(u64 spte, u64* sptep, int level, gfn_t gfn, void* data)
+{
+    struct region_update* region_update = data;
+    return region_update->update(spte, __pa(sptep) >> PAGE_SHIFT, gfn, region_update->data);
+}
+
+unsigned long ept_update(struct ept* ept, gfn_t start, gfn_t end, ept_update_func update,
+    void* data)
+{
+    struct region_update region_update = {update, data};
+    return kvm_tdp_mmu_ept_sample_update(ept->kvm, start, end, PG_LEVEL_2M, update_region,
+        &region_update);
+}
+
+struct pfn_lookup
+{
+    gfn_t gfn;
+    unsigned long pfn;
+};
+
+// find the leaf of the GFN on the way down, and keep all entries as they are
+static u64 lookup_pfn(u64 spte, u64* sptep, int level, gfn_t gfn, void* data)
+{
+    struct pfn_lookup* lookup = data;
+    if(level == PG_LEVEL_2M && (spte & EPT_LARGE))
+        lookup->pfn = ((spte & EPT_HUGE_ADDR_MASK) >> PAGE_SHIFT) +
+            (lookup->gfn & (EPT_REGION_PAGES - 1));
+    else if(level == PG_LEVEL_4K)
+        lookup->pfn = (spte & EPT_ADDR_MASK) >> PAGE_SHIFT;
+    return spte;
+}
+
+unsigned long ept_get_pfn(struct ept* ept, gfn_t gfn)
+{
+    struct pfn_lookup lookup = {gfn, 0};
+    kvm_tdp_mmu_ept_sample_update(ept->kvm, gfn, gfn + 1, PG_LEVEL_4K, lookup_pfn, &lookup);
+    return lookup.pfn;
+}
+
+#else
+
+#define EPT_PGD_INDEX(gfn)      (((gfn) >> 27) & 0x1ff)
+#define EPT_PUD_INDEX(gfn)      (((gfn) >> 18) & 0x1ff)
+#define EPT_PMD_INDEX(gfn)      (((gfn) >> 9) & 0x1ff)
+#define EPT_PTE_INDEX(gfn)      ((gfn) & 0x1ff)
+
+// the table an entry points to, or NULL if it's not present or a leaf
+static uint64_t* get_table(uint64_t entry)
+{
+    uint64_t table = entry & EPT_ADDR_MASK;
+    return table && !(entry & EPT_LARGE) ? (uint64_t*)__va(table) : NULL;
+}
+
+int ept_init(struct ept* ept, struct kvm* kvm)
+{
+    uint64_t root = 0;
+    int i, vcpu_count = atomic_read(&(kvm->online_vcpus));
+    for(i = 0; i < vcpu_count; i++)
+    {
+        struct kvm_vcpu* vcpu = kvm_get_vcpu(kvm, i);
+        uint64_t root_of_vcpu;
+        if(!vcpu)
+            ERROR2(-ENXIO, "vcpu[%d] of process (pid = %d) is uncreated",
+                i, kvm->userspace_pid);
+        if(!(root_of_vcpu = COMPAT_VCPU_ROOT_HPA(vcpu)))
+            ERROR1(-EINVAL, "vcpu[%d] is uninitialized", i);
+        if(!root)
+            root = root_of_vcpu;
+        else if(root != root_of_vcpu)
+            ERROR2(-EFAULT, "ept root of vcpu[%d] is %llx, different from other vcpus'",
+                i, root_of_vcpu);
+    }
+    if(!root)
+        ERROR1(-EINVAL, "process (pid = %d) has no vcpu", kvm->userspace_pid);
+    ept->kvm = kvm;
+    ept->root = (uint64_t*)__va(root);
+    return 0;
+}
+
+unsigned long ept_update(struct ept* ept, gfn_t start, gfn_t end, ept_update_func update,
+    void* data)
+{
+    unsigned long count = 0;
+    gfn_t gfn = start;
+    while(gfn < end)
+    {
+        uint64_t *puds, *pmds, *pmdp, pmd_val, new_val;
+        // a whole sweep takes long, give way to others between tables of 1GB
+        if(!(gfn & (EPT_TABLE_PAGES - 1)))
+            cond_resched();
+        // skip absent tables as a whole
+        if(!(puds = get_table(ept->root[EPT_PGD_INDEX(gfn)])))
+        {
+            gfn = (gfn | (EPT_TABLE_PAGES * 512 - 1)) + 1;
+            continue;
+        }
+        if(!(pmds = get_table(puds[EPT_PUD_INDEX(gfn)])))
+        {
+            gfn = (gfn | (EPT_TABLE_PAGES - 1)) + 1;
+            continue;
+        }
+        pmdp = pmds + EPT_PMD_INDEX(gfn);
+        // retry with the current entry if it's changed at the same time
+        while((pmd_val = READ_ONCE(*pmdp)))
+        {
+            new_val = update(pmd_val, __pa(pmds) >> PAGE_SHIFT,
+                gfn & ~(gfn_t)(EPT_REGION_PAGES - 1), data);
+            if(new_val == pmd_val || __sync_bool_compare_and_swap(pmdp, pmd_val, new_val))
+            {
+                count++;
+                break;
+            }
+        }
+        gfn = (gfn | (EPT_REGION_PAGES - 1)) + 1;
+    }
+    return count;
+}
+
+unsigned long ept_get_pfn(struct ept* ept, gfn_t gfn)
+{
+    uint64_t *puds, *pmds, *ptes, pmd_val;
+    if(!(puds = get_table(ept->root[EPT_PGD_INDEX(gfn)])) ||
+        !(pmds = get_table(puds[EPT_PUD_INDEX(gfn)])))
+        return 0;
+    pmd_val = pmds[EPT_PMD_INDEX(gfn)];
+    if(pmd_val & EPT_LARGE)
+        return ((pmd_val & EPT_HUGE_ADDR_MASK) >> PAGE_SHIFT) + EPT_PTE_INDEX(gfn);
+    if(!(ptes = get_table(pmd_val)))
+        return 0;
+    return (ptes[EPT_PTE_INDEX(gfn)] & EPT_ADDR_MASK) >> PAGE_SHIFT;
+}
+
+#endif
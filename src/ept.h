@@ -0,0 +1,66 @@
+#ifndef EPT_H
+#define EPT_H
+
+// Access to the EPT of a VM, on either MMU of KVM:
+// - the legacy MMU of older kernels, where the EPT is walked from the root of vCPUs by raw
+//   pointers, and an entry is changed by a single CAS
+// - the TDP MMU of current kernels, patched as in the TDP MMU section of kernel_patch.md,
+//   which defines KVM_EPT_SAMPLE_TDP_MMU. KVM walks the EPT by its own iterators under RCU
+//   with mmu_lock held for read, and changes an entry by its atomic SPTE update, so it never
+//   races with faults KVM handles in parallel, and never blocks them
+// Only 2MB-level entries are changed, i.e. 2MB leaves or pointers to tables of 4KB leaves,
+// and only in the root that vCPUs use for the normal address space, so every GFN is visited
+// once per call.
+
+#include <linux/kvm_host.h>
+
+#define EPT_REGION_PAGES    512     // 4KB pages of a 2MB region
+#define EPT_TABLE_PAGES     (512 * EPT_REGION_PAGES)    // 4KB pages of a table of regions
+#define EPT_GFN_LIMIT       (1UL << 36)     // GFNs of a 4-level EPT
+
+#define EPT_ADDR_MASK       ((uint64_t)0xfffffffff000)
+#define EPT_LARGE           0x80    // the entry is a leaf of a huge page
+
+#define EPT_PROT_READ   (1 << 0)
+#define EPT_PROT_WRITE  (1 << 1)
+#define EPT_PROT_EXEC   (1 << 2)
+#define EPT_PROT_UEXEC  (1 << 10)
+#define EPT_PROT_ALL    (EPT_PROT_READ | EPT_PROT_WRITE | EPT_PROT_EXEC | EPT_PROT_UEXEC)
+
+struct ept
+{
+    struct kvm* kvm;
+#ifndef KVM_EPT_SAMPLE_TDP_MMU
+    uint64_t* root;     // the root shared by all vCPUs
+#endif
+};
+
+// compute the new value of a 2MB-level entry
+//  entry: the present entry
+//  table: the PFN of the table holding the entry, which tells the entry from another one
+//      KVM may replace it with after rebuilding the table
+//  gfn: the first GFN of the region
+//  data: the private data passed to 'ept_update()'
+// return the new entry, or 'entry' to keep it
+typedef uint64_t (*ept_update_func)(uint64_t entry, unsigned long table, gfn_t gfn,
+    void* data);
+
+// init
+// return 0 when ok, or a negative error code
+int ept_init(struct ept* ept, struct kvm* kvm);
+
+// visit present 2MB-level entries of regions in GFNs [start, end), and change every entry to
+// what 'update' returns
+// 'update' is called again with the current entry if it's changed at the same time (e.g. by
+// KVM, or by another 'ept_update()'), and may be called again for an entry already changed
+// after a reschedule, so it must be safe to repeat, and never sleep. 'ept_update()' itself
+// may sleep, so it must be called in process context.
+// return the count of visited entries
+unsigned long ept_update(struct ept* ept, gfn_t start, gfn_t end, ept_update_func update,
+    void* data);
+
+// get the host PFN of a GFN from the EPT
+// return the PFN, or 0 if it's not mapped
+unsigned long ept_get_pfn(struct ept* ept, gfn_t gfn);
+
+#endif
@@ -1,6 +1,12 @@
 #include "common.h"
+#include "compat.h"
 #include "interact.h"
 
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/math64.h>
+#include <asm/tsc.h>
+
 static void* alloc_page_for_queue(void* privdata)
 {
     return (void*)__get_free_page(GFP_ATOMIC);
@@ -11,6 +17,44 @@ static void free_page_for_queue(void* page, void* privdata)
     free_page((unsigned long)page);
 }
 
+static void deinit_queues(struct lfqueue __percpu* queues, unsigned int cpu_limit)
+{
+    unsigned int cpu;
+    for_each_possible_cpu(cpu)
+    {
+        if(cpu >= cpu_limit)
+            break;
+        lfqueue_deinit(per_cpu_ptr(queues, cpu), NULL);
+    }
+    free_percpu(queues);
+}
+
+static size_t sample_size(int format)
+{
+    return format == INTERACT_FORMAT_ANNOTATED ?
+        sizeof(struct interact_annotated_sample) : sizeof(struct interact_sample);
+}
+
+static int init_queues(struct lfqueue __percpu** p_queues, int format)
+{
+    int ret;
+    unsigned int cpu;
+    struct lfqueue __percpu* queues;
+    if(!(queues = alloc_percpu(struct lfqueue)))
+        ERROR0(-ENOMEM, "alloc_percpu(struct lfqueue) failed");
+    for_each_possible_cpu(cpu)
+    {
+        if((ret = lfqueue_init(per_cpu_ptr(queues, cpu), sample_size(format), PAGE_SIZE,
+            alloc_page_for_queue, free_page_for_queue, NULL)))
+        {
+            deinit_queues(queues, cpu);
+            ERROR1(ret, "lfqueue_init(<queue of cpu %u>, ...) failed", cpu);
+        }
+    }
+    (*p_queues) = queues;
+    return 0;
+}
+
 int interact_open(struct inode* inode, struct file* file)
 {
     int ret;
@@ -19,35 +63,81 @@ int interact_open(struct inode* inode, struct file* file)
     if(!(interact = kzalloc(sizeof(struct interact), GFP_KERNEL)))
         ERROR0(-ENOMEM, "kzalloc(sizeof(struct interact), GFP_KERNEL) failed");
     sema_init(&(interact->file_lock), 1);
-    if((ret = queue_init(&(interact->queue), sizeof(struct interact_sample), PAGE_SIZE,
-        alloc_page_for_queue, free_page_for_queue, NULL)))
+    interact->format = INTERACT_FORMAT_COMPACT;
+    if(!(interact->stats = alloc_percpu(struct interact_stats)))
+    {
+        kfree(interact);
+        ERROR0(-ENOMEM, "alloc_percpu(struct interact_stats) failed");
+    }
+    if((ret = init_queues(&(interact->queues), interact->format)))
     {
+        free_percpu(interact->stats);
         kfree(interact);
-        ERROR0(ret, "queue_init(&(interact->queue), ...) failed");
+        ERROR0(ret, "init_queues(&(interact->queues), ...) failed");
     }
-    spin_lock_init(&(interact->queue_lock));
+    interact->read_cpu = 0;
+    init_waitqueue_head(&(interact->wait));
     assert(!interact->sampler.privdata);
     assert(!file->private_data);
     file->private_data = interact;
     return 0;
 }
 
-static void on_ept_sample(unsigned long gpa, int xwr, void* privdata)
+static void on_ept_sample(const struct sampler_sample* sample, void* privdata)
 {
     struct interact* interact = privdata;
-    struct interact_sample* sample;
+    struct lfqueue* queue;
+    void* entry;
     assert(interact);
-    if(!spin_trylock(&(interact->queue_lock)))
-        return;
-    if(interact->queue.length >= INTERACT_MAX_BUFFERED_SAMPLES ||
-        !(sample = queue_add(&(interact->queue))))
+    // preemption is disabled, so this CPU is the only producer of its queue
+    queue = get_cpu_ptr(interact->queues);
+    if(lfqueue_length(queue) >= INTERACT_MAX_BUFFERED_SAMPLES ||
+        !(entry = lfqueue_add(queue)))
     {
-        spin_unlock(&(interact->queue_lock));
-        return;
+        // the reader can't keep up, tell it how many samples it has missed
+        this_cpu_inc(interact->stats->dropped);
     }
-    sample->gfn = gpa >> PAGE_SHIFT;
-    sample->xwr = xwr;
-    spin_unlock(&(interact->queue_lock));
+    else
+    {
+        if(interact->format == INTERACT_FORMAT_ANNOTATED)
+        {
+            struct interact_annotated_sample* annotated = entry;
+            annotated->gfn = sample->gpa >> PAGE_SHIFT;
+            annotated->xwr = sample->xwr;
+            annotated->hva = sample->hva;
+            annotated->slot = sample->slot;
+            annotated->node = sample->node;
+        }
+        else
+        {
+            struct interact_sample* compact = entry;
+            compact->gfn = sample->gpa >> PAGE_SHIFT;
+            compact->xwr = sample->xwr;
+        }
+        lfqueue_commit(queue);
+        this_cpu_inc(interact->stats->buffered);
+    }
+    put_cpu_ptr(interact->queues);
+}
+
+static int has_samples(struct interact* interact)
+{
+    unsigned int cpu;
+    for_each_possible_cpu(cpu)
+        if(lfqueue_length(per_cpu_ptr(interact->queues, cpu)))
+            return 1;
+    return 0;
+}
+
+static void on_sweep(uint64_t memslots_generation, void* privdata)
+{
+    struct interact* interact = privdata;
+    assert(interact);
+    if(memslots_generation != READ_ONCE(interact->memslots_generation))
+        WRITE_ONCE(interact->memslots_changed, 1);
+    if(waitqueue_active(&(interact->wait)) &&
+        (READ_ONCE(interact->memslots_changed) || has_samples(interact)))
+        wake_up_interruptible(&(interact->wait));
 }
 
 static int handle_cmd_init(struct interact* interact, pid_t pid)
@@ -55,12 +145,15 @@ static int handle_cmd_init(struct interact* interact, pid_t pid)
     int ret;
     if(interact->sampler.privdata)
         ERROR0(-EINVAL, "this fd has been inited already");
-    if((ret = sampler_init(&(interact->sampler), pid, on_ept_sample, interact)))
+    if((ret = sampler_init(&(interact->sampler), pid, on_ept_sample, on_sweep, interact)))
     {
         assert(!interact->sampler.privdata);
         ERROR1(ret, "sampler_init(&(interact->sampler), %d, ...) failed", pid);
     }
     assert(interact->sampler.privdata == interact);
+    sampler_set_annotate(&(interact->sampler), interact->format == INTERACT_FORMAT_ANNOTATED);
+    interact->memslots_generation = interact->sampler.memslots_generation;
+    interact->memslots_changed = 0;
     return 0;
 }
 
@@ -74,47 +167,316 @@ static int handle_cmd_set_prot(struct interact* interact, int xwr)
 
 static int handle_cmd_set_freq(struct interact* interact, unsigned long freq)
 {
+    int ret;
     if(!interact->sampler.privdata)
         ERROR0(-EINVAL, "this fd has not been inited yet");
-    sampler_set_freq(&(interact->sampler), freq);
+    if((ret = sampler_set_freq(&(interact->sampler), freq)))
+        ERROR1(ret, "sampler_set_freq(&(interact->sampler), %lu) failed", freq);
     return 0;
 }
 
+static int handle_cmd_set_vcpu_budget(struct interact* interact, unsigned long hz)
+{
+    if(!interact->sampler.privdata)
+        ERROR0(-EINVAL, "this fd has not been inited yet");
+    sampler_set_vcpu_budget(&(interact->sampler), hz);
+    return 0;
+}
+
+static int handle_cmd_set_sweep_cpus(struct interact* interact,
+    struct interact_sweep_cpus* __user param)
+{
+    struct interact_sweep_cpus sweep_cpus;
+    cpumask_var_t cpus;
+    int ret;
+    if(!param)
+        ERROR0(-EINVAL, "param <param = NULL> is invalid");
+    if(!interact->sampler.privdata)
+        ERROR0(-EINVAL, "this fd has not been inited yet");
+    if(copy_from_user(&sweep_cpus, param, sizeof(struct interact_sweep_cpus)))
+        ERROR1(-EIO, "copy_from_user(..., %p, sizeof(struct interact_sweep_cpus)) failed", param);
+    if(!sweep_cpus.mask)
+        return sampler_set_sweep_cpus(&(interact->sampler), NULL);
+    if(!zalloc_cpumask_var(&cpus, GFP_KERNEL))
+        ERROR0(-ENOMEM, "zalloc_cpumask_var(&cpus, GFP_KERNEL) failed");
+    // a larger mask than the kernel's is cut, as the CPUs beyond can't exist
+    if(copy_from_user(cpumask_bits(cpus), sweep_cpus.mask,
+        min_t(size_t, sweep_cpus.size, cpumask_size())))
+    {
+        free_cpumask_var(cpus);
+        ERROR1(-EIO, "copy_from_user(..., %p, ...) failed", sweep_cpus.mask);
+    }
+    ret = sampler_set_sweep_cpus(&(interact->sampler), cpus);
+    free_cpumask_var(cpus);
+    if(ret)
+        ERROR0(ret, "sampler_set_sweep_cpus(...) failed");
+    return 0;
+}
+
+static void fill_memslot(struct kvm_memory_slot* src, int as_id, struct interact_memslot_ex* dst)
+{
+    dst->gpa = src->base_gfn << PAGE_SHIFT;
+    dst->hva = src->userspace_addr;
+    dst->page_count = src->npages;
+    dst->as_id = as_id;
+    dst->id = src->id;
+}
+
+// take a snapshot of at most 'capacity' slots of the first 'as_count' address spaces, and
+// count all of them
+// the slots and the generation must be consistent, so they are taken under one SRCU section
+// The generation always covers all address spaces, as events of the sample stream do.
+static size_t snapshot_memslots(struct kvm* kvm, int as_count,
+    struct interact_memslot_ex* memslots, size_t capacity, uint64_t* generation)
+{
+    size_t slot_count = 0;
+    int as_id, srcu_index = srcu_read_lock(&(kvm->srcu));
+    (*generation) = 0;
+    for(as_id = 0; as_id < KVM_ADDRESS_SPACE_NUM; as_id++)
+    {
+        struct kvm_memslots* kvm_memslots = __kvm_memslots(kvm, as_id);
+        struct kvm_memory_slot* memslot;
+        int bkt __maybe_unused;
+        assert(kvm_memslots);
+        (*generation) += COMPAT_MEMSLOTS_GENERATION(kvm_memslots);
+        if(as_id >= as_count)
+            continue;
+        COMPAT_FOR_EACH_MEMSLOT(memslot, bkt, kvm_memslots)
+        {
+            if(slot_count < capacity)
+                fill_memslot(memslot, as_id, memslots + slot_count);
+            slot_count++;
+        }
+    }
+    srcu_read_unlock(&(kvm->srcu), srcu_index);
+    return slot_count;
+}
+
+// copy slots out in the records of GET_MEMSLOTS_EX, or of GET_MEMSLOTS
+static int copy_memslots(void* __user memslots, const struct interact_memslot_ex* buffer,
+    size_t count, int ex)
+{
+    size_t i;
+    if(ex)
+        return copy_to_user(memslots, buffer, sizeof(struct interact_memslot_ex) * count);
+    for(i = 0; i < count; i++)
+    {
+        struct interact_memslot memslot = {buffer[i].gpa, buffer[i].hva, buffer[i].page_count};
+        if(copy_to_user((struct interact_memslot* __user)memslots + i, &memslot,
+            sizeof(memslot)))
+            return -EFAULT;
+    }
+    return 0;
+}
+
+// GET_MEMSLOTS if 'ex' is 0, whose argument is the prefix of the one of GET_MEMSLOTS_EX
 static int handle_cmd_get_memslots(struct interact* interact,
-    struct interact_get_memslots* __user param)
+    struct interact_get_memslots_ex* __user param, int ex)
 {
-    struct kvm_memslots* kvm_memslots;
-    size_t slot_count;
-    struct interact_memslot* __user memslots;
+    struct kvm* kvm;
+    void* __user memslots;
+    struct interact_memslot_ex* buffer = NULL;
+    size_t capacity = 0, buffer_capacity = 0, slot_count;
+    uint64_t generation;
+    BUILD_BUG_ON(offsetof(struct interact_get_memslots_ex, count) !=
+        offsetof(struct interact_get_memslots, count));
     if(!param)
         ERROR0(-EINVAL, "param <param = NULL> is invalid");
     if(!interact->sampler.privdata)
         ERROR0(-EINVAL, "this fd has not been inited yet");
-    kvm_memslots = interact->sampler.kvm->memslots[0];
-    assert(kvm_memslots);
-    slot_count = kvm_memslots->used_slots;
+    kvm = interact->sampler.kvm;
     if(copy_from_user(&memslots, &(param->memslots), sizeof(void*)))
         ERROR1(-EIO, "copy_from_user(..., %p, sizeof(void*)) failed", &(param->memslots));
-    if(memslots)
+    if(memslots && get_user(capacity, &(param->capacity)))
+        ERROR1(-EIO, "get_user(..., %p) failed", &(param->capacity));
+    // Slots are copied out after leaving SRCU, as the user buffer may fault, or block under
+    // userfaultfd, which would stall synchronize_srcu() of memslot updates in QEMU.
+    // Grow the snapshot till it holds as many slots as the caller wants.
+    while(1)
     {
-        size_t i, capacity, count;
-        if(get_user(capacity, &(param->capacity)))
-            ERROR1(-EIO, "get_user(..., %p) failed", &(param->capacity));
-        count = MIN2(capacity, slot_count);
-        for(i = 0; i < count; i++)
-        {
-            struct kvm_memory_slot* src = kvm_memslots->memslots + i;
-            struct interact_memslot* __user dst = memslots + i;
-            if(put_user(src->base_gfn << PAGE_SHIFT, &(dst->gpa)))
-                ERROR1(-EIO, "put_user(..., %p) failed", &(dst->gpa));
-            if(put_user(src->userspace_addr, &(dst->hva)))
-                ERROR1(-EIO, "put_user(..., %p) failed", &(dst->hva));
-            if(put_user(src->npages, &(dst->page_count)))
-                ERROR1(-EIO, "put_user(..., %p) failed", &(dst->page_count));
-        }
+        slot_count = snapshot_memslots(kvm, ex ? KVM_ADDRESS_SPACE_NUM : 1, buffer,
+            buffer_capacity, &generation);
+        if(slot_count <= buffer_capacity || buffer_capacity >= capacity)
+            break;
+        kvfree(buffer);
+        buffer_capacity = min(slot_count, capacity);
+        if(!(buffer = kvmalloc_array(buffer_capacity, sizeof(struct interact_memslot_ex),
+            GFP_KERNEL)))
+            ERROR0(-ENOMEM, "kvmalloc_array(..., sizeof(struct interact_memslot_ex), ...) failed");
+    }
+    if(buffer && copy_memslots(memslots, buffer, min(slot_count, capacity), ex))
+    {
+        kvfree(buffer);
+        ERROR1(-EIO, "copy_memslots(%p, buffer, ...) failed", memslots);
     }
+    kvfree(buffer);
     if(put_user(slot_count, &(param->count)))
         ERROR1(-EIO, "put_user(..., %p) failed", &(param->count));
+    if(ex && put_user(generation, &(param->generation)))
+        ERROR1(-EIO, "put_user(..., %p) failed", &(param->generation));
+    // the reader knows the latest slots now, unless it can't get all of them
+    if(slot_count <= capacity)
+    {
+        WRITE_ONCE(interact->memslots_generation, generation);
+        WRITE_ONCE(interact->memslots_changed, 0);
+    }
+    return 0;
+}
+
+static int handle_cmd_get_memslots_gen(struct interact* interact, uint64_t* __user generation)
+{
+    if(!generation)
+        ERROR0(-EINVAL, "param <generation = NULL> is invalid");
+    if(!interact->sampler.privdata)
+        ERROR0(-EINVAL, "this fd has not been inited yet");
+    if(put_user(sampler_get_memslots_generation(&(interact->sampler)), generation))
+        ERROR1(-EIO, "put_user(..., %p) failed", generation);
+    return 0;
+}
+
+static int handle_cmd_set_wss(struct interact* interact, unsigned long interval_ms)
+{
+    int ret;
+    if(!interact->sampler.privdata)
+        ERROR0(-EINVAL, "this fd has not been inited yet");
+    if((ret = sampler_set_wss(&(interact->sampler), interval_ms)))
+        ERROR1(ret, "sampler_set_wss(&(interact->sampler), %lu) failed", interval_ms);
+    return 0;
+}
+
+static int handle_cmd_get_wss(struct interact* interact, struct interact_get_wss* __user param)
+{
+    struct sampler_wss* __user records;
+    size_t capacity, count = 0;
+    if(!param)
+        ERROR0(-EINVAL, "param <param = NULL> is invalid");
+    if(!interact->sampler.privdata)
+        ERROR0(-EINVAL, "this fd has not been inited yet");
+    if(copy_from_user(&records, &(param->records), sizeof(void*)))
+        ERROR1(-EIO, "copy_from_user(..., %p, sizeof(void*)) failed", &(param->records));
+    if(get_user(capacity, &(param->capacity)))
+        ERROR1(-EIO, "get_user(..., %p) failed", &(param->capacity));
+    if(!records)
+        capacity = 0;
+    while(count < capacity)
+    {
+        struct sampler_wss wss;
+        if(!sampler_take_wss(&(interact->sampler), &wss))
+            break;
+        if(copy_to_user(records + count, &wss, sizeof(struct sampler_wss)))
+            ERROR1(-EIO, "copy_to_user(%p, &wss, sizeof(struct sampler_wss)) failed",
+                records + count);
+        count++;
+    }
+    if(put_user(count, &(param->count)))
+        ERROR1(-EIO, "put_user(..., %p) failed", &(param->count));
+    return 0;
+}
+
+static int handle_cmd_set_format(struct interact* interact, int format)
+{
+    int ret;
+    struct lfqueue __percpu* queues;
+    if(format != INTERACT_FORMAT_COMPACT && format != INTERACT_FORMAT_ANNOTATED)
+        ERROR1(-EINVAL, "param <format = %d> is invalid", format);
+    // queues can be rebuilt safely only when there is no producer
+    if(interact->sampler.privdata)
+        ERROR0(-EBUSY, "this fd has been inited already");
+    if(format == interact->format)
+        return 0;
+    if((ret = init_queues(&queues, format)))
+        ERROR1(ret, "init_queues(&queues, %d) failed", format);
+    deinit_queues(interact->queues, nr_cpu_ids);
+    interact->queues = queues;
+    interact->format = format;
+    return 0;
+}
+
+static int handle_cmd_get_stats(struct interact* interact, struct interact_stats* __user param)
+{
+    struct interact_stats stats = {0, 0};
+    unsigned int cpu;
+    if(!param)
+        ERROR0(-EINVAL, "param <param = NULL> is invalid");
+    // counters of CPUs are summed without stopping them, so the sum may be a little stale
+    for_each_possible_cpu(cpu)
+    {
+        struct interact_stats* cpu_stats = per_cpu_ptr(interact->stats, cpu);
+        stats.buffered += READ_ONCE(cpu_stats->buffered);
+        stats.dropped += READ_ONCE(cpu_stats->dropped);
+    }
+    if(copy_to_user(param, &stats, sizeof(struct interact_stats)))
+        ERROR1(-EIO, "copy_to_user(%p, &stats, sizeof(struct interact_stats)) failed", param);
+    return 0;
+}
+
+// the latency of a percentile in ns, rounded up to the end of its bucket
+static uint64_t get_percentile(const uint64_t* counts, uint64_t total, unsigned int percent)
+{
+    uint64_t sum = 0;
+    int i;
+    for(i = 0; i < SAMPLER_LATENCY_BUCKETS; i++)
+    {
+        sum += counts[i];
+        if(sum && sum * 100 >= total * percent)
+            break;
+    }
+    if(i >= SAMPLER_LATENCY_BUCKETS - 1)
+        return U64_MAX;
+    return mul_u64_u32_div(1ULL << (i + 1), NSEC_PER_MSEC, tsc_khz);
+}
+
+static int handle_cmd_get_latency(struct interact* interact, struct interact_latency* __user param)
+{
+    struct sampler_latency* latency;
+    struct interact_latency* result;
+    int ret, kind, i;
+    if(!param)
+        ERROR0(-EINVAL, "param <param = NULL> is invalid");
+    if(!interact->sampler.privdata)
+        ERROR0(-EINVAL, "this fd has not been inited yet");
+    // too large for the kernel stack
+    if(!(latency = kmalloc(sizeof(struct sampler_latency), GFP_KERNEL)))
+        ERROR0(-ENOMEM, "kmalloc(sizeof(struct sampler_latency), GFP_KERNEL) failed");
+    if((ret = sampler_get_latency(&(interact->sampler), latency)))
+    {
+        kfree(latency);
+        ERROR0(ret, "sampler_get_latency(...) failed, is the module built with SAMPLER_LATENCY?");
+    }
+    if(!(result = kzalloc(sizeof(struct interact_latency), GFP_KERNEL)))
+    {
+        kfree(latency);
+        ERROR0(-ENOMEM, "kzalloc(sizeof(struct interact_latency), GFP_KERNEL) failed");
+    }
+    for(kind = 0; kind < SAMPLER_LATENCY_KINDS; kind++)
+    {
+        struct interact_latency_histogram* histogram = result->histograms + kind;
+        uint64_t total = 0;
+        for(i = 0; i < SAMPLER_LATENCY_BUCKETS; i++)
+            total += (histogram->counts[i] = latency->counts[kind][i]);
+        if(total)
+        {
+            histogram->p50 = get_percentile(histogram->counts, total, 50);
+            histogram->p99 = get_percentile(histogram->counts, total, 99);
+            histogram->max = mul_u64_u32_div(latency->max[kind], NSEC_PER_MSEC, tsc_khz);
+        }
+    }
+    result->tsc_khz = tsc_khz;
+    kfree(latency);
+    ret = copy_to_user(param, result, sizeof(struct interact_latency)) ? -EIO : 0;
+    kfree(result);
+    if(ret)
+        ERROR1(ret, "copy_to_user(%p, result, sizeof(struct interact_latency)) failed", param);
+    return 0;
+}
+
+static int handle_cmd_reset_latency(struct interact* interact)
+{
+    int ret;
+    if(!interact->sampler.privdata)
+        ERROR0(-EINVAL, "this fd has not been inited yet");
+    if((ret = sampler_reset_latency(&(interact->sampler))))
+        ERROR0(ret, "sampler_reset_latency(...) failed, is the module built with SAMPLER_LATENCY?");
     return 0;
 }
 
@@ -145,9 +507,29 @@ long interact_ioctl(struct file* file, unsigned int cmd, unsigned long arg)
     else if(cmd == INTERACT_CMD_SET_FREQ)
         ret = handle_cmd_set_freq(interact, arg);
     else if(cmd == INTERACT_CMD_GET_MEMSLOTS)
-        ret = handle_cmd_get_memslots(interact, (void*)arg);
+        ret = handle_cmd_get_memslots(interact, (void*)arg, 0);
     else if(cmd == INTERACT_CMD_DEINIT)
         ret = handle_cmd_deinit(interact, 1);
+    else if(cmd == INTERACT_CMD_SET_WSS)
+        ret = handle_cmd_set_wss(interact, arg);
+    else if(cmd == INTERACT_CMD_GET_WSS)
+        ret = handle_cmd_get_wss(interact, (void*)arg);
+    else if(cmd == INTERACT_CMD_GET_MEMSLOTS_GEN)
+        ret = handle_cmd_get_memslots_gen(interact, (void*)arg);
+    else if(cmd == INTERACT_CMD_SET_FORMAT)
+        ret = handle_cmd_set_format(interact, (int)arg);
+    else if(cmd == INTERACT_CMD_GET_STATS)
+        ret = handle_cmd_get_stats(interact, (void*)arg);
+    else if(cmd == INTERACT_CMD_GET_LATENCY)
+        ret = handle_cmd_get_latency(interact, (void*)arg);
+    else if(cmd == INTERACT_CMD_RESET_LATENCY)
+        ret = handle_cmd_reset_latency(interact);
+    else if(cmd == INTERACT_CMD_SET_VCPU_BUDGET)
+        ret = handle_cmd_set_vcpu_budget(interact, arg);
+    else if(cmd == INTERACT_CMD_SET_SWEEP_CPUS)
+        ret = handle_cmd_set_sweep_cpus(interact, (void*)arg);
+    else if(cmd == INTERACT_CMD_GET_MEMSLOTS_EX)
+        ret = handle_cmd_get_memslots(interact, (void*)arg, 1);
     else
     {
         up(&(interact->file_lock));
@@ -157,40 +539,98 @@ long interact_ioctl(struct file* file, unsigned int cmd, unsigned long arg)
     return ret;
 }
 
+static void make_event(struct interact* interact, void* entry)
+{
+    uint64_t generation = interact->sampler.memslots_generation;
+    if(interact->format == INTERACT_FORMAT_ANNOTATED)
+    {
+        struct interact_annotated_sample* annotated = entry;
+        annotated->gfn = generation;
+        annotated->xwr = 0;
+        annotated->hva = 0;
+        annotated->slot = -1;
+        annotated->node = NUMA_NO_NODE;
+    }
+    else
+    {
+        struct interact_sample* compact = entry;
+        compact->gfn = generation;
+        compact->xwr = 0;
+    }
+}
+
 ssize_t interact_read(struct file* file, char* buffer, size_t capacity, loff_t* offset)
 {
     struct interact* interact = file->private_data;
-    size_t size = 0;
+    size_t size = 0, entry_size;
+    unsigned int i, cpu;
     if(!buffer)
         return 0;
     assert(interact);
+    // 'file_lock' makes this the only consumer of all queues
     down(&(interact->file_lock));
-    while(size < capacity)
+    entry_size = sample_size(interact->format);
+    // the event of memslots changing goes first
+    if(interact->sampler.privdata && size + entry_size <= capacity &&
+        xchg(&(interact->memslots_changed), 0))
     {
-        struct interact_sample* sample;
-        spin_lock(&(interact->queue_lock));
-        sample = queue_take(&(interact->queue));
-        spin_unlock(&(interact->queue_lock));
-        if(!sample)
-            break;
-        if(copy_to_user(buffer + size, sample, sizeof(struct interact_sample)))
+        struct interact_annotated_sample event;
+        make_event(interact, &event);
+        if(copy_to_user(buffer + size, &event, entry_size))
         {
             up(&(interact->file_lock));
-            ERROR1(-EIO, "copy_to_user(%p, sample, sizeof(struct interact_sample)) failed",
-                buffer + size);
+            ERROR1(-EIO, "copy_to_user(%p, &event, entry_size) failed", buffer + size);
         }
-        size += sizeof(struct interact_sample);
+        size += entry_size;
     }
+    // start from a different CPU every time, so that no queue starves
+    cpu = interact->read_cpu;
+    for(i = 0; i < nr_cpu_ids && size + entry_size <= capacity; i++)
+    {
+        struct lfqueue* queue;
+        void* sample;
+        if(!cpu_possible(cpu))
+        {
+            cpu = (cpu + 1) % nr_cpu_ids;
+            continue;
+        }
+        queue = per_cpu_ptr(interact->queues, cpu);
+        while(size + entry_size <= capacity && (sample = lfqueue_take(queue)))
+        {
+            if(copy_to_user(buffer + size, sample, entry_size))
+            {
+                up(&(interact->file_lock));
+                ERROR1(-EIO, "copy_to_user(%p, sample, entry_size) failed", buffer + size);
+            }
+            size += entry_size;
+        }
+        cpu = (cpu + 1) % nr_cpu_ids;
+    }
+    interact->read_cpu = cpu;
     up(&(interact->file_lock));
     return size;
 }
 
+unsigned int interact_poll(struct file* file, poll_table* wait)
+{
+    struct interact* interact = file->private_data;
+    unsigned int mask = 0;
+    assert(interact);
+    poll_wait(file, &(interact->wait), wait);
+    if(READ_ONCE(interact->memslots_changed))
+        mask |= POLLIN | POLLRDNORM | POLLPRI;
+    else if(has_samples(interact))
+        mask |= POLLIN | POLLRDNORM;
+    return mask;
+}
+
 int interact_release(struct inode* inode, struct file* file)
 {
     struct interact* interact = file->private_data;
     assert(interact);
     handle_cmd_deinit(interact, 0);
-    queue_deinit(&(interact->queue), NULL);
+    deinit_queues(interact->queues, nr_cpu_ids);
+    free_percpu(interact->stats);
     kfree(interact);
     file->private_data = NULL;
     return 0;
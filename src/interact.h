@@ -1,35 +1,91 @@
 #ifndef INTERACT_H
 #define INTERACT_H
 
-#include "queue.h"
+#include "lfqueue.h"
 #include "sampler.h"
 
 #include <linux/fs.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
 
 #define INTERACT_CMD_INIT           1200
 #define INTERACT_CMD_SET_PROT       1201
 #define INTERACT_CMD_SET_FREQ       1202
 #define INTERACT_CMD_GET_MEMSLOTS   1203
 #define INTERACT_CMD_DEINIT         1204
+#define INTERACT_CMD_SET_WSS        1205
+#define INTERACT_CMD_GET_WSS        1206
+#define INTERACT_CMD_GET_MEMSLOTS_GEN   1207
+#define INTERACT_CMD_SET_FORMAT     1208
+#define INTERACT_CMD_GET_STATS      1209
+#define INTERACT_CMD_GET_LATENCY    1210
+#define INTERACT_CMD_RESET_LATENCY  1211
+#define INTERACT_CMD_SET_VCPU_BUDGET    1212
+#define INTERACT_CMD_SET_SWEEP_CPUS 1213
+#define INTERACT_CMD_GET_MEMSLOTS_EX    1214
 
-#define INTERACT_MAX_BUFFERED_SAMPLES   65536
+#define INTERACT_FORMAT_COMPACT     0   // samples are 'struct interact_sample'
+#define INTERACT_FORMAT_ANNOTATED   1   // samples are 'struct interact_annotated_sample'
+
+#define INTERACT_MAX_BUFFERED_SAMPLES   65536   // per CPU
+
+// the argument of GET_STATS command, counters since the fd is opened
+struct interact_stats
+{
+    uint64_t buffered;      // count of samples buffered for read()
+    uint64_t dropped;       // count of samples dropped, as the buffer of a CPU is full
+};
+
+// the argument of GET_LATENCY command, latencies since INIT or the latest RESET_LATENCY
+// Only available if the module is built with SAMPLER_LATENCY, see 'sampler_get_latency()'.
+struct interact_latency
+{
+    struct interact_latency_histogram
+    {
+        uint64_t counts[SAMPLER_LATENCY_BUCKETS];   // i: count of [2^i, 2^(i+1)) TSC cycles
+        uint64_t p50;       // the median in ns, rounded up to the end of its bucket
+        uint64_t p99;       // the 99th percentile in ns, rounded up to the end of its bucket
+        uint64_t max;       // the max in ns
+    }
+    histograms[SAMPLER_LATENCY_KINDS];  // SAMPLER_LATENCY_SAMPLE and SAMPLER_LATENCY_SWEEP
+    uint64_t tsc_khz;       // the TSC frequency, to convert 'counts' to time
+};
 
 // the structure that a file->private_data points to
 struct interact
 {
     struct semaphore file_lock; // make sure file operations are sequential
     struct sampler sampler;     // core sampler
-    struct queue queue;         // queue to buffer samples
-    spinlock_t queue_lock;      // protect 'queue'
+    int format;                 // INTERACT_FORMAT_*, the format of samples
+    struct lfqueue __percpu* queues;    // per-CPU queues to buffer samples
+    struct interact_stats __percpu* stats;  // per-CPU counters of samples
+    unsigned int read_cpu;      // the CPU whose queue is read first in next read()
+    wait_queue_head_t wait;     // woken up when samples or events are readable
+    uint64_t memslots_generation;   // the memslots generation that the reader knows
+    int memslots_changed;       // whether an event sample should be read
 };
 
 // the structure of a access sample
+// A sample with xwr = 0 is not an access, but an event telling that memslots have changed
+// since the latest GET_MEMSLOTS or GET_MEMSLOTS_EX. Its gfn is the low bits of the new generation.
 struct interact_sample
 {
     uint32_t gfn: 29;   // the Guest Physical Page Frame Number
     uint32_t xwr: 3;    // the 'or' bits of access type
 };
 
+// the structure of an annotated access sample
+// The HVA and the host NUMA node are got by the kernel when handling the EPT violation.
+// An event has xwr = 0 as well, and its gfn is the new generation of memslots.
+struct interact_annotated_sample
+{
+    uint64_t gfn: 61;   // the Guest Physical Page Frame Number
+    uint64_t xwr: 3;    // the 'or' bits of access type
+    uint64_t hva;       // the Host Virtual Address of the page, 0 if not in any memslot
+    int32_t slot;       // (as_id << 16) | id of the memslot, -1 if not in any memslot
+    int32_t node;       // the host NUMA node of the page, -1 if unknown
+};
+
 // the argument of GET_MEMSLOTS command
 // Guest Physical Address (GPA) is mapped to Host Virtual Addess (HVA) by 'memory slots'
 // For example, a kvm instance has 3 memory slots:
@@ -38,6 +94,8 @@ struct interact_sample
 // |  0x400000  |  0x7f0000800000  |  32768  |
 // |  0x900000  |  0x7f0001200000  |    160  |
 // so GPA = 0x412345 is in the second slot, and mapped to HVA = 0x7f0000812345
+// Only slots of the normal address space are returned. Its layout is kept as it is, as
+// binaries built before GET_MEMSLOTS_EX still use it.
 struct interact_get_memslots
 {
     struct interact_memslot
@@ -51,12 +109,52 @@ struct interact_get_memslots
     size_t count;           // the actual count of the array (output)
 };
 
+// the argument of GET_MEMSLOTS_EX command, the same as GET_MEMSLOTS, but slots of all
+// address spaces are returned, the normal one (as_id = 0) at first, together with their
+// generation. Slots of other address spaces (e.g. SMM) overlay the normal ones.
+struct interact_get_memslots_ex
+{
+    struct interact_memslot_ex
+    {
+        uint64_t gpa;       // the base GPA
+        uint64_t hva;       // the base HVA
+        size_t page_count;  // count of pages in the slot
+        uint32_t as_id;     // the address space of the slot
+        uint32_t id;        // the id of the slot in its address space
+    }*
+    memslots;               // the array of slots (output)
+    size_t capacity;        // the max count of the array (input)
+    size_t count;           // the actual count of the array (output)
+    uint64_t generation;    // the generation of the slots (output)
+};
+
+// the argument of GET_WSS command
+// In WSS mode (see 'sampler_set_wss()'), a record of working-set-size is appended to the
+// history at the end of every interval, and GET_WSS takes the oldest records out.
+struct interact_get_wss
+{
+    struct sampler_wss* records;    // the array of records (output)
+    size_t capacity;        // the max count of the array (input)
+    size_t count;           // the actual count of the array (output)
+};
+
+// the argument of SET_SWEEP_CPUS command
+// The mask is laid out like 'cpu_set_t' of sched_setaffinity(), i.e. bit n is CPU n.
+// CPUs beyond 'size' are not allowed, and a NULL 'mask' restores the default.
+struct interact_sweep_cpus
+{
+    unsigned long* mask;    // the bitmap of allowed CPUs (input)
+    size_t size;            // the size of 'mask' in bytes (input)
+};
+
 int interact_open(struct inode* inode, struct file* file);
 
 long interact_ioctl(struct file* file, unsigned int cmd, unsigned long arg);
 
 ssize_t interact_read(struct file* file, char* buffer, size_t capacity, loff_t* offset);
 
+unsigned int interact_poll(struct file* file, poll_table* wait);
+
 int interact_release(struct inode* inode, struct file* file);
 
 #endif
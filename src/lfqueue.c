@@ -0,0 +1,157 @@
+#include "lfqueue.h"
+
+#define LOAD_ACQUIRE(ptr)           __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(ptr, val)     __atomic_store_n((ptr), (val), __ATOMIC_RELEASE)
+
+int lfqueue_init(struct lfqueue* queue, size_t entry_size, size_t page_size,
+    void* (*func_alloc_page)(void* privdata),
+    void (*func_free_page)(void* page, void* privdata),
+    void* privdata)
+{
+    struct lfqueue_node* node;
+    assert(queue);
+    if(unlikely(!(queue->entry_size = entry_size)))
+        ERROR0(-EINVAL, "param <entry_size = 0> is not allowed");
+    if(unlikely(page_size < sizeof(struct lfqueue_node) + entry_size))
+        ERROR1(-EINVAL, "param <page_size = %lu> is too small", page_size);
+    queue->entry_per_page = (page_size - sizeof(struct lfqueue_node)) / entry_size;
+    if(unlikely(!(queue->func_alloc_page = func_alloc_page)))
+        ERROR0(-EINVAL, "param <func_alloc_page = NULL> is not allowed");
+    if(unlikely(!(queue->func_free_page = func_free_page)))
+        ERROR0(-EINVAL, "param <func_free_page = NULL> is not allowed");
+    queue->privdata = privdata;
+    if(unlikely(!(node = func_alloc_page(privdata))))
+        ERROR0(-ENOMEM, "func_alloc_page(privdata) failed");
+    node->next = NULL;
+    node->head = 0;
+    node->tail = 0;
+    queue->first = queue->last = node;
+    queue->taken = queue->added = 0;
+    queue->pages_freed = 0;
+    queue->pages_allocated = 1;
+    return 0;
+}
+
+void* lfqueue_add(struct lfqueue* queue)
+{
+    struct lfqueue_node* last;
+    assert(queue);
+    last = queue->last;
+    assert(last);
+    // only the producer writes 'tail', so a plain read is enough
+    if(likely(last->tail < queue->entry_per_page))
+        return (char*)last + sizeof(struct lfqueue_node) + queue->entry_size * last->tail;
+    if(unlikely(!(last = queue->func_alloc_page(queue->privdata))))
+        ERROR0(NULL, "queue->func_alloc_page(queue->privdata) failed");
+    last->next = NULL;
+    last->head = 0;
+    last->tail = 0;
+    STORE_RELEASE(&(queue->pages_allocated), queue->pages_allocated + 1);
+    // the consumer may free the full node as soon as it sees 'next',
+    // so never touch the old node after this store
+    STORE_RELEASE(&(queue->last->next), last);
+    queue->last = last;
+    return (char*)last + sizeof(struct lfqueue_node);
+}
+
+void lfqueue_commit(struct lfqueue* queue)
+{
+    struct lfqueue_node* last;
+    assert(queue);
+    last = queue->last;
+    assert(last);
+    assert(last->tail < queue->entry_per_page);
+    // the entry must be written before the consumer sees the new 'tail'
+    STORE_RELEASE(&(last->tail), last->tail + 1);
+    STORE_RELEASE(&(queue->added), queue->added + 1);
+}
+
+static void* generic_get_head(struct lfqueue* queue, int remove)
+{
+    struct lfqueue_node* first = queue->first;
+    size_t head;
+    void* entry;
+    assert(first);
+    head = first->head;
+    assert(head <= queue->entry_per_page);
+    if(unlikely(head == queue->entry_per_page))
+    {
+        struct lfqueue_node* next = LOAD_ACQUIRE(&(first->next));
+        if(!next)
+            return NULL;
+        // the producer has moved to 'next' and never comes back, so it's safe to free
+        queue->first = next;
+        queue->func_free_page(first, queue->privdata);
+        STORE_RELEASE(&(queue->pages_freed), queue->pages_freed + 1);
+        first = next;
+        head = 0;
+    }
+    if(head == LOAD_ACQUIRE(&(first->tail)))
+        return NULL;
+    entry = (char*)first + sizeof(struct lfqueue_node) + queue->entry_size * head;
+    if(remove)
+    {
+        first->head = head + 1;
+        STORE_RELEASE(&(queue->taken), queue->taken + 1);
+    }
+    return entry;
+}
+
+void* lfqueue_take(struct lfqueue* queue)
+{
+    assert(queue);
+    return generic_get_head(queue, 1);
+}
+
+void* lfqueue_glance(struct lfqueue* queue)
+{
+    assert(queue);
+    return generic_get_head(queue, 0);
+}
+
+size_t lfqueue_length(struct lfqueue* queue)
+{
+    size_t taken, added;
+    assert(queue);
+    // read 'taken' first, so that 'added' is never older than it
+    taken = LOAD_ACQUIRE(&(queue->taken));
+    added = LOAD_ACQUIRE(&(queue->added));
+    return added >= taken ? added - taken : 0;
+}
+
+size_t lfqueue_page_count(struct lfqueue* queue)
+{
+    size_t freed, allocated;
+    assert(queue);
+    freed = LOAD_ACQUIRE(&(queue->pages_freed));
+    allocated = LOAD_ACQUIRE(&(queue->pages_allocated));
+    return allocated >= freed ? allocated - freed : 0;
+}
+
+void lfqueue_deinit(struct lfqueue* queue, void (*destructor)(void* value))
+{
+    struct lfqueue_node* node;
+    assert(queue);
+    node = queue->first;
+    while(node)
+    {
+        struct lfqueue_node* next = node->next;
+        assert(node->head <= node->tail);
+        if(destructor)
+        {
+            size_t i = node->head;
+            char* value = (char*)node + sizeof(struct lfqueue_node) + queue->entry_size * i;
+            for(; i < node->tail; i++)
+            {
+                destructor(value);
+                value += queue->entry_size;
+            }
+        }
+        queue->taken += node->tail - node->head;
+        queue->func_free_page(node, queue->privdata);
+        queue->pages_freed++;
+        node = next;
+    }
+    assert(queue->taken == queue->added);
+    assert(queue->pages_freed == queue->pages_allocated);
+}
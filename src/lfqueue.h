@@ -0,0 +1,79 @@
+#ifndef LFQUEUE_H
+#define LFQUEUE_H
+
+#include "common.h"
+
+// A lock-free single-producer single-consumer variant of 'struct queue'.
+// It keeps the same page-linked layout, but the producer only touches 'last' and the
+// tail of the last node, while the consumer only touches 'first' and the head of the
+// first node, so one producer can fill it while one consumer drains it without a lock.
+// To support many producers, give each producer its own lfqueue (e.g. one per CPU).
+
+// a node in lfqueue
+struct lfqueue_node
+{
+    struct lfqueue_node* next;  // next node, published by the producer
+    size_t head;    // the head position in this node, owned by the consumer
+    size_t tail;    // the tail position in this node, published by the producer
+};
+
+struct lfqueue
+{
+    // constants, keep unchange after init
+    size_t entry_size;      // size of user entry in this queue
+    size_t entry_per_page;  // how many entries in a node (one page is one node)
+    void* (*func_alloc_page)(void* privdata);   // the function to allocate a page
+    void (*func_free_page)(void* page, void* privdata); // the function to free a page
+    void* privdata;         // the privdata to the two functions above
+
+    // consumer side
+    struct lfqueue_node* first __attribute__((aligned(CACHELINE_SIZE)));   // the first node
+    size_t taken;           // how many entries have been taken
+    size_t pages_freed;     // how many pages have been freed
+
+    // producer side
+    struct lfqueue_node* last __attribute__((aligned(CACHELINE_SIZE)));    // the last node
+    size_t added;           // how many entries have been added
+    size_t pages_allocated; // how many pages have been allocated
+};
+
+// init
+//      entry_size: size of of user's element, sizeof(struct user_ele)
+//      page_size: size of a memory page, usually 4096
+//      func_alloc_page: the function to allocate a page
+//      func_free_page: the function to free a page
+//      privdata: user's privdata to the two functions above
+// return 0 if succeed, or error code if failed.
+int lfqueue_init(struct lfqueue* queue, size_t entry_size, size_t page_size,
+    void* (*func_alloc_page)(void* privdata),
+    void (*func_free_page)(void* page, void* privdata),
+    void* privdata);
+
+// (producer) reserve an entry at the tail of the queue
+// the entry is invisible to the consumer until lfqueue_commit() is called
+// return the pointer of the new entry, or NULL if no memory
+void* lfqueue_add(struct lfqueue* queue);
+
+// (producer) publish the entry reserved by the latest lfqueue_add()
+void lfqueue_commit(struct lfqueue* queue);
+
+// (consumer) take an entry from the head of the queue
+// the entry keeps valid until the next call of lfqueue_take() or lfqueue_glance()
+// return the pointer of the poped entry, or NULL if the queue is empty
+void* lfqueue_take(struct lfqueue* queue);
+
+// (consumer) glance at the head of the queue, but not remove it
+// return the pointer of the first entry, or NULL if the queue is empty
+void* lfqueue_glance(struct lfqueue* queue);
+
+// (any) how many entries in the queue, may be stale when racing with the other side
+size_t lfqueue_length(struct lfqueue* queue);
+
+// (any) how many pages used, may be stale when racing with the other side
+size_t lfqueue_page_count(struct lfqueue* queue);
+
+// release the resources, no producer or consumer may be running
+//      destructor: the destructor to destroy every element, or NULL
+void lfqueue_deinit(struct lfqueue* queue, void (*destructor)(void* value));
+
+#endif
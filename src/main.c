@@ -4,18 +4,32 @@
 #include <linux/fs.h>
 #include <linux/module.h>
 #include <linux/proc_fs.h>
+#include <linux/version.h>
 
 #define MODULE_NAME     "kvm_ept_sample"
 #define MODULE_PROT     0666
 
+// proc entries take 'struct proc_ops' since 5.6
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
+static struct proc_ops fops =
+{
+    .proc_open = interact_open,
+    .proc_ioctl = interact_ioctl,
+    .proc_read = interact_read,
+    .proc_poll = interact_poll,
+    .proc_release = interact_release,
+};
+#else
 static struct file_operations fops =
 {
     .owner = THIS_MODULE,
     .open = interact_open,
     .unlocked_ioctl = interact_ioctl,
     .read = interact_read,
+    .poll = interact_poll,
     .release = interact_release,
 };
+#endif
 
 static int init(void)
 {
@@ -1,79 +1,61 @@
 #include "common.h"
+#include "compat.h"
 #include "sampler.h"
 
+#include <linux/hash.h>
+#include <linux/slab.h>
+#include <linux/version.h>
+#include <linux/ktime.h>
+#include <linux/bitmap.h>
 #include <linux/fdtable.h>
+#include <linux/vmalloc.h>
+#ifdef SAMPLER_LATENCY
+#include <linux/percpu.h>
+#include <asm/msr.h>
+#endif
 
 #define INTERVAL_DELTA(hz_delta)    ((hz_delta) / 1000)
 #define INIT_INTERVAL(hz)           (1000 * HZ / (hz))
 
+// take the kvm of a file if it's a KVM VM, called by iterate_fd() under the lock of the files
+static int match_kvm_file(const void* data, struct file* file, unsigned int fd)
+{
+    struct kvm** kvmp = (struct kvm**)data;
+    char buffer[32];
+    char* fname = d_path(&(file->f_path), buffer, sizeof(buffer));
+    if(fname < buffer || fname >= buffer + sizeof(buffer))
+        return 0;
+    if(strcmp(fname, "anon_inode:kvm-vm") != 0)
+        return 0;
+    (*kvmp) = file->private_data;
+    assert(*kvmp);
+    kvm_get_kvm(*kvmp);
+    return 1;
+}
+
 static int get_kvm_by_vpid(pid_t nr, struct kvm** kvmp)
 {
-    struct pid* pid;
     struct task_struct* task;
-    struct files_struct* files;
-    int fd, max_fds;
     struct kvm* kvm = NULL;
     rcu_read_lock();
-    if(!(pid = find_vpid(nr)))
-    {
-        rcu_read_unlock();
-        ERROR1(-ESRCH, "no such process whose pid = %d", nr);
-    }
-    if(!(task = pid_task(pid, PIDTYPE_PID)))
-    {
-        rcu_read_unlock();
-        ERROR1(-ESRCH, "no such process whose pid = %d", nr);
-    }
-    files = task->files;
-    max_fds = files_fdtable(files)->max_fds;
-    for(fd = 0; fd < max_fds; fd++)
-    {
-        struct file* file;
-        char buffer[32];
-        char* fname;
-        if(!(file = fcheck_files(files, fd)))
-            continue;
-        fname = d_path(&(file->f_path), buffer, sizeof(buffer));
-        if(fname < buffer || fname >= buffer + sizeof(buffer))
-            continue;
-        if(strcmp(fname, "anon_inode:kvm-vm") == 0)
-        {
-            kvm = file->private_data;
-            assert(kvm);
-            kvm_get_kvm(kvm);
-            break;
-        }
-    }
+    task = pid_task(find_vpid(nr), PIDTYPE_PID);
+    if(task)
+        get_task_struct(task);
     rcu_read_unlock();
+    if(!task)
+        ERROR1(-ESRCH, "no such process whose pid = %d", nr);
+    // iterate_fd() is the stable API to look up files across kernels
+    task_lock(task);
+    if(task->files)
+        iterate_fd(task->files, 0, match_kvm_file, &kvm);
+    task_unlock(task);
+    put_task_struct(task);
     if(!kvm)
         ERROR1(-EINVAL, "process (pid = %d) has no kvm", nr);
     (*kvmp) = kvm;
     return 0;
 }
 
-static int get_ept_root(struct kvm* kvm, uint64_t** rootp)
-{
-    uint64_t root = 0;
-    int i, vcpu_count = atomic_read(&(kvm->online_vcpus));
-    for(i = 0; i < vcpu_count; i++)
-    {
-        struct kvm_vcpu* vcpu = kvm_get_vcpu(kvm, i);
-        uint64_t root_of_vcpu;
-        if(!vcpu)
-            ERROR2(-ENXIO, "vcpu[%d] of process (pid = %d) is uncreated",
-                i, kvm->userspace_pid);
-        if(!(root_of_vcpu = vcpu->arch.mmu.root_hpa))
-            ERROR1(-EINVAL, "vcpu[%d] is uninitialized", i);
-        if(!root)
-            root = root_of_vcpu;
-        else if(root != root_of_vcpu)
-            ERROR2(-EFAULT, "ept root of vcpu[%d] is %llx, different from other vcpus'",
-                i, root_of_vcpu);
-    }
-    (*rootp) = root ? (uint64_t*)__va(root) : NULL;
-    return 0;
-}
-
 static void update_interval(struct sampler* sampler)
 {
     unsigned long current_time = jiffies, time_delta, hz, interval_delta;
@@ -99,61 +81,7 @@ static void update_interval(struct sampler* sampler)
     sampler->adapter.triggers = 0;
 }
 
-#define EPT_PUD_ROOT(pgd)                                       \
-({                                                              \
-    uint64_t pgd_val = (pgd);                                   \
-    uint64_t pud_root = pgd_val & (uint64_t)0xfffffffff000;     \
-    pud_root ? (uint64_t*)__va(pud_root) : NULL;                \
-})
-
-#define EPT_PMD_ROOT(pud)                                       \
-({                                                              \
-    uint64_t pud_val = (pud);                                   \
-    uint64_t pmd_root = 0;                                      \
-    if(!(pud_val & 0x80))                                       \
-        pmd_root = pud_val & (uint64_t)0xfffffffff000;          \
-    pmd_root ? (uint64_t*)__va(pmd_root) : NULL;                \
-})
-
-#define EPT_WALK_TO_PMD(ept_root, action)                       \
-({                                                              \
-    uint64_t *pgds = (ept_root), *puds, *pmds, *pmdp;           \
-    int i, j, k;                                                \
-    for(i = 0; i < 512; i++)                                    \
-    {                                                           \
-        if(!(puds = EPT_PUD_ROOT(pgds[i])))                     \
-            continue;                                           \
-        for(j = 0; j < 512; j++)                                \
-        {                                                       \
-            if(!(pmds = EPT_PMD_ROOT(puds[j])))                 \
-                continue;                                       \
-            for(k = 0; k < 512; k++)                            \
-            {                                                   \
-                pmdp = pmds + k;                                \
-                (action);                                       \
-            }                                                   \
-        }                                                       \
-    }                                                           \
-})
-
-static void set_landmine_on_ept(struct timer_list* timer)
-{
-    struct sampler* sampler = container_of(timer, struct sampler, timer);
-    uint64_t prot_mask = ~(sampler->prot_mask);
-    EPT_WALK_TO_PMD(sampler->ept_root,
-    ({
-        uint64_t pmd_val = (*pmdp);
-        if(pmd_val)
-            __sync_bool_compare_and_swap(pmdp, pmd_val, pmd_val & prot_mask);
-    }));
-    update_interval(sampler);
-    sampler->timer.expires += sampler->adapter.interval;
-    add_timer(&(sampler->timer));
-}
-
-#define EPT_PGD_INDEX(addr)     (((addr) >> 39) & 0x1ff)
-#define EPT_PUD_INDEX(addr)     (((addr) >> 30) & 0x1ff)
-#define EPT_PMD_INDEX(addr)     (((addr) >> 21) & 0x1ff)
+#define EPT_REGION(addr)        ((addr) >> 21)
 
 #define EPT_VIOLATION_ACC_READ      (1 << 0)
 #define EPT_VIOLATION_ACC_WRITE     (1 << 1)
@@ -161,37 +89,459 @@ static void set_landmine_on_ept(struct timer_list* timer)
 #define EPT_VIOLATION_ACC_ALL       (EPT_VIOLATION_ACC_READ | EPT_VIOLATION_ACC_WRITE | \
                                         EPT_VIOLATION_ACC_INSTR)
 
-#define EPT_PROT_READ   (1 << 0)
-#define EPT_PROT_WRITE  (1 << 1)
-#define EPT_PROT_EXEC   (1 << 2)
-#define EPT_PROT_UEXEC  (1 << 10)
-#define EPT_PROT_ALL    (EPT_PROT_READ | EPT_PROT_WRITE | EPT_PROT_EXEC | EPT_PROT_UEXEC)
+// A record of a region holds the permission a sweep stripped from its entry, and the key of
+// the entry. Only recorded permission is restored, as KVM strips some by itself, e.g. X of
+// NX huge pages against iTLB multihit, and W for write-protection and dirty logging.
+#define RECORD_PROT_BITS        4
+#define RECORD_PROT(record)     ((record) & ((1 << RECORD_PROT_BITS) - 1))
+#define RECORD_KEY(record)      ((record) >> RECORD_PROT_BITS)
 
-static int on_ept_sample(struct kvm* kvm, unsigned long gpa, unsigned long code)
+// EPT_PROT_* to the bits of a record
+static uint32_t to_record_prot(uint64_t prot)
 {
-    struct sampler* sampler = kvm->ept_sample_privdata;
-    uint64_t *pgds, *puds, *pmds, *pmdp, pmd_val;
-    if(!sampler)
-        return 0;
-    pgds = sampler->ept_root;
-    if(!(puds = EPT_PUD_ROOT(pgds[EPT_PGD_INDEX(gpa)])))
-        return 0;
-    if(!(pmds = EPT_PMD_ROOT(puds[EPT_PUD_INDEX(gpa)])))
+    return (prot & 7) | ((prot & EPT_PROT_UEXEC) ? 8 : 0);
+}
+
+// the bits of a record to EPT_PROT_*
+static uint64_t from_record_prot(uint32_t prot)
+{
+    return (prot & 7) | ((prot & 8) ? EPT_PROT_UEXEC : 0);
+}
+
+// a key telling an entry from another one KVM may replace it with, in a rebuilt table or
+// pointing to another frame, whose permission is KVM's own
+static uint32_t get_entry_key(uint64_t entry, unsigned long table)
+{
+    return hash_64((entry & (EPT_ADDR_MASK | EPT_LARGE)) ^ ((uint64_t)table << 52),
+        32 - RECORD_PROT_BITS);
+}
+
+// is dirty logging enabled on the memslot of a GFN, called inside kvm->srcu
+static int is_dirty_tracked(struct kvm* kvm, gfn_t gfn)
+{
+    struct kvm_memory_slot* memslot = gfn_to_memslot(kvm, gfn);
+    return memslot && COMPAT_SLOT_DIRTY_TRACKED(memslot);
+}
+
+struct restore
+{
+    struct kvm* kvm;
+    struct sampler_records* records;
+    uint64_t needed;    // the permission to restore if it's recorded
+    gfn_t gfn;          // the region of 'restored'
+    uint64_t restored;  // the permission taken from the record of the region (output)
+    int deferred;       // is W taken from the record but left to KVM (output)
+};
+
+// restore the recorded permission of a region that is in 'needed' and still stripped
+// The entry changed after the permission is taken gets it as well, unless KVM has replaced it.
+// W of a memslot under dirty logging is dropped from the record but never restored, as KVM
+// may have write-protected the entry since the sweep without noticing, e.g. a huge leaf in
+// the manual-protect mode, so only the fault path of KVM may make it writable, which logs
+// the write.
+static uint64_t restore_region(uint64_t entry, unsigned long table, gfn_t gfn, void* data)
+{
+    struct restore* restore = data;
+    unsigned long region = gfn / EPT_REGION_PAGES;
+    uint32_t key = get_entry_key(entry, table), record, taken;
+    uint32_t* recordp;
+    if(region >= restore->records->count)
+        return entry;
+    recordp = restore->records->records + region;
+    if(restore->restored && restore->gfn == gfn)
+        return RECORD_KEY(READ_ONCE(*recordp)) == key ? entry | restore->restored : entry;
+    restore->gfn = gfn;
+    restore->restored = 0;
+    do
+    {
+        record = READ_ONCE(*recordp);
+        if(RECORD_KEY(record) != key)
+            return entry;
+        if(!(taken = RECORD_PROT(record) & to_record_prot(restore->needed & ~entry)))
+            return entry;
+    }
+    while(cmpxchg(recordp, record, record & ~taken) != record);
+    if((taken & to_record_prot(EPT_PROT_WRITE)) && is_dirty_tracked(restore->kvm, gfn))
+    {
+        taken &= ~to_record_prot(EPT_PROT_WRITE);
+        restore->deferred = 1;
+    }
+    restore->restored = from_record_prot(taken);
+    return entry | restore->restored;
+}
+
+// restore the recorded permission of regions in GFNs [start, end), called inside kvm->srcu
+static void restore_regions(struct sampler* sampler, struct sampler_records* records,
+    gfn_t start, gfn_t end)
+{
+    struct restore restore = {sampler->kvm, records, EPT_PROT_ALL, 0, 0, 0};
+    if(records)
+        ept_update(&(sampler->ept), start, end, restore_region, &restore);
+}
+
+// called with sweeps stopped
+static void restore_all(struct sampler* sampler)
+{
+    int srcu_index = srcu_read_lock(&(sampler->kvm->srcu));
+    restore_regions(sampler, rcu_dereference_protected(sampler->records, 1), 0, EPT_GFN_LIMIT);
+    srcu_read_unlock(&(sampler->kvm->srcu), srcu_index);
+}
+
+struct arm
+{
+    struct sampler_records* records;
+    uint64_t prot_mask; // the permission to strip
+};
+
+// arm a region by stripping the permission in 'prot_mask' that it still has
+// Permission KVM has stripped by itself is not recorded, and permission recorded before and
+// still stripped is kept, as the region may not have triggered since the previous sweep.
+static uint64_t arm_region(uint64_t entry, unsigned long table, gfn_t gfn, void* data)
+{
+    struct arm* arm = data;
+    unsigned long region = gfn / EPT_REGION_PAGES;
+    uint32_t key = get_entry_key(entry, table), record, armed;
+    uint64_t strip = entry & arm->prot_mask;
+    uint32_t* recordp;
+    // regions of memslots added since the records are sized are armed at the next sweep
+    if(region >= arm->records->count)
+        return entry;
+    recordp = arm->records->records + region;
+    do
+    {
+        record = READ_ONCE(*recordp);
+        armed = RECORD_KEY(record) == key ? RECORD_PROT(record) & ~to_record_prot(entry) : 0;
+        armed |= to_record_prot(strip);
+    }
+    while(cmpxchg(recordp, record, (key << RECORD_PROT_BITS) | armed) != record);
+    return entry & ~strip;
+}
+
+// arm all present regions
+// return the count of present regions
+static unsigned long arm_all(struct sampler* sampler, uint64_t prot_mask)
+{
+    struct arm arm = {rcu_dereference_protected(sampler->records, 1), prot_mask};
+    return ept_update(&(sampler->ept), 0, EPT_GFN_LIMIT, arm_region, &arm);
+}
+
+static unsigned long get_region_count(struct kvm* kvm)
+{
+    struct kvm_memory_slot* memslot;
+    gfn_t gfn_limit = 0;
+    int bkt __maybe_unused;
+    int srcu_index = srcu_read_lock(&(kvm->srcu));
+    COMPAT_FOR_EACH_MEMSLOT(memslot, bkt, kvm_memslots(kvm))
+        gfn_limit = MAX2(gfn_limit, memslot->base_gfn + memslot->npages);
+    srcu_read_unlock(&(kvm->srcu), srcu_index);
+    return DIV_ROUND_UP(gfn_limit, EPT_REGION_PAGES);
+}
+
+// grow the records to cover all memslots, called by sweeps only
+// Updates of the old records after they are copied are lost. A lost restore only leaves
+// permission recorded that the entry has again, which is never taken.
+static void reserve_records(struct sampler* sampler)
+{
+    struct sampler_records* old = rcu_dereference_protected(sampler->records, 1);
+    struct sampler_records* records;
+    unsigned long count = get_region_count(sampler->kvm);
+    if(old && old->count >= count)
+        return;
+    // keep arming the old regions if it fails, and try again at the next sweep
+    if(!(records = vzalloc(sizeof(struct sampler_records) + sizeof(uint32_t) * count)))
+        return;
+    records->count = count;
+    if(old)
+        memcpy(records->records, old->records, sizeof(uint32_t) * old->count);
+    rcu_assign_pointer(sampler->records, records);
+    // EPT violations read the records inside kvm->srcu
+    synchronize_srcu(&(sampler->kvm->srcu));
+    vfree(old);
+}
+
+static void push_wss(struct sampler* sampler, struct sampler_wss* wss)
+{
+    size_t tail;
+    spin_lock(&(sampler->wss.history_lock));
+    tail = (sampler->wss.history_head + sampler->wss.history_count) % SAMPLER_WSS_HISTORY;
+    sampler->wss.history[tail] = (*wss);
+    if(sampler->wss.history_count < SAMPLER_WSS_HISTORY)
+        sampler->wss.history_count++;
+    else    // overwrite the oldest one
+        sampler->wss.history_head = (sampler->wss.history_head + 1) % SAMPLER_WSS_HISTORY;
+    spin_unlock(&(sampler->wss.history_lock));
+}
+
+static void sweep_wss(struct sampler* sampler)
+{
+    unsigned long current_time = jiffies, present;
+    struct sampler_wss wss;
+    int type;
+    // finish the current interval
+    wss.time = ktime_to_ms(ktime_get_real());
+    wss.interval = jiffies_to_msecs(current_time - sampler->wss.start);
+    wss.present = sampler->wss.present;
+    wss.reserved = 0;
+    // Clear bits before taking counts, so a region still armed and triggered in between is
+    // counted in the finished interval. Were it the other way round, the region would bump
+    // the new count, lose its bit, and be counted again after re-arming.
+    for(type = 0; type < SAMPLER_WSS_TYPES; type++)
+    {
+        bitmap_zero(sampler->wss.bitmaps[type], sampler->wss.region_count);
+        smp_mb();
+        wss.counts[type] = __sync_lock_test_and_set(&(sampler->wss.counts[type]), 0);
+    }
+    // no interval is finished at the first sweep
+    if(sampler->wss.present)
+        push_wss(sampler, &wss);
+    // start a new interval by arming all present regions
+    present = arm_all(sampler, EPT_PROT_ALL);
+    sampler->wss.present = present;
+    sampler->wss.start = current_time;
+}
+
+static void count_wss(struct sampler* sampler, int type, unsigned long region)
+{
+    if(!test_and_set_bit(region, sampler->wss.bitmaps[type]))
+        __sync_fetch_and_add(&(sampler->wss.counts[type]), 1);
+}
+
+// the permission to restore upon a trigger
+// In WSS mode, only the permission needed by the access is restored, so that a region
+// read at first can still be counted when it's written later.
+// As EPT doesn't allow write-only, a write restores read as well.
+static uint64_t get_restore_mask(struct sampler* sampler, unsigned long code)
+{
+    if(!sampler->wss.interval)
+        return EPT_PROT_ALL;
+    if(code & EPT_VIOLATION_ACC_WRITE)
+        return EPT_PROT_READ | EPT_PROT_WRITE;
+    if(code & EPT_VIOLATION_ACC_INSTR)
+        return EPT_PROT_READ | EPT_PROT_EXEC | EPT_PROT_UEXEC;
+    return EPT_PROT_READ;
+}
+
+static void on_wss_sample(struct sampler* sampler, unsigned long gpa, unsigned long code)
+{
+    unsigned long region = EPT_REGION(gpa);
+    // regions of memslots added after WSS mode starts are not counted
+    if(region < sampler->wss.region_count)
+    {
+        count_wss(sampler, SAMPLER_WSS_READ, region);
+        if(code & EPT_VIOLATION_ACC_WRITE)
+            count_wss(sampler, SAMPLER_WSS_WRITE, region);
+        if(code & EPT_VIOLATION_ACC_INSTR)
+            count_wss(sampler, SAMPLER_WSS_EXEC, region);
+    }
+}
+
+static uint64_t get_memslots_generation(struct kvm* kvm)
+{
+    uint64_t generation = 0;
+    int as_id, srcu_index = srcu_read_lock(&(kvm->srcu));
+    // every generation only grows, so does the sum
+    for(as_id = 0; as_id < KVM_ADDRESS_SPACE_NUM; as_id++)
+        generation += COMPAT_MEMSLOTS_GENERATION(__kvm_memslots(kvm, as_id));
+    srcu_read_unlock(&(kvm->srcu), srcu_index);
+    return generation;
+}
+
+#ifdef SAMPLER_LATENCY
+// count a latency since 'start' in the histogram of this CPU
+static void record_latency(struct sampler* sampler, int kind, uint64_t start)
+{
+    uint64_t cycles = rdtsc_ordered() - start;
+    struct sampler_latency* latency = get_cpu_ptr(sampler->latency);
+    latency->counts[kind][cycles ? fls64(cycles) - 1 : 0]++;
+    if(cycles > latency->max[kind])
+        latency->max[kind] = cycles;
+    put_cpu_ptr(sampler->latency);
+}
+#define LATENCY_START()                         rdtsc_ordered()
+#define LATENCY_END(sampler, kind, start)       record_latency(sampler, kind, start)
+#else
+#define LATENCY_START()                         0
+#define LATENCY_END(sampler, kind, start)       do {} while(0)
+#endif
+
+// queue the next sweep on a CPU allowed by 'sweep_cpus', preferring the current one
+// A mask changed at the same time may be read torn, which at worst picks another CPU.
+static void queue_sweep(struct sampler* sampler, unsigned long delay)
+{
+    int cpu = raw_smp_processor_id();
+    if(!cpumask_test_cpu(cpu, sampler->sweep_cpus))
+        cpu = cpumask_any_and(sampler->sweep_cpus, cpu_online_mask);
+    // all allowed CPUs are offline, fall back to the housekeeping CPUs of unbound works
+    if(cpu >= nr_cpu_ids)
+        queue_delayed_work(system_unbound_wq, &(sampler->sweep), delay);
+    else
+        queue_delayed_work_on(cpu, system_wq, &(sampler->sweep), delay);
+}
+
+// sweeps run in a work rather than a timer, as the TDP MMU takes mmu_lock, which is not
+// safe to take in softirq context
+static void set_landmine_on_ept(struct work_struct* work)
+{
+    struct sampler* sampler = container_of(to_delayed_work(work), struct sampler, sweep);
+    uint64_t start __maybe_unused = LATENCY_START();
+    unsigned long current_time;
+    reserve_records(sampler);
+    if(sampler->wss.interval)
+    {
+        sweep_wss(sampler);
+        sampler->next_sweep += sampler->wss.interval;
+    }
+    else
+    {
+        arm_all(sampler, sampler->prot_mask);
+        update_interval(sampler);
+        sampler->next_sweep += sampler->adapter.interval;
+    }
+    sampler->memslots_generation = get_memslots_generation(sampler->kvm);
+    sampler->func_on_sweep(sampler->memslots_generation, sampler->privdata);
+    LATENCY_END(sampler, SAMPLER_LATENCY_SWEEP, start);
+    // don't catch up with sweeps missed, if a sweep takes longer than the interval
+    current_time = jiffies;
+    if(time_before(sampler->next_sweep, current_time))
+        sampler->next_sweep = current_time;
+    queue_sweep(sampler, sampler->next_sweep - current_time);
+}
+
+// get the vCPU in EPT violation on the current CPU
+//  index: the output index of the vCPU in kvm->vcpus
+// return the vCPU, or NULL if no vCPU of 'kvm' is running here
+static struct kvm_vcpu* get_running_vcpu(struct kvm* kvm, int* index)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 7, 0)
+    struct kvm_vcpu* vcpu = kvm_get_running_vcpu();
+    if(!vcpu || vcpu->kvm != kvm)
+        return NULL;
+    (*index) = vcpu->vcpu_idx;
+    return vcpu;
+#else
+    // KVM doesn't record the running vCPU, find it by the current thread
+    struct pid* pid = task_pid(current);
+    int i, vcpu_count = atomic_read(&(kvm->online_vcpus));
+    for(i = 0; i < vcpu_count; i++)
+    {
+        struct kvm_vcpu* vcpu = kvm_get_vcpu(kvm, i);
+        if(vcpu && rcu_access_pointer(vcpu->pid) == pid)
+        {
+            (*index) = i;
+            return vcpu;
+        }
+    }
+    return NULL;
+#endif
+}
+
+// the vCPU in EPT violation holds kvm->srcu, so memslots are safe to read
+// The memslot is looked up in the address space of the vCPU, e.g. SMM while it's in SMM.
+static void annotate_sample(struct sampler* sampler, struct sampler_sample* sample)
+{
+    struct kvm* kvm = sampler->kvm;
+    gfn_t gfn = sample->gpa >> PAGE_SHIFT;
+    struct kvm_memory_slot* memslot;
+    int as_id = 0, index;
+    struct kvm_vcpu* vcpu = get_running_vcpu(kvm, &index);
+    unsigned long pfn;
+    if(vcpu)
+    {
+        as_id = kvm_arch_vcpu_memslots_id(vcpu);
+        memslot = kvm_vcpu_gfn_to_memslot(vcpu, gfn);
+    }
+    else
+        memslot = gfn_to_memslot(kvm, gfn);
+    if(memslot)
+    {
+        sample->hva = __gfn_to_hva_memslot(memslot, gfn);
+        sample->slot = (as_id << 16) | memslot->id;
+    }
+    else
+    {
+        sample->hva = 0;
+        sample->slot = -1;
+    }
+    pfn = ept_get_pfn(&(sampler->ept), gfn);
+    sample->node = pfn && pfn_valid(pfn) ? page_to_nid(pfn_to_page(pfn)) : NUMA_NO_NODE;
+}
+
+// count a trigger of the current vCPU
+// return 1 if the vCPU has run out of its budget of this second, or 0 if not
+static int is_over_budget(struct sampler* sampler, struct kvm* kvm)
+{
+    struct sampler_vcpu* vcpu;
+    unsigned long current_time = jiffies;
+    int index;
+    if(!get_running_vcpu(kvm, &index))
         return 0;
-    pmdp = pmds + EPT_PMD_INDEX(gpa);
-    pmd_val = (*pmdp);
-    if(!pmd_val)
+    vcpu = sampler->vcpus + index;
+    if(current_time - vcpu->window_start >= HZ)
+    {
+        vcpu->window_start = current_time;
+        vcpu->triggers = 0;
+    }
+    return ++(vcpu->triggers) > sampler->vcpu_hz;
+}
+
+static int handle_ept_sample(struct sampler* sampler, struct kvm* kvm, unsigned long gpa,
+    unsigned long code)
+{
+    struct sampler_sample sample;
+    struct sampler_records* records = srcu_dereference(sampler->records, &(kvm->srcu));
+    struct restore restore = {kvm, records, get_restore_mask(sampler, code), 0, 0, 0};
+    gfn_t gfn = gpa >> PAGE_SHIFT;
+    int handled;
+    if(!records)
         return 0;
-    if((pmd_val & EPT_PROT_ALL) == EPT_PROT_ALL)
+    // restore the entry at once, a fault not caused by a landmine restores nothing, and is
+    // left to KVM
+    ept_update(&(sampler->ept), gfn, gfn + 1, restore_region, &restore);
+    if(!restore.restored && !restore.deferred)
         return 0;
-    __sync_bool_compare_and_swap(pmdp, pmd_val, pmd_val | EPT_PROT_ALL);
+    // the sample still counts when W is left to KVM, but KVM handles the fault then
+    handled = !restore.deferred;
+    if(sampler->wss.interval)
+    {
+        on_wss_sample(sampler, gpa, code);
+        return handled;
+    }
+    // Every trigger counts in the frequency, or the adapter would see a rate below the
+    // target, and re-arm the range of a vCPU over its budget even more often.
     __sync_fetch_and_add(&(sampler->adapter.triggers), 1);
-    sampler->func_on_sample(gpa, code & EPT_VIOLATION_ACC_ALL, sampler->privdata);
-    return 1;
+    // a vCPU over its budget is not sampled, and landmines of its 1GB range are cleared,
+    // as it's likely to scan through them
+    if(sampler->vcpu_hz && is_over_budget(sampler, kvm))
+    {
+        gfn &= ~(gfn_t)(EPT_TABLE_PAGES - 1);
+        restore_regions(sampler, records, gfn, gfn + EPT_TABLE_PAGES);
+        return handled;
+    }
+    sample.gpa = gpa;
+    sample.xwr = code & EPT_VIOLATION_ACC_ALL;
+    if(sampler->annotate)
+        annotate_sample(sampler, &sample);
+    sampler->func_on_sample(&sample, sampler->privdata);
+    return handled;
+}
+
+// the vCPU in EPT violation holds kvm->srcu, so the sampler stays till it returns
+static int on_ept_sample(struct kvm* kvm, unsigned long gpa, unsigned long code)
+{
+    struct sampler* sampler = kvm->ept_sample_privdata;
+    uint64_t start __maybe_unused = LATENCY_START();
+    int ret;
+    if(!sampler)
+        return 0;
+    // only violations caused by landmines are counted, others return at once
+    if((ret = handle_ept_sample(sampler, kvm, gpa, code)))
+        LATENCY_END(sampler, SAMPLER_LATENCY_SAMPLE, start);
+    return ret;
 }
 
 int sampler_init(struct sampler* sampler, pid_t pid,
-    void (*func_on_sample)(unsigned long gpa, int xwr, void* privdata),
+    void (*func_on_sample)(const struct sampler_sample* sample, void* privdata),
+    void (*func_on_sweep)(uint64_t memslots_generation, void* privdata),
     void* privdata)
 {
     int ret;
@@ -199,23 +549,57 @@ int sampler_init(struct sampler* sampler, pid_t pid,
     assert(sampler);
     if(!(sampler->func_on_sample = func_on_sample))
         ERROR0(-EINVAL, "param <func_on_sample = NULL> is invalid");
+    if(!(sampler->func_on_sweep = func_on_sweep))
+        ERROR0(-EINVAL, "param <func_on_sweep = NULL> is invalid");
     if((ret = get_kvm_by_vpid(pid, &kvm)))
         ERROR1(ret, "get_kvm_by_vpid(%d, &kvm) failed", pid);
     sampler->kvm = kvm;
-    if((ret = get_ept_root(kvm, &(sampler->ept_root))))
+    if((ret = ept_init(&(sampler->ept), kvm)))
+    {
+        kvm_put_kvm(kvm);
+        ERROR0(ret, "ept_init(&(sampler->ept), kvm) failed");
+    }
+    if(!(sampler->vcpus = kcalloc(KVM_MAX_VCPUS, sizeof(struct sampler_vcpu), GFP_KERNEL)))
+    {
+        kvm_put_kvm(kvm);
+        ERROR0(-ENOMEM, "kcalloc(KVM_MAX_VCPUS, sizeof(struct sampler_vcpu), GFP_KERNEL) failed");
+    }
+    if(!alloc_cpumask_var(&(sampler->sweep_cpus), GFP_KERNEL))
+    {
+        kfree(sampler->vcpus);
+        kvm_put_kvm(kvm);
+        ERROR0(-ENOMEM, "alloc_cpumask_var(&(sampler->sweep_cpus), GFP_KERNEL) failed");
+    }
+#ifdef SAMPLER_LATENCY
+    if(!(sampler->latency = alloc_percpu(struct sampler_latency)))
     {
+        free_cpumask_var(sampler->sweep_cpus);
+        kfree(sampler->vcpus);
         kvm_put_kvm(kvm);
-        ERROR0(ret, "get_ept_root(kvm, &(sampler->ept_root)) failed");
+        ERROR0(-ENOMEM, "alloc_percpu(struct sampler_latency) failed");
     }
+#endif
     if(!__sync_bool_compare_and_swap(&(kvm->on_ept_sample), NULL, on_ept_sample))
     {
+#ifdef SAMPLER_LATENCY
+        free_percpu(sampler->latency);
+#endif
+        free_cpumask_var(sampler->sweep_cpus);
+        kfree(sampler->vcpus);
         kvm_put_kvm(kvm);
         ERROR1(-EIO, "kvm.on_ept_sample in process (pid = %d) has been occupied", pid);
     }
     wmb();
     sampler->prot_mask = EPT_PROT_ALL;
+    sampler->annotate = 0;
     sampler->hz = 0;
-    init_timer_key(&(sampler->timer), set_landmine_on_ept, 0, NULL, NULL);
+    sampler->vcpu_hz = 0;
+    RCU_INIT_POINTER(sampler->records, NULL);
+    INIT_DELAYED_WORK(&(sampler->sweep), set_landmine_on_ept);
+    cpumask_copy(sampler->sweep_cpus, COMPAT_HOUSEKEEPING_CPUMASK());
+    memset(&(sampler->wss), 0, sizeof(sampler->wss));
+    sampler->memslots_generation = get_memslots_generation(kvm);
+    spin_lock_init(&(sampler->wss.history_lock));
     sampler->privdata = privdata;
     wmb();
     assert(!kvm->ept_sample_privdata);
@@ -229,20 +613,188 @@ void sampler_set_prot(struct sampler* sampler, int xwr)
     sampler->prot_mask = xwr & EPT_PROT_ALL;
 }
 
-void sampler_set_freq(struct sampler* sampler, unsigned long hz)
+void sampler_set_annotate(struct sampler* sampler, int annotate)
+{
+    assert(sampler);
+    sampler->annotate = annotate;
+}
+
+void sampler_set_vcpu_budget(struct sampler* sampler, unsigned long hz)
+{
+    assert(sampler);
+    WRITE_ONCE(sampler->vcpu_hz, hz);
+}
+
+int sampler_set_sweep_cpus(struct sampler* sampler, const struct cpumask* cpus)
+{
+    assert(sampler);
+    if(!cpus)
+        cpus = COMPAT_HOUSEKEEPING_CPUMASK();
+    if(!cpumask_intersects(cpus, cpu_online_mask))
+        ERROR0(-EINVAL, "no CPU in the mask is online");
+    // a running sweep moves there when it's queued next time
+    cpumask_copy(sampler->sweep_cpus, cpus);
+    return 0;
+}
+
+int sampler_set_freq(struct sampler* sampler, unsigned long hz)
 {
     assert(sampler);
+    if(sampler->wss.interval && hz != 0)
+        ERROR0(-EBUSY, "WSS mode is running, stop it first");
     if(sampler->hz == 0 && hz != 0)
     {
         sampler->adapter.last_time = jiffies;
         sampler->adapter.triggers = 0;
         sampler->adapter.interval = INIT_INTERVAL(hz);
-        sampler->timer.expires = jiffies;
-        add_timer(&(sampler->timer));
+        sampler->next_sweep = jiffies;
+        queue_sweep(sampler, 0);
     }
     else if(sampler->hz != 0 && hz == 0)
-        del_timer_sync(&(sampler->timer));
+        cancel_delayed_work_sync(&(sampler->sweep));
     sampler->hz = hz;
+    return 0;
+}
+
+static void free_wss_bitmaps(struct sampler* sampler)
+{
+    int type;
+    for(type = 0; type < SAMPLER_WSS_TYPES; type++)
+    {
+        vfree(sampler->wss.bitmaps[type]);
+        sampler->wss.bitmaps[type] = NULL;
+    }
+    sampler->wss.region_count = 0;
+}
+
+static int alloc_wss(struct sampler* sampler)
+{
+    unsigned long region_count = get_region_count(sampler->kvm);
+    int type;
+    if(!sampler->wss.history)
+    {
+        if(!(sampler->wss.history = kmalloc(sizeof(struct sampler_wss) * SAMPLER_WSS_HISTORY,
+            GFP_KERNEL)))
+            ERROR0(-ENOMEM, "kmalloc(<history of WSS>, GFP_KERNEL) failed");
+    }
+    spin_lock_bh(&(sampler->wss.history_lock));
+    sampler->wss.history_head = 0;
+    sampler->wss.history_count = 0;
+    spin_unlock_bh(&(sampler->wss.history_lock));
+    if(sampler->wss.bitmaps[0] && sampler->wss.region_count == region_count)
+    {
+        for(type = 0; type < SAMPLER_WSS_TYPES; type++)
+            bitmap_zero(sampler->wss.bitmaps[type], region_count);
+        return 0;
+    }
+    // wait for EPT violations that may still be counting on old bitmaps
+    synchronize_srcu(&(sampler->kvm->srcu));
+    free_wss_bitmaps(sampler);
+    for(type = 0; type < SAMPLER_WSS_TYPES; type++)
+    {
+        if(!(sampler->wss.bitmaps[type] = vzalloc(BITS_TO_LONGS(region_count) * sizeof(long))))
+        {
+            free_wss_bitmaps(sampler);
+            ERROR1(-ENOMEM, "vzalloc(<bitmap of %lu regions>) failed", region_count);
+        }
+    }
+    sampler->wss.region_count = region_count;
+    return 0;
+}
+
+int sampler_set_wss(struct sampler* sampler, unsigned long interval_ms)
+{
+    int ret, type;
+    assert(sampler);
+    if(sampler->hz)
+        ERROR0(-EBUSY, "sampling is running, stop it first");
+    if(!interval_ms)
+    {
+        if(sampler->wss.interval)
+        {
+            cancel_delayed_work_sync(&(sampler->sweep));
+            // disarm before leaving WSS mode, or armed regions would be reported as samples
+            restore_all(sampler);
+            sampler->wss.interval = 0;
+        }
+        return 0;
+    }
+    if(sampler->wss.interval)
+    {
+        sampler->wss.interval = MAX2(msecs_to_jiffies(interval_ms), 1UL);
+        return 0;
+    }
+    if((ret = alloc_wss(sampler)))
+        ERROR0(ret, "alloc_wss(sampler) failed");
+    sampler->wss.present = 0;
+    sampler->wss.start = jiffies;
+    for(type = 0; type < SAMPLER_WSS_TYPES; type++)
+        sampler->wss.counts[type] = 0;
+    wmb();
+    sampler->wss.interval = MAX2(msecs_to_jiffies(interval_ms), 1UL);
+    sampler->next_sweep = jiffies;
+    queue_sweep(sampler, 0);
+    return 0;
+}
+
+int sampler_take_wss(struct sampler* sampler, struct sampler_wss* wss)
+{
+    int taken = 0;
+    assert(sampler);
+    assert(wss);
+    spin_lock_bh(&(sampler->wss.history_lock));
+    if(sampler->wss.history_count)
+    {
+        (*wss) = sampler->wss.history[sampler->wss.history_head];
+        sampler->wss.history_head = (sampler->wss.history_head + 1) % SAMPLER_WSS_HISTORY;
+        sampler->wss.history_count--;
+        taken = 1;
+    }
+    spin_unlock_bh(&(sampler->wss.history_lock));
+    return taken;
+}
+
+uint64_t sampler_get_memslots_generation(struct sampler* sampler)
+{
+    assert(sampler);
+    return get_memslots_generation(sampler->kvm);
+}
+
+int sampler_get_latency(struct sampler* sampler, struct sampler_latency* latency)
+{
+#ifdef SAMPLER_LATENCY
+    unsigned int cpu;
+    int kind, i;
+    assert(sampler);
+    assert(latency);
+    memset(latency, 0, sizeof(struct sampler_latency));
+    for_each_possible_cpu(cpu)
+    {
+        struct sampler_latency* cpu_latency = per_cpu_ptr(sampler->latency, cpu);
+        for(kind = 0; kind < SAMPLER_LATENCY_KINDS; kind++)
+        {
+            for(i = 0; i < SAMPLER_LATENCY_BUCKETS; i++)
+                latency->counts[kind][i] += READ_ONCE(cpu_latency->counts[kind][i]);
+            latency->max[kind] = MAX2(latency->max[kind], READ_ONCE(cpu_latency->max[kind]));
+        }
+    }
+    return 0;
+#else
+    return -EOPNOTSUPP;
+#endif
+}
+
+int sampler_reset_latency(struct sampler* sampler)
+{
+#ifdef SAMPLER_LATENCY
+    unsigned int cpu;
+    assert(sampler);
+    for_each_possible_cpu(cpu)
+        memset(per_cpu_ptr(sampler->latency, cpu), 0, sizeof(struct sampler_latency));
+    return 0;
+#else
+    return -EOPNOTSUPP;
+#endif
 }
 
 void sampler_deinit(struct sampler* sampler)
@@ -256,12 +808,22 @@ void sampler_deinit(struct sampler* sampler)
     kvm->ept_sample_privdata = NULL;
     wmb();
     kvm->on_ept_sample = NULL;
-    del_timer_sync(&(sampler->timer));
-    EPT_WALK_TO_PMD(sampler->ept_root,
-    ({
-        uint64_t pmd_val = (*pmdp);
-        if(pmd_val)
-            __sync_bool_compare_and_swap(pmdp, pmd_val, pmd_val | EPT_PROT_ALL);
-    }));
+    cancel_delayed_work_sync(&(sampler->sweep));
+    restore_all(sampler);
+    sampler->wss.interval = 0;
+    // wait for EPT violations that may still be using the sampler
+    synchronize_srcu(&(kvm->srcu));
+    free_wss_bitmaps(sampler);
+    kfree(sampler->wss.history);
+    sampler->wss.history = NULL;
+    vfree(rcu_dereference_protected(sampler->records, 1));
+    RCU_INIT_POINTER(sampler->records, NULL);
+    kfree(sampler->vcpus);
+    sampler->vcpus = NULL;
+    free_cpumask_var(sampler->sweep_cpus);
+#ifdef SAMPLER_LATENCY
+    free_percpu(sampler->latency);
+    sampler->latency = NULL;
+#endif
     kvm_put_kvm(kvm);
 }
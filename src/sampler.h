@@ -1,38 +1,126 @@
 #ifndef SAMPLER_H
 #define SAMPLER_H
 
-#include <linux/timer.h>
+#include <linux/cpumask.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
 #include <linux/kvm_host.h>
 
+#include "ept.h"
+
+#define SAMPLER_WSS_READ        0   // regions accessed, by read or write (EPT can't write-only)
+#define SAMPLER_WSS_WRITE       1   // regions written
+#define SAMPLER_WSS_EXEC        2   // regions executed
+#define SAMPLER_WSS_TYPES       3
+
+#define SAMPLER_WSS_HISTORY     1024    // max count of WSS records kept in a sampler
+
+#define SAMPLER_LATENCY_SAMPLE  0   // handling an EPT violation, see 'func_on_sample'
+#define SAMPLER_LATENCY_SWEEP   1   // a sweep setting landmines
+#define SAMPLER_LATENCY_KINDS   2
+
+#define SAMPLER_LATENCY_BUCKETS 64  // bucket i counts latencies of [2^i, 2^(i+1)) TSC cycles
+
+// a sample passed to 'func_on_sample'
+struct sampler_sample
+{
+    unsigned long gpa;  // the Guest Physical Address
+    int xwr;            // an 'or' bitmap of the access type
+    // the following are filled only if annotation is on, see 'sampler_set_annotate()'
+    unsigned long hva;  // the Host Virtual Address, 0 if not in any memslot
+    int slot;           // (as_id << 16) | id of the memslot, -1 if not in any memslot
+    int node;           // the host NUMA node of the backing page, NUMA_NO_NODE if unknown
+};
+
+// the working-set-size of an interval, counted in 2MB regions
+struct sampler_wss
+{
+    uint64_t time;          // the end of the interval, in ms since the Epoch
+    uint32_t interval;      // the length of the interval, in ms
+    uint32_t present;       // count of present regions armed at the start of the interval
+    uint32_t counts[SAMPLER_WSS_TYPES]; // count of distinct triggered regions per access type
+    uint32_t reserved;
+};
+
+// the budget of a vCPU in the current window, see 'sampler_set_vcpu_budget()'
+// Only the vCPU itself touches it, in its EPT violations, so no lock is needed.
+struct sampler_vcpu
+{
+    unsigned long window_start; // the start of the current window of a second, in jiffies
+    unsigned long triggers;     // count of triggered landmines in the window
+};
+
+// what sweeps armed, a record per 2MB region of memslots, see 'arm_region()' in sampler.c
+// Sweeps grow it when memslots grow, and replace it under kvm->srcu.
+struct sampler_records
+{
+    unsigned long count;        // count of regions
+    uint32_t records[];         // (key of the entry << 4) | the permission stripped
+};
+
+// log2 histograms of latencies, see 'sampler_get_latency()'
+struct sampler_latency
+{
+    uint64_t counts[SAMPLER_LATENCY_KINDS][SAMPLER_LATENCY_BUCKETS];
+    uint64_t max[SAMPLER_LATENCY_KINDS];    // the max latency in TSC cycles
+};
+
 // A sampler to sample memory access on EPT
 struct sampler
 {
     struct kvm* kvm;            // the target KVM instance
-    uint64_t* ept_root;         // the pointer to EPT
+    struct ept ept;             // the EPT
+    struct sampler_records __rcu* records;  // what sweeps armed
     uint64_t prot_mask;         // the mask to 'and' on EPT entry to set a landmine
+    int annotate;               // whether to fill HVA, slot and node of samples
 	unsigned long hz;           // the desired frequency to sample
-    struct timer_list timer;    // timmer to set landmines
-    struct                      // a PID algorithm to adjuest the interval of 'timer'
+    struct delayed_work sweep;  // the work to set landmines
+    unsigned long next_sweep;   // the due of the next sweep, in jiffies
+    cpumask_var_t sweep_cpus;   // CPUs allowed to run 'sweep', see 'sampler_set_sweep_cpus()'
+    struct                      // a PID algorithm to adjuest the interval of 'sweep'
     {
         unsigned long last_time;    // last timestamp
         unsigned long triggers;     // count of triggered landmines from 'last_time' to now
-        unsigned long interval;     // the calculated interval for 'timer'
+        unsigned long interval;     // the calculated interval for 'sweep'
     }
     adapter;
-    void (*func_on_sample)(unsigned long gpa, int xwr, void* privdata); // called upon a sample
-    void* privdata;     // the private data passed to 'func_on_sample'
+    unsigned long vcpu_hz;      // the max count of triggers per second of a vCPU, 0 if unlimited
+    struct sampler_vcpu* vcpus; // budgets of vCPUs, indexed like kvm_get_vcpu()
+    struct                      // working-set-size estimation, see 'sampler_set_wss()'
+    {
+        unsigned long interval;     // the interval in jiffies, 0 if WSS mode is off
+        unsigned long start;        // the start of the current interval, in jiffies
+        unsigned long present;      // count of present regions armed in the current interval
+        unsigned long region_count; // count of 2MB regions covered by 'bitmaps'
+        unsigned long* bitmaps[SAMPLER_WSS_TYPES];  // a bit per triggered region
+        unsigned long counts[SAMPLER_WSS_TYPES];    // count of set bits in 'bitmaps'
+        struct sampler_wss* history;    // a ring of records of finished intervals
+        size_t history_head;        // the index of the oldest record in 'history'
+        size_t history_count;       // count of records in 'history'
+        spinlock_t history_lock;    // protect 'history'
+    }
+    wss;
+    uint64_t memslots_generation;   // the memslots generation seen by the latest sweep
+#ifdef SAMPLER_LATENCY
+    struct sampler_latency __percpu* latency;   // per-CPU histograms of latencies
+#endif
+    void (*func_on_sample)(const struct sampler_sample* sample, void* privdata); // upon a sample
+    void (*func_on_sweep)(uint64_t memslots_generation, void* privdata); // called after a sweep
+    void* privdata;     // the private data passed to 'func_on_sample' and 'func_on_sweep'
 };
 
 // init
 //  pid: the pid of the QEMU process using KVM
-//  function_on_sample: a function to be called back upon a sample
-//      gpa: the Guest Physical Address
-//      xwr: an 'or' bitmap of the access type. 'x' = execute, 'w' = write, 'r' = read
+//  function_on_sample: a function to be called back upon a sample, in EPT violation context
+//      sample->xwr: an 'or' bitmap of the access type. 'x' = execute, 'w' = write, 'r' = read
 //          e.g. xwr = 100b means this access is to fetch instructions
-//  privdata: the private data passed to 'func_on_sample'
+//  function_on_sweep: a function to be called back after every sweep, in process context
+//      memslots_generation: see 'sampler_get_memslots_generation()'
+//  privdata: the private data passed to 'func_on_sample' and 'func_on_sweep'
 // return 0 when ok, or a negative error code
 int sampler_init(struct sampler* sampler, pid_t pid,
-    void (*func_on_sample)(unsigned long gpa, int xwr, void* privdata),
+    void (*func_on_sample)(const struct sampler_sample* sample, void* privdata),
+    void (*func_on_sweep)(uint64_t memslots_generation, void* privdata),
     void* privdata);
 
 // set the type of accesses to be sampled
@@ -40,9 +128,58 @@ int sampler_init(struct sampler* sampler, pid_t pid,
 //      e.g. xwr = 110b means both fetchin instructions and writing should be sampled
 void sampler_set_prot(struct sampler* sampler, int xwr);
 
+// set whether to annotate samples with the HVA, the memslot and the host NUMA node
+// They are got from the memslot and the EPT leaf at hand when handling the EPT violation,
+// which saves userspace a memslot lookup and a move_pages() query per sample.
+void sampler_set_annotate(struct sampler* sampler, int annotate);
+
 // set the frequency to sample
 //  hz: the frequency
-void sampler_set_freq(struct sampler* sampler, unsigned long hz);
+// return 0 when ok, or a negative error code
+int sampler_set_freq(struct sampler* sampler, unsigned long hz);
+
+// cap landmines triggered by every vCPU, so that a vCPU sweeping memory can't take most
+// exits while others see none
+// Once a vCPU triggers 'hz' landmines in a second, its next trigger is not sampled, and all
+// landmines of the 1GB range around it are disarmed, so that a sequential scan stops
+// exiting for the rest of the sweep. It costs a lookup of the vCPU per trigger.
+//  hz: the max count of triggers per second of a vCPU, 0 if unlimited
+void sampler_set_vcpu_budget(struct sampler* sampler, unsigned long hz);
+
+// limit the CPUs on which sweeps run, so that sweeps keep off the cores of vCPUs
+// Sweeps run on the housekeeping CPUs (i.e. those not isolated by 'isolcpus=') by default.
+// The on-sweep callback runs within the sweep, so it's limited as well.
+//  cpus: the allowed CPUs, or NULL for the default
+// return 0 when ok, or a negative error code if no CPU of 'cpus' is online
+int sampler_set_sweep_cpus(struct sampler* sampler, const struct cpumask* cpus);
+
+// start or stop the working-set-size (WSS) mode, which can't run together with sampling
+// At the start of every interval, all present 2MB regions are armed in a single sweep,
+// and a region is counted once per access type when it's triggered. At the end of the
+// interval, the counts are appended to the history, and no sample is reported.
+//  interval_ms: the length of an interval in ms, 0 to stop
+// return 0 when ok, or a negative error code
+int sampler_set_wss(struct sampler* sampler, unsigned long interval_ms);
+
+// take the oldest WSS record out of the history
+//  wss: the output record
+// return 1 if a record is taken, or 0 if the history is empty
+int sampler_take_wss(struct sampler* sampler, struct sampler_wss* wss);
+
+// get the generation of memslots, which changes whenever memslots of any address space
+// are changed. It's read under SRCU, so it's safe in any context.
+uint64_t sampler_get_memslots_generation(struct sampler* sampler);
+
+// sum up per-CPU histograms of latencies of handling EPT violations and sweeps
+// They are only kept if the module is built with SAMPLER_LATENCY, which costs two TSC reads
+// per EPT violation. A CPU is summed without stopping it, so the sum may be a little stale.
+//  latency: the output histograms
+// return 0 when ok, or -EOPNOTSUPP if the module is built without SAMPLER_LATENCY
+int sampler_get_latency(struct sampler* sampler, struct sampler_latency* latency);
+
+// clear histograms of latencies, a latency being recorded at the time may be lost
+// return 0 when ok, or -EOPNOTSUPP if the module is built without SAMPLER_LATENCY
+int sampler_reset_latency(struct sampler* sampler);
 
 // deinit
 void sampler_deinit(struct sampler* sampler);